@@ -1,5 +1,17 @@
+
 .section .text.boot
 
+// the image is linked in the upper half but entered at its physical load
+// address with the mmu off, so everything up to higher_half must only use
+// pc-relative addressing
+
+// boot translation: 0-4gb as 1gb normal blocks, reachable both identity
+// mapped through ttbr0 and at KERNEL_VIRT_BASE through ttbr1 (both walks use
+// l0 index 0). vm_init replaces it with the real kernel tables
+.equ BOOT_BLOCK_ATTRS, 0x709        // valid block, attr index normal, inner shareable, af
+.equ BOOT_MAIR_VALUE, 0xFF4400      // device-ngnrne, normal-nc, normal-wbwa
+.equ BOOT_TCR_VALUE, 0x5B5103510   // t0sz = t1sz = 16, 4kb granules, wbwa inner shareable walks, 48-bit ipa
+
 .globl _start
 _start:
     mrs x1, mpidr_el1
@@ -8,18 +20,58 @@ _start:
     b halt
 
 master_core:
-    ldr x1, =_start
+    adr x1, _start
     mov sp, x1
+    // tpidr_el1 holds the current task, none until the scheduler runs
+    msr tpidr_el1, xzr
 
-    ldr x1, =__bss_start
-    ldr w2, =__bss_size
-    cbz w2, done_bss
+    adrp x1, __bss_start
+    add x1, x1, :lo12:__bss_start
+    ldr x2, =__bss_size
+    add x2, x2, #7
+    lsr x2, x2, #3
+    cbz x2, done_bss
 clear_bss:
     str xzr, [x1], #8
-    sub w2, w2, #1
-    cbnz w2, clear_bss
+    sub x2, x2, #1
+    cbnz x2, clear_bss
 done_bss:
 
+    adrp x0, boot_l0_table
+    adrp x1, boot_l1_table
+    orr x2, x1, #3
+    str x2, [x0]
+    mov x2, #BOOT_BLOCK_ATTRS
+    mov x3, #4
+    mov x4, #0x40000000
+map_boot_blocks:
+    str x2, [x1], #8
+    add x2, x2, x4
+    subs x3, x3, #1
+    b.ne map_boot_blocks
+
+    ldr x1, =BOOT_MAIR_VALUE
+    msr mair_el1, x1
+    ldr x1, =BOOT_TCR_VALUE
+    msr tcr_el1, x1
+    msr ttbr0_el1, x0
+    msr ttbr1_el1, x0
+    isb
+    tlbi vmalle1
+    dsb nsh
+    isb
+    mrs x1, sctlr_el1
+    orr x1, x1, #1
+    msr sctlr_el1, x1
+    isb
+
+    ldr x1, =higher_half
+    br x1
+
+higher_half:
+    ldr x1, =_start
+    mov sp, x1
+
     ldr x0, =_dtb_ptr
     ldr x0, [x0]
     bl kernel_main
@@ -28,4 +80,60 @@ halt:
     wfi
     b halt
 
+// secondary cores, started by psci cpu_on with the mmu off and x0 holding the
+// physical address of their smp_boot_args_t. the boot identity map in ttbr0
+// covers the switch to the upper half, after which the core runs on the
+// kernel tables like the boot core
+.equ ARGS_MAIR, 0
+.equ ARGS_TCR, 8
+.equ ARGS_TTBR1, 16
+.equ ARGS_TTBR0, 24
+.equ ARGS_STACK_TOP, 32
+.equ SCTLR_MMU_CACHES, 0x1005       // m, c and i
+
+.globl secondary_entry
+secondary_entry:
+    msr tpidr_el1, xzr
+    ldr x1, [x0, #ARGS_MAIR]
+    msr mair_el1, x1
+    ldr x1, [x0, #ARGS_TCR]
+    msr tcr_el1, x1
+    adrp x1, boot_l0_table
+    msr ttbr0_el1, x1
+    ldr x1, [x0, #ARGS_TTBR1]
+    msr ttbr1_el1, x1
+    isb
+    tlbi vmalle1
+    ic iallu
+    dsb nsh
+    isb
+    mrs x1, sctlr_el1
+    mov x2, #SCTLR_MMU_CACHES
+    orr x1, x1, x2
+    msr sctlr_el1, x1
+    isb
+
+    ldr x1, =secondary_higher_half
+    br x1
+
+secondary_higher_half:
+    ldr x1, =KERNEL_VIRT_BASE
+    add x0, x0, x1
+    ldr x1, [x0, #ARGS_STACK_TOP]
+    mov sp, x1
+    // drop the global identity translations along with the boot tables
+    ldr x1, [x0, #ARGS_TTBR0]
+    msr ttbr0_el1, x1
+    isb
+    tlbi vmalle1
+    dsb nsh
+    isb
+    bl smp_secondary_main
+    b halt
 
+.section .bss
+.balign 4096
+boot_l0_table:
+    .skip 4096
+boot_l1_table:
+    .skip 4096
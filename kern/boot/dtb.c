@@ -209,4 +209,11 @@ int dtb_get_memory_info(uint64_t* mem_start, uint64_t* mem_size) {
     return -1;
 }
 
+int dtb_get_blob_range(uint64_t* dtb_start, uint64_t* dtb_size) {
+    if (!_dtb_base_address) return -1;
 
+    fdt_header_t* header = (fdt_header_t*)_dtb_base_address;
+    *dtb_start = _dtb_base_address;
+    *dtb_size = bswap32(header->totalsize);
+    return 0;
+}
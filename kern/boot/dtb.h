@@ -34,6 +34,7 @@ typedef struct {
 void dtb_init(uint64_t dtb_addr);
 int dtb_get_framebuffer_info(uint64_t* fb_base, uint32_t* fb_width, uint32_t* fb_height, uint32_t* fb_pitch);
 int dtb_get_memory_info(uint64_t* mem_start, uint64_t* mem_size);
+int dtb_get_blob_range(uint64_t* dtb_start, uint64_t* dtb_size);
 const void* dtb_get_property(const char* node_path, const char* prop_name, uint32_t* len);
 uint32_t bswap32(uint32_t val);
 uint64_t bswap64(uint64_t val);
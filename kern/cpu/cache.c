@@ -0,0 +1,64 @@
+#include "cache.h"
+
+#define SCTLR_C (1 << 2)  // data and unified caches
+#define SCTLR_I (1 << 12) // instruction cache
+
+// smallest data cache line in the system; maintenance steps by it so no line is skipped
+static uint32_t dline_size = 64;
+
+void cache_init() {
+    uint64_t ctr;
+    asm volatile("mrs %0, ctr_el0" : "=r"(ctr));
+    // ctr_el0.dminline is log2 of the line size in words
+    dline_size = 4 << ((ctr >> 16) & 0xF);
+}
+
+uint32_t cache_dline_size() {
+    return dline_size;
+}
+
+void cache_clean_range(const void* va, uint64_t size) {
+    uint64_t line = (uint64_t)va & ~(uint64_t)(dline_size - 1);
+    uint64_t end = (uint64_t)va + size;
+    for (; line < end; line += dline_size) {
+        asm volatile("dc cvac, %0" : : "r"(line) : "memory");
+    }
+    asm volatile("dsb sy" : : : "memory");
+}
+
+// lines the range only partly covers are cleaned as well, so data that shares
+// them with the buffer is not thrown away
+void cache_invalidate_range(void* va, uint64_t size) {
+    uint64_t start = (uint64_t)va;
+    uint64_t end = start + size;
+    uint64_t line = start & ~(uint64_t)(dline_size - 1);
+    for (; line < end; line += dline_size) {
+        if (line < start || line + dline_size > end) {
+            asm volatile("dc civac, %0" : : "r"(line) : "memory");
+        } else {
+            asm volatile("dc ivac, %0" : : "r"(line) : "memory");
+        }
+    }
+    asm volatile("dsb sy" : : : "memory");
+}
+
+void cache_clean_invalidate_range(const void* va, uint64_t size) {
+    uint64_t line = (uint64_t)va & ~(uint64_t)(dline_size - 1);
+    uint64_t end = (uint64_t)va + size;
+    for (; line < end; line += dline_size) {
+        asm volatile("dc civac, %0" : : "r"(line) : "memory");
+    }
+    asm volatile("dsb sy" : : : "memory");
+}
+
+// turn on the data and instruction caches; called once the mmu runs on the
+// kernel tables, since normal memory is only cacheable through them
+void cache_enable() {
+    uint64_t sctlr;
+    asm volatile("ic iallu" : : : "memory");
+    asm volatile("dsb nsh" : : : "memory");
+    asm volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
+    sctlr |= SCTLR_C | SCTLR_I;
+    asm volatile("msr sctlr_el1, %0" : : "r"(sctlr) : "memory");
+    asm volatile("isb" : : : "memory");
+}
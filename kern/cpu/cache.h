@@ -0,0 +1,17 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// data cache maintenance by virtual address to the point of coherency, which
+// is where dma masters see memory. every call completes with a dsb, so the
+// device can be started right after it returns
+void cache_init();
+uint32_t cache_dline_size();
+void cache_clean_range(const void* va, uint64_t size);            // dc cvac: push dirty lines out before a device reads
+void cache_invalidate_range(void* va, uint64_t size);             // dc ivac: drop stale lines after a device wrote
+void cache_clean_invalidate_range(const void* va, uint64_t size); // dc civac: both, for buffers a device may read and write
+void cache_enable();
+
+#endif // CACHE_H
@@ -1,7 +1,5 @@
 #include "cpu.h"
 
-#define MAX_CORES 8
-
 static volatile cpu_state_t cpu_states[MAX_CORES];
 
 void cpu_enable_interrupts() {
@@ -12,6 +10,18 @@ void cpu_disable_interrupts() {
     asm volatile("msr daifset, #2");
 }
 
+// mask irqs on this core and return the previous daif so it can be restored
+uint64_t cpu_irq_save() {
+    uint64_t daif;
+    asm volatile("mrs %0, daif" : "=r"(daif));
+    asm volatile("msr daifset, #2" : : : "memory");
+    return daif;
+}
+
+void cpu_irq_restore(uint64_t flags) {
+    asm volatile("msr daif, %0" : : "r"(flags) : "memory");
+}
+
 void cpu_wfi() {
     asm volatile("wfi");
 }
@@ -34,6 +44,13 @@ uint64_t cpu_get_core_id() {
     return (mpidr & 0xff) | ((mpidr >> 8) & 0xff00);
 }
 
+// every core starts out offline until it enters the kernel and says otherwise
+void cpu_init_states() {
+    for (uint64_t core = 0; core < MAX_CORES; core++) {
+        cpu_states[core] = CPU_STATE_OFFLINE;
+    }
+}
+
 void cpu_set_state(cpu_state_t state) {
     uint64_t core_id = cpu_get_core_id();
     if (core_id >= MAX_CORES) return;
@@ -65,10 +82,18 @@ cpu_state_t cpu_get_state() {
     return (core_id < MAX_CORES) ? cpu_states[core_id] : CPU_STATE_RUNNING;
 }
 
+cpu_state_t cpu_get_core_state(uint64_t core_id) {
+    return (core_id < MAX_CORES) ? cpu_states[core_id] : CPU_STATE_OFFLINE;
+}
+
 uint64_t cpu_get_system_timer_count() {
     uint64_t cntpct_el0;
     asm volatile("mrs %0, cntpct_el0" : "=r"(cntpct_el0));
     return cntpct_el0;
 }
 
-
+uint64_t cpu_get_system_timer_frequency() {
+    uint64_t cntfrq_el0;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(cntfrq_el0));
+    return cntfrq_el0;
+}
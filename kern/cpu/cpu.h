@@ -4,7 +4,25 @@
 typedef unsigned long long uint64_t;
 typedef unsigned int uint32_t;
 
+#define MAX_CORES 8
+
+// esr_el1 fields for synchronous aborts
+#define ESR_EC_SHIFT          26
+#define ESR_EC_MASK           0x3F
+#define ESR_EC_FP_ACCESS      0x07  // fp/simd use while cpacr_el1.fpen traps it
+#define ESR_EC_IABT_LOWER     0x20
+#define ESR_EC_IABT_CURRENT   0x21
+#define ESR_EC_DABT_LOWER     0x24
+#define ESR_EC_DABT_CURRENT   0x25
+#define ESR_ISS_WNR           (1 << 6)
+#define ESR_ISS_CM            (1 << 8)  // cache maintenance, reports wnr = 1
+#define ESR_FSC_TYPE_MASK     0x3C      // fault status code without the level
+#define ESR_FSC_TRANSLATION   0x04
+#define ESR_FSC_ACCESS_FLAG   0x08
+#define ESR_FSC_PERMISSION    0x0C
+
 typedef enum {
+    CPU_STATE_OFFLINE, // not started yet, or powered down
     CPU_STATE_IDLE,
     CPU_STATE_RUNNING,
     CPU_STATE_HALTED
@@ -12,14 +30,19 @@ typedef enum {
 
 void cpu_enable_interrupts();
 void cpu_disable_interrupts();
+uint64_t cpu_irq_save();
+void cpu_irq_restore(uint64_t flags);
 void cpu_wfi();
 void cpu_wfe();
 void cpu_sev();
 void cpu_sevl();
 uint64_t cpu_get_core_id();
+void cpu_init_states();
 void cpu_set_state(cpu_state_t state);
 cpu_state_t cpu_get_state();
+cpu_state_t cpu_get_core_state(uint64_t core_id);
 uint64_t cpu_get_system_timer_count();
+uint64_t cpu_get_system_timer_frequency();
 void cpu_enable_mmu();
 
 #endif
@@ -1,28 +1,50 @@
 .global _exception_vectors
 
 .extern exception_handler
-.extern timer_handle_interrupt
+.extern gic_handle_irq
 
+// vbar_el1 needs 2kb alignment and every vector gets its own 0x80 byte slot
+.balign 0x800
 _exception_vectors:
+    // current el with sp_el0
     b el1_sync
+    .balign 0x80
     b el1_irq
+    .balign 0x80
     b el1_fiq
+    .balign 0x80
     b el1_serror
+    .balign 0x80
 
+    // current el with sp_elx
     b el1_sync
+    .balign 0x80
     b el1_irq
+    .balign 0x80
     b el1_fiq
+    .balign 0x80
     b el1_serror
+    .balign 0x80
 
+    // lower el, aarch64
     b el0_sync
+    .balign 0x80
     b el0_irq
+    .balign 0x80
     b el0_fiq
+    .balign 0x80
     b el0_serror
+    .balign 0x80
 
+    // lower el, aarch32
     b el0_sync
+    .balign 0x80
     b el0_irq
+    .balign 0x80
     b el0_fiq
+    .balign 0x80
     b el0_serror
+    .balign 0x80
 
 .macro save_context
     stp x0, x1, [sp, #-16]!
@@ -52,19 +74,19 @@ _exception_vectors:
     msr elr_el1, x20
     msr spsr_el1, x21
     ldp x28, x29, [sp], #16
-    ldp x26, x27, [sp, #-16]!
-    ldp x24, x25, [sp, #-16]!
-    ldp x22, x23, [sp, #-16]!
-    ldp x20, x21, [sp, #-16]!
-    ldp x18, x19, [sp, #-16]!
-    ldp x16, x17, [sp, #-16]!
-    ldp x14, x15, [sp, #-16]!
-    ldp x12, x13, [sp, #-16]!
-    ldp x10, x11, [sp, #-16]!
-    ldp x8, x9, [sp, #-16]!
-    ldp x6, x7, [sp, #-16]!
-    ldp x4, x5, [sp, #-16]!
-    ldp x2, x3, [sp, #-16]!
+    ldp x26, x27, [sp], #16
+    ldp x24, x25, [sp], #16
+    ldp x22, x23, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp x18, x19, [sp], #16
+    ldp x16, x17, [sp], #16
+    ldp x14, x15, [sp], #16
+    ldp x12, x13, [sp], #16
+    ldp x10, x11, [sp], #16
+    ldp x8, x9, [sp], #16
+    ldp x6, x7, [sp], #16
+    ldp x4, x5, [sp], #16
+    ldp x2, x3, [sp], #16
     ldp x0, x1, [sp], #16
 .endm
 
@@ -80,7 +102,8 @@ el1_irq:
     save_context
     mov x0, sp
     mov x1, #1
-    bl timer_handle_interrupt
+    bl gic_handle_irq
+    bl irq_exit
     restore_context
     eret
 
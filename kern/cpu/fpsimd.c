@@ -0,0 +1,195 @@
+#include "fpsimd.h"
+#include "cpu.h"
+#include "kmalloc.h"
+#include "kprintf.h"
+
+#define CPACR_FPEN_MASK (3ULL << 20)
+#define CPACR_FPEN_ALL  (3ULL << 20) // no trapping at el1 or el0
+
+// the task whose fp/simd state is in each core's registers, 0 if nobody's
+static tcb_t* volatile fpsimd_owner[MAX_CORES];
+// cached cpacr_el1.fpen setting, so integer-only switches skip the msr
+static uint32_t fpsimd_access[MAX_CORES];
+
+static void fpsimd_set_access(uint32_t core, uint32_t enable) {
+    if (fpsimd_access[core] == enable) {
+        return;
+    }
+    uint64_t cpacr;
+    asm volatile("mrs %0, cpacr_el1" : "=r"(cpacr));
+    cpacr = (cpacr & ~CPACR_FPEN_MASK) | (enable ? CPACR_FPEN_ALL : 0);
+    asm volatile("msr cpacr_el1, %0" : : "r"(cpacr));
+    asm volatile("isb");
+    fpsimd_access[core] = enable;
+}
+
+// the registers are only touched here, in asm: the rest of the kernel is
+// built with -mgeneral-regs-only
+static void fpsimd_save(fpsimd_state_t* state) {
+    uint64_t temp;
+    asm volatile(
+        "stp q0, q1, [%1, #0]\n"
+        "stp q2, q3, [%1, #32]\n"
+        "stp q4, q5, [%1, #64]\n"
+        "stp q6, q7, [%1, #96]\n"
+        "stp q8, q9, [%1, #128]\n"
+        "stp q10, q11, [%1, #160]\n"
+        "stp q12, q13, [%1, #192]\n"
+        "stp q14, q15, [%1, #224]\n"
+        "stp q16, q17, [%1, #256]\n"
+        "stp q18, q19, [%1, #288]\n"
+        "stp q20, q21, [%1, #320]\n"
+        "stp q22, q23, [%1, #352]\n"
+        "stp q24, q25, [%1, #384]\n"
+        "stp q26, q27, [%1, #416]\n"
+        "stp q28, q29, [%1, #448]\n"
+        "stp q30, q31, [%1, #480]\n"
+        "mrs %0, fpsr\n"
+        "str %0, [%1, #512]\n"
+        "mrs %0, fpcr\n"
+        "str %0, [%1, #520]\n"
+        : "=&r"(temp)
+        : "r"(state)
+        : "memory"
+    );
+}
+
+static void fpsimd_load(fpsimd_state_t* state) {
+    uint64_t temp;
+    asm volatile(
+        "ldp q0, q1, [%1, #0]\n"
+        "ldp q2, q3, [%1, #32]\n"
+        "ldp q4, q5, [%1, #64]\n"
+        "ldp q6, q7, [%1, #96]\n"
+        "ldp q8, q9, [%1, #128]\n"
+        "ldp q10, q11, [%1, #160]\n"
+        "ldp q12, q13, [%1, #192]\n"
+        "ldp q14, q15, [%1, #224]\n"
+        "ldp q16, q17, [%1, #256]\n"
+        "ldp q18, q19, [%1, #288]\n"
+        "ldp q20, q21, [%1, #320]\n"
+        "ldp q22, q23, [%1, #352]\n"
+        "ldp q24, q25, [%1, #384]\n"
+        "ldp q26, q27, [%1, #416]\n"
+        "ldp q28, q29, [%1, #448]\n"
+        "ldp q30, q31, [%1, #480]\n"
+        "ldr %0, [%1, #512]\n"
+        "msr fpsr, %0\n"
+        "ldr %0, [%1, #520]\n"
+        "msr fpcr, %0\n"
+        : "=&r"(temp)
+        : "r"(state)
+        : "memory"
+    );
+}
+
+// a task's first use starts from zeroed registers and the default fpcr
+static void fpsimd_load_zero() {
+    asm volatile(
+        "movi v0.2d, #0\n"
+        "movi v1.2d, #0\n"
+        "movi v2.2d, #0\n"
+        "movi v3.2d, #0\n"
+        "movi v4.2d, #0\n"
+        "movi v5.2d, #0\n"
+        "movi v6.2d, #0\n"
+        "movi v7.2d, #0\n"
+        "movi v8.2d, #0\n"
+        "movi v9.2d, #0\n"
+        "movi v10.2d, #0\n"
+        "movi v11.2d, #0\n"
+        "movi v12.2d, #0\n"
+        "movi v13.2d, #0\n"
+        "movi v14.2d, #0\n"
+        "movi v15.2d, #0\n"
+        "movi v16.2d, #0\n"
+        "movi v17.2d, #0\n"
+        "movi v18.2d, #0\n"
+        "movi v19.2d, #0\n"
+        "movi v20.2d, #0\n"
+        "movi v21.2d, #0\n"
+        "movi v22.2d, #0\n"
+        "movi v23.2d, #0\n"
+        "movi v24.2d, #0\n"
+        "movi v25.2d, #0\n"
+        "movi v26.2d, #0\n"
+        "movi v27.2d, #0\n"
+        "movi v28.2d, #0\n"
+        "movi v29.2d, #0\n"
+        "movi v30.2d, #0\n"
+        "movi v31.2d, #0\n"
+        "msr fpsr, xzr\n"
+        "msr fpcr, xzr\n"
+    );
+}
+
+// every core starts with no owner and fp/simd access trapping
+void fpsimd_init_cpu() {
+    uint32_t core = (uint32_t)cpu_get_core_id();
+    fpsimd_owner[core] = 0;
+    fpsimd_access[core] = 1;
+    fpsimd_set_access(core, 0);
+}
+
+// called on every switch with irqs masked. nothing is saved or loaded here:
+// access stays enabled only if next's state is still in this core's
+// registers, otherwise its first fp/simd instruction traps
+void fpsimd_switch(tcb_t* next) {
+    uint32_t core = (uint32_t)cpu_get_core_id();
+    fpsimd_set_access(core, fpsimd_owner[core] == next && next->fpsimd_cpu == core);
+}
+
+// the fp/simd access trap: the registers change owner, so the previous
+// owner's state is saved, and the current task's is loaded. returns -1 if
+// there is no task to give them to
+int fpsimd_handle_trap() {
+    tcb_t* task = sched_current_task();
+    if (!task) {
+        return -1;
+    }
+    uint32_t core = (uint32_t)cpu_get_core_id();
+    tcb_t* owner = fpsimd_owner[core];
+    fpsimd_set_access(core, 1);
+    if (owner != task) {
+        if (!task->fpsimd) {
+            task->fpsimd = (fpsimd_state_t*)kmalloc(sizeof(fpsimd_state_t));
+            if (!task->fpsimd) {
+                kprintf("fpsimd: no memory for the state of task %d\n", (int)task->id);
+                return -1;
+            }
+            task->fpsimd_valid = 0;
+        }
+        if (owner) {
+            fpsimd_save(owner->fpsimd);
+            owner->fpsimd_valid = 1;
+            // from here the owner may run on any core again
+            __atomic_store_n(&owner->fpsimd_cpu, FPSIMD_CPU_NONE, __ATOMIC_RELEASE);
+        }
+        if (task->fpsimd_valid) {
+            fpsimd_load(task->fpsimd);
+        } else {
+            fpsimd_load_zero();
+        }
+        fpsimd_owner[core] = task;
+        task->fpsimd_cpu = core;
+    }
+    return 0;
+}
+
+// a task whose state only lives in another core's registers has to stay
+// there until that core saves it, which it does when the registers change owner
+int fpsimd_can_migrate(tcb_t* task, uint32_t core) {
+    uint32_t cpu = __atomic_load_n(&task->fpsimd_cpu, __ATOMIC_ACQUIRE);
+    return cpu == FPSIMD_CPU_NONE || cpu == core;
+}
+
+// an exited task gives up its registers without saving them
+void fpsimd_release(tcb_t* task) {
+    uint32_t cpu = task->fpsimd_cpu;
+    if (cpu != FPSIMD_CPU_NONE) {
+        tcb_t* expected = task;
+        __atomic_compare_exchange_n(&fpsimd_owner[cpu], &expected, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        task->fpsimd_cpu = FPSIMD_CPU_NONE;
+    }
+    task->fpsimd_valid = 0;
+}
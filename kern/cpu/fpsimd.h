@@ -0,0 +1,27 @@
+#ifndef FPSIMD_H
+#define FPSIMD_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+#include "astral_sched.h"
+
+// lazy fp/simd switching. a core leaves its registers with the last task
+// that used them and traps the first fp/simd instruction of any other task;
+// only then is the old owner's state saved and the new one's loaded. tasks
+// that never use fp/simd never get a save area
+#define FPSIMD_CPU_NONE 0xFFFFFFFF
+
+typedef struct fpsimd_state {
+    uint64_t vregs[64]; // q0-q31
+    uint64_t fpsr;
+    uint64_t fpcr;
+} fpsimd_state_t;
+
+void fpsimd_init_cpu();
+void fpsimd_switch(tcb_t* next);
+int fpsimd_handle_trap();
+int fpsimd_can_migrate(tcb_t* task, uint32_t core);
+void fpsimd_release(tcb_t* task);
+
+#endif // FPSIMD_H
@@ -0,0 +1,107 @@
+#include "gic.h"
+#include "cpu.h"
+#include "kprintf.h"
+#include "vm_maps.h"
+
+#define GIC_DIST_SIZE 0x10000
+#define GIC_CPU_SIZE  0x10000
+
+#define GICD_CTLR       0x000
+#define GICD_ISENABLER  0x100
+#define GICD_ICENABLER  0x180
+#define GICD_IPRIORITYR 0x400
+#define GICD_ITARGETSR  0x800
+#define GICD_SGIR       0xF00
+
+#define GICC_CTLR 0x000
+#define GICC_PMR  0x004
+#define GICC_IAR  0x00C
+#define GICC_EOIR 0x010
+
+#define GIC_IAR_ID_MASK  0x3FF
+#define GIC_SPURIOUS     1020
+#define GIC_PRIORITY_ALL 0xFF
+#define GIC_PRIORITY_IRQ 0xA0
+
+static uint64_t gic_dist = 0;
+static uint64_t gic_cpu = 0;
+static irq_handler_t irq_handlers[GIC_MAX_IRQS];
+
+static inline volatile uint32_t* dist_reg(uint32_t offset) {
+    return (volatile uint32_t*)(gic_dist + offset);
+}
+
+static inline volatile uint32_t* cpu_reg(uint32_t offset) {
+    return (volatile uint32_t*)(gic_cpu + offset);
+}
+
+// map both register frames and turn the distributor on, once on the boot core
+void gic_init() {
+    gic_dist = (uint64_t)vm_map_device(GIC_DIST_PA, GIC_DIST_SIZE);
+    gic_cpu = (uint64_t)vm_map_device(GIC_CPU_PA, GIC_CPU_SIZE);
+    if (!gic_dist || !gic_cpu) {
+        kprintf("gic: cannot map registers\n");
+        return;
+    }
+    for (uint32_t irq = 0; irq < GIC_MAX_IRQS; irq++) {
+        irq_handlers[irq] = 0;
+    }
+    *dist_reg(GICD_CTLR) = 1;
+}
+
+// sgis and ppis and the cpu interface are banked, so every core sets up its own
+void gic_init_cpu() {
+    if (!gic_cpu) {
+        return;
+    }
+    *cpu_reg(GICC_PMR) = GIC_PRIORITY_ALL;
+    *cpu_reg(GICC_CTLR) = 1;
+}
+
+int gic_register(uint32_t irq, irq_handler_t handler) {
+    if (irq >= GIC_MAX_IRQS) {
+        kprintf("gic: irq %d out of range\n", (int)irq);
+        return -1;
+    }
+    irq_handlers[irq] = handler;
+    return 0;
+}
+
+// for sgis and ppis this only affects the calling core. an spi is routed to
+// the calling core
+void gic_enable_irq(uint32_t irq) {
+    volatile uint8_t* priority = (volatile uint8_t*)(gic_dist + GICD_IPRIORITYR + irq);
+    *priority = GIC_PRIORITY_IRQ;
+    if (irq >= GIC_SPI_BASE) {
+        volatile uint8_t* target = (volatile uint8_t*)(gic_dist + GICD_ITARGETSR + irq);
+        *target = (uint8_t)(1U << cpu_get_core_id());
+    }
+    *dist_reg(GICD_ISENABLER + (irq / 32) * 4) = 1U << (irq % 32);
+}
+
+void gic_disable_irq(uint32_t irq) {
+    *dist_reg(GICD_ICENABLER + (irq / 32) * 4) = 1U << (irq % 32);
+}
+
+// raise an sgi on another core; stores made before it are visible to its handler
+void gic_send_sgi(uint32_t core, uint32_t sgi) {
+    asm volatile("dsb ishst" : : : "memory");
+    *dist_reg(GICD_SGIR) = ((1U << core) << 16) | (sgi & 0xF);
+}
+
+// entry from the irq vector. handlers never switch tasks: they raise
+// softirqs, queue work or set need_resched, and irq_exit acts on those after
+// this returns. so the interrupt is ended once its handler has quieted the device
+void gic_handle_irq() {
+    uint32_t iar = *cpu_reg(GICC_IAR);
+    uint32_t irq = iar & GIC_IAR_ID_MASK;
+    if (irq >= GIC_SPURIOUS) {
+        return;
+    }
+    if (irq < GIC_MAX_IRQS && irq_handlers[irq]) {
+        irq_handlers[irq](irq);
+    } else {
+        kprintf("gic: unhandled irq %d\n", (int)irq);
+    }
+    *cpu_reg(GICC_EOIR) = iar;
+}
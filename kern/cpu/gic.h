@@ -0,0 +1,31 @@
+#ifndef GIC_H
+#define GIC_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// gicv2 on the qemu virt machine
+#define GIC_DIST_PA 0x08000000
+#define GIC_CPU_PA  0x08010000
+
+// interrupt ids: 0-15 are sgis sent between cores, 16-31 per-core ppis,
+// spis from 32 up. only the ids below GIC_MAX_IRQS can have a handler
+#define GIC_SGI_BASE  0
+#define GIC_PPI_BASE  16
+#define GIC_SPI_BASE  32
+#define GIC_MAX_IRQS  128
+
+// runs with irqs masked, after the interrupt has been acknowledged and ended.
+// it must not switch tasks: longer work goes to a softirq, and a reschedule
+// is requested through need_resched and done in irq_exit
+typedef void (*irq_handler_t)(uint32_t irq);
+
+void gic_init();
+void gic_init_cpu();
+int gic_register(uint32_t irq, irq_handler_t handler);
+void gic_enable_irq(uint32_t irq);
+void gic_disable_irq(uint32_t irq);
+void gic_send_sgi(uint32_t core, uint32_t sgi);
+void gic_handle_irq();
+
+#endif // GIC_H
@@ -0,0 +1,65 @@
+#include "psci.h"
+#include "dtb.h"
+#include "kprintf.h"
+#include "lib.h"
+
+static psci_conduit_t conduit = PSCI_CONDUIT_NONE;
+
+// smccc: function id and arguments in x0-x3, result in x0; the firmware may
+// clobber x4-x17
+static int64_t psci_call(uint64_t fn, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
+    register uint64_t x0 asm("x0") = fn;
+    register uint64_t x1 asm("x1") = arg0;
+    register uint64_t x2 asm("x2") = arg1;
+    register uint64_t x3 asm("x3") = arg2;
+    if (conduit == PSCI_CONDUIT_HVC) {
+        asm volatile("hvc #0"
+                     : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)
+                     :
+                     : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17", "memory");
+    } else if (conduit == PSCI_CONDUIT_SMC) {
+        asm volatile("smc #0"
+                     : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)
+                     :
+                     : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17", "memory");
+    } else {
+        return PSCI_RET_NOT_SUPPORTED;
+    }
+    return (int64_t)x0;
+}
+
+// pick the conduit the firmware advertises in the device tree
+int psci_init() {
+    uint32_t len;
+    const char* method = (const char*)dtb_get_property("/psci", "method", &len);
+    if (!method || len < 4) {
+        kprintf("psci: no /psci method in the device tree\n");
+        return -1;
+    }
+    if (strncmp(method, "hvc", 3) == 0) {
+        conduit = PSCI_CONDUIT_HVC;
+    } else if (strncmp(method, "smc", 3) == 0) {
+        conduit = PSCI_CONDUIT_SMC;
+    } else {
+        kprintf("psci: unknown method %s\n", method);
+        return -1;
+    }
+    uint64_t version = (uint64_t)psci_call(PSCI_FN_VERSION, 0, 0, 0);
+    kprintf("psci: version %d.%d via %s\n", (int)(version >> 16), (int)(version & 0xFFFF), method);
+    return 0;
+}
+
+psci_conduit_t psci_conduit() {
+    return conduit;
+}
+
+// start the core with the given mpidr affinity at a physical entry point with
+// the mmu off; context_id arrives in its x0
+int psci_cpu_on(uint64_t target_mpidr, uint64_t entry_pa, uint64_t context_id) {
+    return (int)psci_call(PSCI_FN64_CPU_ON, target_mpidr, entry_pa, context_id);
+}
+
+// power down the calling core; only returns on failure
+void psci_cpu_off() {
+    psci_call(PSCI_FN_CPU_OFF, 0, 0, 0);
+}
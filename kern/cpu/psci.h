@@ -0,0 +1,33 @@
+#ifndef PSCI_H
+#define PSCI_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+typedef long long int64_t;
+
+// psci 0.2+ function ids, smc64 calling convention where it matters
+#define PSCI_FN_VERSION         0x84000000
+#define PSCI_FN_CPU_OFF         0x84000002
+#define PSCI_FN64_CPU_ON        0xC4000003
+
+#define PSCI_RET_SUCCESS            0
+#define PSCI_RET_NOT_SUPPORTED      -1
+#define PSCI_RET_INVALID_PARAMS     -2
+#define PSCI_RET_DENIED             -3
+#define PSCI_RET_ALREADY_ON         -4
+#define PSCI_RET_ON_PENDING         -5
+#define PSCI_RET_INTERNAL_FAILURE   -6
+
+// how calls reach the firmware, from the /psci node's method property
+typedef enum {
+    PSCI_CONDUIT_NONE,
+    PSCI_CONDUIT_HVC,
+    PSCI_CONDUIT_SMC
+} psci_conduit_t;
+
+int psci_init();
+psci_conduit_t psci_conduit();
+int psci_cpu_on(uint64_t target_mpidr, uint64_t entry_pa, uint64_t context_id);
+void psci_cpu_off();
+
+#endif // PSCI_H
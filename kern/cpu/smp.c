@@ -0,0 +1,90 @@
+#include "smp.h"
+#include "cpu.h"
+#include "psci.h"
+#include "cache.h"
+#include "kprintf.h"
+#include "pmm.h"
+#include "astral_sched.h"
+#include "bench.h"
+
+#define SMP_BOOT_TIMEOUT_US 100000
+
+extern void secondary_entry();
+extern void _exception_vectors();
+
+static smp_boot_args_t boot_args[MAX_CORES];
+static volatile uint32_t cores_online = 1;
+
+// start every other core through psci. each one gets its own stack and enters
+// the kernel on the primary's translation tables, with the mmu and caches set
+// up the same way, then reports in through cores_online
+void smp_init() {
+    if (psci_init() != 0) {
+        kprintf("smp: no psci, running on the boot core only\n");
+        return;
+    }
+    uint64_t mair, tcr, ttbr1, ttbr0;
+    asm volatile("mrs %0, mair_el1" : "=r"(mair));
+    asm volatile("mrs %0, tcr_el1" : "=r"(tcr));
+    asm volatile("mrs %0, ttbr1_el1" : "=r"(ttbr1));
+    asm volatile("mrs %0, ttbr0_el1" : "=r"(ttbr0));
+
+    uint64_t boot_core = cpu_get_core_id();
+    uint64_t timeout_ticks = cpu_get_system_timer_frequency() / 1000000 * SMP_BOOT_TIMEOUT_US;
+    uint32_t stack_order = pmm_order_for_size(SMP_STACK_SIZE);
+    for (uint64_t core = 0; core < MAX_CORES; core++) {
+        if (core == boot_core) continue;
+        uint64_t stack_pa = pmm_alloc_pages(stack_order);
+        if (!stack_pa) {
+            kprintf("smp: no stack for core %d\n", (int)core);
+            break;
+        }
+        smp_boot_args_t* args = &boot_args[core];
+        args->mair = mair;
+        args->tcr = tcr;
+        args->ttbr1 = ttbr1;
+        args->ttbr0 = ttbr0;
+        args->stack_top = (uint64_t)PHYS_TO_VIRT(stack_pa) + (PMM_PAGE_SIZE << stack_order);
+        args->core_id = core;
+        // the core reads its arguments before its caches are on
+        cache_clean_range(args, sizeof(smp_boot_args_t));
+
+        // core ids are mpidr aff0, with aff1 above it, so they double as the psci target
+        uint32_t online = cores_online;
+        int ret = psci_cpu_on(core, VIRT_TO_PHYS(secondary_entry), VIRT_TO_PHYS(args));
+        if (ret != PSCI_RET_SUCCESS) {
+            pmm_free_pages(stack_pa, stack_order);
+            if (ret == PSCI_RET_INVALID_PARAMS) {
+                break; // no such core, and none after it
+            }
+            if (ret != PSCI_RET_ALREADY_ON) {
+                kprintf("smp: cpu_on for core %d failed: %d\n", (int)core, ret);
+            }
+            continue;
+        }
+        uint64_t deadline = cpu_get_system_timer_count() + timeout_ticks;
+        while (cores_online == online && cpu_get_system_timer_count() < deadline);
+        if (cores_online == online) {
+            kprintf("smp: core %d did not come up\n", (int)core);
+        }
+    }
+    kprintf("smp: %d cores online\n", (int)cores_online);
+}
+
+uint32_t smp_cores_online() {
+    return cores_online;
+}
+
+// first c code on a secondary core, on its own stack in the upper half
+void smp_secondary_main(smp_boot_args_t* args) {
+    asm volatile("msr vbar_el1, %0" : : "r"((uint64_t)_exception_vectors));
+    asm volatile("isb");
+    __atomic_add_fetch(&cores_online, 1, __ATOMIC_RELAXED);
+    if (cpu_get_core_id() != args->core_id) {
+        kprintf("smp: core %d started as %d\n", (int)args->core_id, (int)cpu_get_core_id());
+    }
+#ifdef ASTRAL_BENCH
+    bench_kmalloc_contention_secondary();
+#endif
+    sched_start_secondary();
+}
@@ -0,0 +1,24 @@
+#ifndef SMP_H
+#define SMP_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+#define SMP_STACK_SIZE 0x4000 // 16kb boot stack per secondary core
+
+// handed to a secondary core in x0 by psci cpu_on. it is read with the mmu
+// off, so secondary_entry in bootloader.s uses these offsets directly
+typedef struct {
+    uint64_t mair;      // 0
+    uint64_t tcr;       // 8
+    uint64_t ttbr1;     // 16, kernel tables
+    uint64_t ttbr0;     // 24, installed once running in the upper half
+    uint64_t stack_top; // 32, kernel va
+    uint64_t core_id;   // 40
+} smp_boot_args_t;
+
+void smp_init();
+uint32_t smp_cores_online();
+void smp_secondary_main(smp_boot_args_t* args);
+
+#endif // SMP_H
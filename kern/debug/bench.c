@@ -0,0 +1,171 @@
+#include "bench.h"
+#include "cpu.h"
+#include "kmalloc.h"
+#include "kprintf.h"
+#include "astral_sched.h"
+#include "pmm.h"
+
+#define BENCH_KMALLOC_ITERATIONS 100000
+#define BENCH_KMALLOC_BATCH      8
+
+static volatile uint32_t kmalloc_bench_cores = 0; // set by the boot core to start the run
+static volatile uint32_t kmalloc_bench_arrived = 0;
+static volatile uint32_t kmalloc_bench_finished = 0;
+static uint64_t kmalloc_bench_ticks[MAX_CORES];
+
+static uint64_t ticks_to_ns(uint64_t ticks, uint64_t count) {
+    uint64_t freq = cpu_get_system_timer_frequency();
+    if (freq == 0 || count == 0) return 0;
+    return (ticks * 1000000000ULL / freq) / count;
+}
+
+// the cores start together after a barrier and hammer kmalloc/kfree with
+// small objects, the last one to finish prints the per-core cost of one
+// alloc+free pair
+static void kmalloc_contention_run(uint32_t num_cores) {
+    uint64_t core_id = cpu_get_core_id();
+    void* objects[BENCH_KMALLOC_BATCH];
+
+    __atomic_add_fetch(&kmalloc_bench_arrived, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&kmalloc_bench_arrived, __ATOMIC_ACQUIRE) < num_cores);
+
+    uint64_t start = cpu_get_system_timer_count();
+    for (int i = 0; i < BENCH_KMALLOC_ITERATIONS; i++) {
+        for (int j = 0; j < BENCH_KMALLOC_BATCH; j++) {
+            objects[j] = kmalloc(48 + j * 16);
+        }
+        for (int j = 0; j < BENCH_KMALLOC_BATCH; j++) {
+            kfree(objects[j]);
+        }
+    }
+    kmalloc_bench_ticks[core_id] = cpu_get_system_timer_count() - start;
+
+    if (__atomic_add_fetch(&kmalloc_bench_finished, 1, __ATOMIC_ACQ_REL) == num_cores) {
+        kprintf("bench: kmalloc contention, %d cores\n", num_cores);
+        for (uint32_t i = 0; i < MAX_CORES; i++) {
+            if (kmalloc_bench_ticks[i] == 0) continue;
+            kprintf("  core %d: %d ns per alloc+free\n", i,
+                    (int)ticks_to_ns(kmalloc_bench_ticks[i], (uint64_t)BENCH_KMALLOC_ITERATIONS * BENCH_KMALLOC_BATCH));
+        }
+    }
+}
+
+// run on the boot core once smp_init has brought up num_cores cores; it
+// releases the secondaries waiting in bench_kmalloc_contention_secondary
+void bench_kmalloc_contention(uint32_t num_cores) {
+    __atomic_store_n(&kmalloc_bench_cores, num_cores, __ATOMIC_RELEASE);
+    cpu_sev();
+    kmalloc_contention_run(num_cores);
+}
+
+// run on every secondary core as it comes up, before it joins the scheduler
+void bench_kmalloc_contention_secondary() {
+    uint32_t num_cores;
+    while (!(num_cores = __atomic_load_n(&kmalloc_bench_cores, __ATOMIC_ACQUIRE))) {
+        cpu_wfe();
+    }
+    kmalloc_contention_run(num_cores);
+}
+
+#define BENCH_SPAWN_STACK 4096
+
+static volatile uint32_t spawn_bench_release = 0;
+
+// spawned tasks stay alive until released, so the task table holds all of them at once
+static void spawn_bench_task() {
+    while (!__atomic_load_n(&spawn_bench_release, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+// spawn count tasks, let them exit and wait until every bundle is back;
+// returns the ticks spent in sched_create_task, or 0 if a spawn failed
+static uint64_t spawn_bench_round(uint32_t count) {
+    uint32_t baseline = sched_task_count();
+    __atomic_store_n(&spawn_bench_release, 0, __ATOMIC_RELEASE);
+    uint64_t ticks = 0;
+    uint32_t spawned = 0;
+    for (; spawned < count; spawned++) {
+        uint64_t start = cpu_get_system_timer_count();
+        int ret = sched_create_task(spawn_bench_task, BENCH_SPAWN_STACK);
+        ticks += cpu_get_system_timer_count() - start;
+        if (ret != 0) {
+            kprintf("bench: spawn failed after %d tasks\n", (int)spawned);
+            ticks = 0;
+            break;
+        }
+    }
+    __atomic_store_n(&spawn_bench_release, 1, __ATOMIC_RELEASE);
+    while (sched_task_count() > baseline) {
+        sched_yield();
+    }
+    return ticks;
+}
+
+// runs as a task: the first round allocates every tcb, stack and address
+// space, the second takes them from the exit pools as far as they reach
+void bench_task_spawn(uint32_t count) {
+    uint64_t cold = spawn_bench_round(count);
+    uint64_t warm = spawn_bench_round(count);
+    kprintf("bench: task spawn, %d tasks\n", count);
+    kprintf("  cold: %d ns per spawn\n", (int)ticks_to_ns(cold, count));
+    kprintf("  warm: %d ns per spawn\n", (int)ticks_to_ns(warm, count));
+}
+
+#define BENCH_SWITCH_ITERATIONS 100000
+#define PMCR_E (1 << 0)  // enable the counters
+#define PMCR_C (1 << 2)  // reset the cycle counter
+#define PMCNTEN_CYCLES (1U << 31)
+
+static cpu_context_t switch_bench_main;
+static cpu_context_t switch_bench_partner;
+
+static inline uint64_t read_cycles() {
+    uint64_t cycles;
+    asm volatile("isb; mrs %0, pmccntr_el0" : "=r"(cycles));
+    return cycles;
+}
+
+// the other end of the ping-pong: hand control straight back, forever
+static void switch_bench_partner_loop() {
+    while (1) {
+        context_switch(&switch_bench_partner, &switch_bench_main);
+    }
+}
+
+// bounce between two contexts on one core with irqs masked and report the
+// cost of a single context_switch, in pmu cycles and in counter time
+void bench_context_switch() {
+    uint64_t stack_pa = pmm_alloc_pages(0);
+    if (!stack_pa) {
+        kprintf("bench: no stack for the context switch partner\n");
+        return;
+    }
+    uint64_t stack_top = (uint64_t)PHYS_TO_VIRT(stack_pa) + PMM_PAGE_SIZE - 16;
+    switch_bench_partner.sp = stack_top;
+    switch_bench_partner.fp = stack_top;
+    switch_bench_partner.lr = (uint64_t)switch_bench_partner_loop;
+
+    asm volatile("msr pmcr_el0, %0" : : "r"((uint64_t)(PMCR_E | PMCR_C)));
+    asm volatile("msr pmcntenset_el0, %0" : : "r"((uint64_t)PMCNTEN_CYCLES));
+
+    uint64_t flags = cpu_irq_save();
+    // one round trip first, so the partner is past its entry
+    context_switch(&switch_bench_main, &switch_bench_partner);
+    uint64_t start_ticks = cpu_get_system_timer_count();
+    uint64_t start_cycles = read_cycles();
+    for (int i = 0; i < BENCH_SWITCH_ITERATIONS; i++) {
+        context_switch(&switch_bench_main, &switch_bench_partner);
+    }
+    uint64_t cycles = read_cycles() - start_cycles;
+    uint64_t ticks = cpu_get_system_timer_count() - start_ticks;
+    cpu_irq_restore(flags);
+
+    // the partner never runs again
+    pmm_free_pages(stack_pa, 0);
+
+    uint64_t switches = (uint64_t)BENCH_SWITCH_ITERATIONS * 2;
+    kprintf("bench: context switch, %d switches\n", (int)switches);
+    kprintf("  %d cycles per switch\n", (int)(cycles / switches));
+    kprintf("  %d ns per switch\n", (int)ticks_to_ns(ticks, switches));
+}
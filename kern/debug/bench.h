@@ -0,0 +1,13 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// in-kernel microbenchmarks, built in with `make BENCH=1`
+void bench_kmalloc_contention(uint32_t num_cores);
+void bench_kmalloc_contention_secondary();
+void bench_task_spawn(uint32_t count);
+void bench_context_switch();
+
+#endif // BENCH_H
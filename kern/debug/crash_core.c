@@ -3,8 +3,6 @@
 #include "kprintf.h"
 #include "lib.h"
 
-#define MAX_CORES 8
-
 void check_and_halt_core() {
     uint64_t core_id = cpu_get_core_id();
     if (core_id != 0) {
@@ -0,0 +1,30 @@
+#include "debug_keys.h"
+#include "gic.h"
+#include "lib.h"
+#include "kmalloc.h"
+#include "workqueue.h"
+
+static work_t kmalloc_stats_work;
+
+static void kmalloc_stats_fn(void* ctx) {
+    (void)ctx;
+    kmalloc_dump_stats();
+}
+
+static void debug_keys_irq(uint32_t irq) {
+    (void)irq;
+    int c;
+    while ((c = uart_getc()) >= 0) {
+        if (c == DEBUG_KEY_KMALLOC_STATS) {
+            work_queue(&kmalloc_stats_work);
+        }
+    }
+}
+
+// needs the gic and the workqueue; input is taken on the calling core
+void debug_keys_init() {
+    work_init(&kmalloc_stats_work, kmalloc_stats_fn, 0);
+    gic_register(UART_IRQ, debug_keys_irq);
+    gic_enable_irq(UART_IRQ);
+    uart_enable_rx_interrupt();
+}
@@ -0,0 +1,13 @@
+#ifndef DEBUG_KEYS_H
+#define DEBUG_KEYS_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// single key commands on the uart console. the rx interrupt only queues
+// work; the dumps run in a worker task, where they may take locks and print
+#define DEBUG_KEY_KMALLOC_STATS 'm'
+
+void debug_keys_init();
+
+#endif // DEBUG_KEYS_H
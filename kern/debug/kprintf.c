@@ -95,4 +95,18 @@ void kprintf(const char* fmt, ...) {
     va_end(args);
 }
 
+// always goes to the serial port, even once the framebuffer console is up
+void kprintf_uart(const char* fmt, ...) {
+    char buffer[KPRINTF_BUFFER_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, KPRINTF_BUFFER_SIZE, fmt, args);
+    va_end(args);
 
+    for (int i = 0; buffer[i] != '\0'; i++) {
+        uart_putc(buffer[i]);
+        if (buffer[i] == '\n') {
+            uart_putc('\r');
+        }
+    }
+}
@@ -10,6 +10,7 @@ typedef unsigned char uint8_t;
 void kprintf_init(uint32_t* fb, uint32_t width, uint32_t height, uint32_t pitch);
 void kprintf(const char* fmt, ...);
 void kprintf_varg(const char* fmt, va_list args);
+void kprintf_uart(const char* fmt, ...);
 
 #endif // KPRINTF_H
 
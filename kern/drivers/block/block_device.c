@@ -1,8 +1,28 @@
 #include "block_device.h"
 #include "kprintf.h"
 #include "lib.h"
+#include "pmm.h"
+#include "vm_maps.h"
+#include "cache.h"
+#include "sync.h"
+
+// both controllers take one request at a time; tasks queued behind the one
+// in flight sleep rather than spin
+static mutex_t block_device_lock;
+static uint32_t block_device_lock_ready = 0;
+
+// run by each controller init and by set_active_block_device, whichever
+// comes first. they all run at boot on one core, so the flag needs no lock
+static void block_device_lock_init() {
+    if (!block_device_lock_ready) {
+        mutex_init(&block_device_lock);
+        block_device_lock_ready = 1;
+    }
+}
 
-#define UFS_HCI_BASE 0xDEAD0000
+#define UFS_HCI_PA 0xDEAD0000
+#define UFS_HCI_BASE ((uint64_t)PHYS_TO_VIRT(UFS_HCI_PA))
+#define HCI_REGS_SIZE 0x1000
 
 #define UFS_HCI_CAPABILITIES_REG            (volatile uint32_t*)(UFS_HCI_BASE + 0x00)
 #define UFS_HCI_VERSION_REG                 (volatile uint32_t*)(UFS_HCI_BASE + 0x04)
@@ -28,42 +48,89 @@
 #define PRDT_DATA_BYTE_COUNT_OFFSET 8
 #define PRDT_RESERVED_OFFSET 12
 
-#define UFS_TRL_BASE 0xDEAE0000
-#define UFS_PRDT_BASE 0xDEAF0000
+// 0 until ufs_init has set the controller up
+static uint64_t ufs_prdt_pa = 0;
+static utp_trd_t* ufs_trd_list = 0;
+static prdt_entry_t* ufs_prdt_list = 0;
 
-static utp_trd_t* ufs_trd_list = (utp_trd_t*)UFS_TRL_BASE;
-static prdt_entry_t* ufs_prdt_list = (prdt_entry_t*)UFS_PRDT_BASE;
+int ufs_init() {
+    block_device_lock_init();
+    if (!vm_map_device(UFS_HCI_PA, HCI_REGS_SIZE)) {
+        kprintf("ufs_init: failed to map controller registers\n");
+        return -1;
+    }
+
+    // the request list and prdt are dma targets, so take them from the page
+    // allocator, which hands out linear-mapped ram
+    uint64_t trl_pa = pmm_alloc_page();
+    uint64_t prdt_pa = pmm_alloc_page();
+    if (!trl_pa || !prdt_pa) {
+        if (trl_pa) pmm_free_page(trl_pa);
+        if (prdt_pa) pmm_free_page(prdt_pa);
+        kprintf("ufs_init: failed to allocate the request list\n");
+        return -1;
+    }
+    utp_trd_t* trd_list = (utp_trd_t*)PHYS_TO_VIRT(trl_pa);
+    prdt_entry_t* prdt_list = (prdt_entry_t*)PHYS_TO_VIRT(prdt_pa);
+    memset(trd_list, 0, PMM_PAGE_SIZE);
+    memset(prdt_list, 0, PMM_PAGE_SIZE);
+    cache_clean_range(trd_list, PMM_PAGE_SIZE);
+    cache_clean_range(prdt_list, PMM_PAGE_SIZE);
 
-void ufs_init() {
     *UFS_HCI_CONTROLLER_RESET_REG = 1;
     while (*UFS_HCI_CONTROLLER_RESET_REG & 1);
 
     *UFS_HCI_CONTROLLER_ENABLE_REG = 1;
     while (!(*UFS_HCI_CONTROLLER_STATUS_REG & 1));
 
-    *UFS_HCI_UTP_TRANSFER_REQ_LIST_BASE_L_REG = (uint32_t)UFS_TRL_BASE;
-    *UFS_HCI_UTP_TRANSFER_REQ_LIST_BASE_H_REG = (uint32_t)((uint64_t)UFS_TRL_BASE >> 32);
+    *UFS_HCI_UTP_TRANSFER_REQ_LIST_BASE_L_REG = (uint32_t)trl_pa;
+    *UFS_HCI_UTP_TRANSFER_REQ_LIST_BASE_H_REG = (uint32_t)(trl_pa >> 32);
 
     *UFS_HCI_UTP_TRANSFER_REQ_INT_EN_REG = 0xFFFFFFFF;
     *UFS_HCI_UTP_TASK_REQ_INT_EN_REG = 0xFFFFFFFF;
 
+    ufs_prdt_pa = prdt_pa;
+    ufs_trd_list = trd_list;
+    ufs_prdt_list = prdt_list;
     kprintf("ufs initialized\n");
+    return 0;
 }
 
 static int ufs_send_command(uint64_t lba, uint32_t num_blocks, uint8_t* buffer, uint32_t data_direction) {
+    if (!ufs_trd_list) {
+        kprintf("ufs_send_command: controller not initialized\n");
+        return -1;
+    }
+    // one prdt entry covers the whole transfer, so the buffer has to be
+    // physically contiguous: kmalloc, pmm pages and stacks are, while
+    // vm_map_allocate memory is not
+    uint64_t length = (uint64_t)num_blocks * UFS_BLOCK_SIZE;
+    uint64_t buffer_va = (uint64_t)buffer;
+    if (buffer_va < KERNEL_VIRT_BASE || buffer_va >= VM_LINEAR_MAP_END || length > VM_LINEAR_MAP_END - buffer_va) {
+        kprintf("ufs_send_command: buffer %p is outside the linear map\n", buffer);
+        return -1;
+    }
+    // a cache line shared with other data could be written back over the
+    // transfer by a store to its neighbour, or lose that store when dropped
+    if ((buffer_va | length) & (cache_dline_size() - 1)) {
+        kprintf("ufs_send_command: buffer %p is not cache line aligned\n", buffer);
+        return -1;
+    }
+
     utp_trd_t* trd = &ufs_trd_list[0];
     prdt_entry_t* prdt = &ufs_prdt_list[0];
 
     memset(trd, 0, sizeof(utp_trd_t));
     memset(prdt, 0, sizeof(prdt_entry_t));
 
-    prdt->dword0 = (uint32_t)(uint64_t)buffer;
-    prdt->dword1 = (uint32_t)((uint64_t)buffer >> 32);
+    uint64_t buffer_pa = VIRT_TO_PHYS(buffer);
+    prdt->dword0 = (uint32_t)buffer_pa;
+    prdt->dword1 = (uint32_t)(buffer_pa >> 32);
     prdt->dword2 = (num_blocks * UFS_BLOCK_SIZE) - 1;
 
     trd->dword0 = (UTP_TRD_COMMAND_TYPE_SCSI << 29) | (data_direction << 24) | (UTP_TRD_INT_CMD << 16);
-    trd->dword1 = (uint32_t)UFS_PRDT_BASE;
-    trd->dword2 = (uint32_t)((uint64_t)UFS_PRDT_BASE >> 32);
+    trd->dword1 = (uint32_t)ufs_prdt_pa;
+    trd->dword2 = (uint32_t)(ufs_prdt_pa >> 32);
 
     uint8_t* cdb = (uint8_t*)&trd->dword4;
     if (data_direction == UTP_TRD_DD_READ) {
@@ -78,10 +145,27 @@ static int ufs_send_command(uint64_t lba, uint32_t num_blocks, uint8_t* buffer,
     cdb[7] = (num_blocks >> 8) & 0xFF;
     cdb[8] = num_blocks & 0xFF;
 
+    // the controller fetches the descriptors and moves the data by dma, so
+    // they have to reach memory first. a read target is also written back and
+    // dropped, so no dirty line can land on top of the incoming data
+    cache_clean_range(trd, sizeof(utp_trd_t));
+    cache_clean_range(prdt, sizeof(prdt_entry_t));
+    if (data_direction == UTP_TRD_DD_READ) {
+        cache_clean_invalidate_range(buffer, length);
+    } else {
+        cache_clean_range(buffer, length);
+    }
+
     *UFS_HCI_UTP_TRANSFER_REQ_DOORBELL_REG = 1;
 
     while (*UFS_HCI_UTP_TRANSFER_REQ_DOORBELL_REG & 1);
 
+    // lines speculatively refetched while the transfer ran are stale. the
+    // buffer covers whole lines, so they are only invalidated (dc ivac)
+    if (data_direction == UTP_TRD_DD_READ) {
+        cache_invalidate_range(buffer, length);
+    }
+    cache_invalidate_range(trd, sizeof(utp_trd_t));
     return 0;
 }
 
@@ -93,7 +177,8 @@ int ufs_write_blocks(uint64_t lba, uint32_t num_blocks, const uint8_t* buffer) {
     return ufs_send_command(lba, num_blocks, (uint8_t*)buffer, UTP_TRD_DD_WRITE);
 }
 
-#define EMMC_HCI_BASE 0xBEEF0000
+#define EMMC_HCI_PA 0xBEEF0000
+#define EMMC_HCI_BASE ((uint64_t)PHYS_TO_VIRT(EMMC_HCI_PA))
 
 #define EMMC_HCI_ARGUMENT_REG       (volatile uint32_t*)(EMMC_HCI_BASE + 0x00)
 #define EMMC_HCI_COMMAND_REG        (volatile uint32_t*)(EMMC_HCI_BASE + 0x04)
@@ -120,6 +205,11 @@ int ufs_write_blocks(uint64_t lba, uint32_t num_blocks, const uint8_t* buffer) {
 #define EMMC_STATUS_TRANSFER_COMPLETE (1 << 1)
 
 void emmc_init() {
+    block_device_lock_init();
+    if (!vm_map_device(EMMC_HCI_PA, HCI_REGS_SIZE)) {
+        kprintf("emmc_init: failed to map controller registers\n");
+        return;
+    }
     kprintf("emmc initialized\n");
 }
 
@@ -176,25 +266,55 @@ block_device_type_t get_active_block_device_type() {
 }
 
 void set_active_block_device(block_device_type_t type) {
+    block_device_lock_init();
     active_block_device_type = type;
 }
 
+// a caller with no task to put to sleep, like fs_init before sched_init or
+// an idle context, only gets the lock when it is free. before the scheduler
+// runs nothing else can hold it
+static int block_device_lock_take() {
+    if (sched_can_block()) {
+        mutex_lock(&block_device_lock);
+        return 0;
+    }
+    if (mutex_trylock(&block_device_lock)) {
+        return 0;
+    }
+    kprintf("block_device: busy, and the caller cannot sleep\n");
+    return -1;
+}
+
+uint32_t block_device_buffer_align() {
+    return cache_dline_size();
+}
+
 int block_device_read(uint64_t lba, uint32_t num_blocks, uint8_t* buffer) {
+    int ret = -1;
+    if (block_device_lock_take() != 0) {
+        return -1;
+    }
     if (active_block_device_type == BLOCK_DEVICE_TYPE_UFS) {
-        return ufs_read_blocks(lba, num_blocks, buffer);
+        ret = ufs_read_blocks(lba, num_blocks, buffer);
     } else if (active_block_device_type == BLOCK_DEVICE_TYPE_EMMC) {
-        return emmc_read_blocks(lba, num_blocks, buffer);
+        ret = emmc_read_blocks(lba, num_blocks, buffer);
     }
-    return -1;
+    mutex_unlock(&block_device_lock);
+    return ret;
 }
 
 int block_device_write(uint64_t lba, uint32_t num_blocks, const uint8_t* buffer) {
+    int ret = -1;
+    if (block_device_lock_take() != 0) {
+        return -1;
+    }
     if (active_block_device_type == BLOCK_DEVICE_TYPE_UFS) {
-        return ufs_write_blocks(lba, num_blocks, buffer);
+        ret = ufs_write_blocks(lba, num_blocks, buffer);
     } else if (active_block_device_type == BLOCK_DEVICE_TYPE_EMMC) {
-        return emmc_write_blocks(lba, num_blocks, buffer);
+        ret = emmc_write_blocks(lba, num_blocks, buffer);
     }
-    return -1;
+    mutex_unlock(&block_device_lock);
+    return ret;
 }
 
 
@@ -46,7 +46,7 @@ typedef struct {
     uint32_t dword3;
 } prdt_entry_t;
 
-void ufs_init();
+int ufs_init();
 int ufs_read_blocks(uint64_t lba, uint32_t num_blocks, uint8_t* buffer);
 int ufs_write_blocks(uint64_t lba, uint32_t num_blocks, const uint8_t* buffer);
 
@@ -97,6 +97,9 @@ block_device_type_t get_active_block_device_type();
 void set_active_block_device(block_device_type_t type);
 int block_device_read(uint64_t lba, uint32_t num_blocks, uint8_t* buffer);
 int block_device_write(uint64_t lba, uint32_t num_blocks, const uint8_t* buffer);
+// buffers passed to the block layer start on this boundary and their length
+// is a multiple of it, so dma never shares a cache line with other data
+uint32_t block_device_buffer_align();
 
 #endif
 
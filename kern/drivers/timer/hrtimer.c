@@ -0,0 +1,339 @@
+#include "hrtimer.h"
+#include "timer.h"
+#include "cpu.h"
+#include "kmalloc.h"
+#include "lib.h"
+#include "astral_sched.h"
+#include "softirq.h"
+
+#define HRTIMER_WHEEL_SLOTS          256
+#define HRTIMER_WHEEL_GRANULARITY_US 1000
+#define HRTIMER_HEAP_INITIAL         16
+
+typedef struct {
+    hrtimer_t* head;
+    hrtimer_t* tail;
+} hrtimer_list_t;
+
+// one per core. every slot up to wheel_clock has been run; a timer whose
+// deadline is more than a wheel turn away waits in its slot for later turns
+typedef struct {
+    spinlock_t lock;
+    hrtimer_t** heap;
+    uint32_t heap_count;
+    uint32_t heap_capacity;
+    hrtimer_list_t wheel[HRTIMER_WHEEL_SLOTS];
+    uint64_t wheel_bitmap[HRTIMER_WHEEL_SLOTS / 64]; // non-empty slots
+    uint64_t wheel_clock;   // absolute slot number run next
+    hrtimer_t* volatile running; // callback in progress, see hrtimer_cancel
+} hrtimer_base_t;
+
+static hrtimer_base_t bases[MAX_CORES];
+static uint64_t slot_ticks = 0;
+
+uint64_t hrtimer_now() {
+    return cpu_get_system_timer_count();
+}
+
+// split so large values do not overflow the product
+uint64_t hrtimer_ns_to_ticks(uint64_t ns) {
+    uint64_t freq = cpu_get_system_timer_frequency();
+    return ns / 1000000000ULL * freq + ns % 1000000000ULL * freq / 1000000000ULL;
+}
+
+void hrtimer_init() {
+    memset(bases, 0, sizeof(bases));
+    slot_ticks = cpu_get_system_timer_frequency() / 1000000 * HRTIMER_WHEEL_GRANULARITY_US;
+    if (!slot_ticks) {
+        slot_ticks = 1;
+    }
+    uint64_t clock = hrtimer_now() / slot_ticks;
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        spinlock_init(&bases[core].lock);
+        bases[core].wheel_clock = clock;
+    }
+    softirq_register(SOFTIRQ_TIMER, hrtimer_run);
+}
+
+void hrtimer_setup(hrtimer_t* timer, hrtimer_fn fn, void* ctx, uint32_t flags) {
+    memset(timer, 0, sizeof(hrtimer_t));
+    timer->fn = fn;
+    timer->ctx = ctx;
+    timer->flags = flags;
+}
+
+static void heap_swap(hrtimer_base_t* base, uint32_t a, uint32_t b) {
+    hrtimer_t* timer = base->heap[a];
+    base->heap[a] = base->heap[b];
+    base->heap[b] = timer;
+    base->heap[a]->index = a;
+    base->heap[b]->index = b;
+}
+
+static void heap_up(hrtimer_base_t* base, uint32_t index) {
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (base->heap[parent]->expires <= base->heap[index]->expires) {
+            break;
+        }
+        heap_swap(base, parent, index);
+        index = parent;
+    }
+}
+
+static void heap_down(hrtimer_base_t* base, uint32_t index) {
+    while (1) {
+        uint32_t smallest = index;
+        uint32_t left = index * 2 + 1;
+        uint32_t right = left + 1;
+        if (left < base->heap_count && base->heap[left]->expires < base->heap[smallest]->expires) {
+            smallest = left;
+        }
+        if (right < base->heap_count && base->heap[right]->expires < base->heap[smallest]->expires) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            break;
+        }
+        heap_swap(base, index, smallest);
+        index = smallest;
+    }
+}
+
+// double the heap array; called with the base locked and irqs masked
+static int heap_grow(hrtimer_base_t* base) {
+    uint32_t capacity = base->heap_capacity ? base->heap_capacity * 2 : HRTIMER_HEAP_INITIAL;
+    hrtimer_t** heap = (hrtimer_t**)kmalloc(capacity * sizeof(hrtimer_t*));
+    if (!heap) {
+        return -1;
+    }
+    if (base->heap) {
+        memcpy(heap, base->heap, base->heap_count * sizeof(hrtimer_t*));
+        kfree(base->heap);
+    }
+    base->heap = heap;
+    base->heap_capacity = capacity;
+    return 0;
+}
+
+static void heap_insert(hrtimer_base_t* base, hrtimer_t* timer) {
+    timer->index = base->heap_count++;
+    base->heap[timer->index] = timer;
+    heap_up(base, timer->index);
+}
+
+static void heap_remove(hrtimer_base_t* base, hrtimer_t* timer) {
+    uint32_t index = timer->index;
+    base->heap_count--;
+    if (index != base->heap_count) {
+        heap_swap(base, index, base->heap_count);
+        heap_down(base, index);
+        heap_up(base, index);
+    }
+}
+
+// coarse deadlines round up to a slot boundary, and never land in a slot
+// that has already been run
+static void wheel_insert(hrtimer_base_t* base, hrtimer_t* timer) {
+    uint64_t slot = (timer->expires + slot_ticks - 1) / slot_ticks;
+    if (slot < base->wheel_clock) {
+        slot = base->wheel_clock;
+    }
+    uint32_t index = (uint32_t)(slot % HRTIMER_WHEEL_SLOTS);
+    hrtimer_list_t* list = &base->wheel[index];
+    timer->index = index;
+    timer->next = 0;
+    timer->prev = list->tail;
+    if (list->tail) {
+        list->tail->next = timer;
+    } else {
+        list->head = timer;
+    }
+    list->tail = timer;
+    base->wheel_bitmap[index / 64] |= 1ULL << (index % 64);
+}
+
+static void wheel_remove(hrtimer_base_t* base, hrtimer_t* timer) {
+    uint32_t index = timer->index;
+    hrtimer_list_t* list = &base->wheel[index];
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        list->head = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    } else {
+        list->tail = timer->prev;
+    }
+    if (!list->head) {
+        base->wheel_bitmap[index / 64] &= ~(1ULL << (index % 64));
+    }
+    timer->next = 0;
+    timer->prev = 0;
+}
+
+// absolute number of the first non-empty slot from wheel_clock on
+static int wheel_next_slot(hrtimer_base_t* base, uint64_t* slot) {
+    uint32_t offset = 0;
+    while (offset < HRTIMER_WHEEL_SLOTS) {
+        uint32_t index = (uint32_t)((base->wheel_clock + offset) % HRTIMER_WHEEL_SLOTS);
+        uint64_t bits = base->wheel_bitmap[index / 64] >> (index % 64);
+        if (bits) {
+            offset += __builtin_ctzll(bits);
+            if (offset >= HRTIMER_WHEEL_SLOTS) {
+                return 0;
+            }
+            *slot = base->wheel_clock + offset;
+            return 1;
+        }
+        offset += 64 - index % 64;
+    }
+    return 0;
+}
+
+// point this core's comparator at the earliest heap deadline or wheel slot
+static void program_locked(hrtimer_base_t* base) {
+    uint64_t next = 0;
+    if (base->heap_count) {
+        next = base->heap[0]->expires;
+    }
+    uint64_t slot;
+    if (wheel_next_slot(base, &slot) && (!next || slot * slot_ticks < next)) {
+        next = slot * slot_ticks;
+    }
+    if (next) {
+        timer_set_deadline(TIMER_SOURCE_HRTIMER, next);
+    } else {
+        timer_clear_deadline(TIMER_SOURCE_HRTIMER);
+    }
+}
+
+// queue a stopped timer on the calling core to fire once the counter reaches
+// expires. precise timers fall back to the wheel if the heap cannot grow
+int hrtimer_start(hrtimer_t* timer, uint64_t expires) {
+    if (!timer || !timer->fn || timer->state != HRTIMER_INACTIVE) {
+        return -1;
+    }
+    uint64_t flags = cpu_irq_save();
+    uint32_t core = (uint32_t)cpu_get_core_id();
+    hrtimer_base_t* base = &bases[core];
+    spinlock_acquire(&base->lock);
+    timer->expires = expires;
+    timer->cpu = core;
+    timer->state = HRTIMER_QUEUED;
+    timer->next = 0;
+    timer->prev = 0;
+    if (!(timer->flags & HRTIMER_COARSE) &&
+        (base->heap_count < base->heap_capacity || heap_grow(base) == 0)) {
+        timer->in_wheel = 0;
+        heap_insert(base, timer);
+    } else {
+        timer->in_wheel = 1;
+        wheel_insert(base, timer);
+    }
+    program_locked(base);
+    spinlock_release(&base->lock);
+    cpu_irq_restore(flags);
+    return 0;
+}
+
+int hrtimer_start_ns(hrtimer_t* timer, uint64_t ns) {
+    return hrtimer_start(timer, hrtimer_now() + hrtimer_ns_to_ticks(ns));
+}
+
+static void remove_locked(hrtimer_base_t* base, hrtimer_t* timer) {
+    if (timer->in_wheel) {
+        wheel_remove(base, timer);
+    } else {
+        heap_remove(base, timer);
+    }
+    timer->state = HRTIMER_INACTIVE;
+}
+
+// lock the base a timer was started on; the timer may be restarted on
+// another core until the lock is held
+static hrtimer_base_t* lock_timer_base(hrtimer_t* timer) {
+    while (1) {
+        hrtimer_base_t* base = &bases[timer->cpu];
+        spinlock_acquire(&base->lock);
+        if (&bases[timer->cpu] == base) {
+            return base;
+        }
+        spinlock_release(&base->lock);
+    }
+}
+
+// stop a timer. returns 1 if it was still queued, 0 if it had fired or was
+// never started. once this returns the callback is not running anywhere,
+// unless this is called from the callback itself
+int hrtimer_cancel(hrtimer_t* timer) {
+    uint64_t flags = cpu_irq_save();
+    hrtimer_base_t* base = lock_timer_base(timer);
+    int queued = (timer->state == HRTIMER_QUEUED);
+    if (queued) {
+        remove_locked(base, timer);
+        if (base == &bases[cpu_get_core_id()]) {
+            program_locked(base);
+        }
+    }
+    if (base != &bases[cpu_get_core_id()]) {
+        while (base->running == timer) {
+            spinlock_release(&base->lock);
+            spinlock_acquire(&base->lock);
+        }
+    }
+    spinlock_release(&base->lock);
+    cpu_irq_restore(flags);
+    return queued;
+}
+
+// take a timer off the queues and run its callback with the base unlocked,
+// so the callback may start or cancel timers itself
+static void fire_locked(hrtimer_base_t* base, hrtimer_t* timer) {
+    remove_locked(base, timer);
+    base->running = timer;
+    spinlock_release(&base->lock);
+    timer->fn(timer->ctx);
+    spinlock_acquire(&base->lock);
+    base->running = 0;
+}
+
+// run every expired timer of this core; the timer softirq. irqs stay masked
+// throughout, since handlers may start or cancel timers on this base
+void hrtimer_run() {
+    uint64_t flags = cpu_irq_save();
+    hrtimer_base_t* base = &bases[cpu_get_core_id()];
+    spinlock_acquire(&base->lock);
+    uint64_t now = hrtimer_now();
+    while (base->heap_count && base->heap[0]->expires <= now) {
+        fire_locked(base, base->heap[0]);
+    }
+
+    uint64_t now_slot = now / slot_ticks;
+    if (now_slot >= base->wheel_clock) {
+        uint64_t first = base->wheel_clock;
+        uint64_t count = now_slot - first + 1;
+        if (count > HRTIMER_WHEEL_SLOTS) {
+            count = HRTIMER_WHEEL_SLOTS;
+        }
+        for (uint64_t slot = first; slot < first + count; slot++) {
+            // timers queued by a callback land in this slot or a later one
+            base->wheel_clock = slot;
+            hrtimer_list_t* list = &base->wheel[slot % HRTIMER_WHEEL_SLOTS];
+            hrtimer_t* timer = list->head;
+            while (timer) {
+                if (timer->expires <= now) {
+                    fire_locked(base, timer);
+                    timer = list->head;
+                } else {
+                    timer = timer->next;
+                }
+            }
+        }
+        base->wheel_clock = now_slot + 1;
+    }
+    program_locked(base);
+    spinlock_release(&base->lock);
+    cpu_irq_restore(flags);
+}
@@ -0,0 +1,42 @@
+#ifndef HRTIMER_H
+#define HRTIMER_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// one-shot timers on top of the system counter, kept per core. precise
+// timers sit in a min-heap and fire at their exact deadline; coarse ones,
+// meant for timeouts that are usually cancelled, go into a timer wheel with
+// HRTIMER_WHEEL_GRANULARITY_US slots and fire up to one slot late
+#define HRTIMER_COARSE (1 << 0)
+
+#define HRTIMER_INACTIVE 0
+#define HRTIMER_QUEUED   1
+
+// runs on the core that started the timer, in the timer softirq with irqs
+// masked. it may start the timer again
+typedef void (*hrtimer_fn)(void* ctx);
+
+typedef struct hrtimer {
+    uint64_t expires;       // counter value
+    hrtimer_fn fn;
+    void* ctx;
+    uint32_t flags;
+    volatile uint32_t state;
+    uint32_t cpu;           // core whose queues hold it
+    uint32_t in_wheel;      // queued as a coarse timer
+    uint32_t index;         // position in the precise heap, or wheel slot
+    struct hrtimer* next;   // wheel slot links
+    struct hrtimer* prev;
+} hrtimer_t;
+
+void hrtimer_init();
+void hrtimer_setup(hrtimer_t* timer, hrtimer_fn fn, void* ctx, uint32_t flags);
+int hrtimer_start(hrtimer_t* timer, uint64_t expires);
+int hrtimer_start_ns(hrtimer_t* timer, uint64_t ns);
+int hrtimer_cancel(hrtimer_t* timer);
+void hrtimer_run();
+uint64_t hrtimer_now();
+uint64_t hrtimer_ns_to_ticks(uint64_t ns);
+
+#endif // HRTIMER_H
@@ -1,30 +1,91 @@
 #include "timer.h"
-#include "../../cpu/cpu.h"
-#include "../../sched/astral_sched.h"
+#include "cpu.h"
+#include "gic.h"
+#include "hrtimer.h"
+#include "softirq.h"
+#include "astral_sched.h"
 
-#define CNTFRQ_EL0 (volatile uint64_t*)0x40000000
-#define CNTP_CTL_EL0 (volatile uint32_t*)0x40000008
-#define CNTP_TVAL_EL0 (volatile uint32_t*)0x4000000C
-#define CNTP_CVAL_EL0 (volatile uint64_t*)0x40000010
+#define CNTP_CTL_ENABLE (1 << 0)
+#define CNTP_CTL_IMASK  (1 << 1)
 
-static uint64_t timer_frequency = 0;
+// per core deadlines in counter ticks, 0 when unset
+static uint64_t deadlines[MAX_CORES][TIMER_SOURCE_COUNT];
 
-void timer_init() {
-    timer_frequency = *CNTFRQ_EL0;
+static inline void write_cval(uint64_t cval) {
+    asm volatile("msr cntp_cval_el0, %0" : : "r"(cval));
+}
+
+static inline void write_ctl(uint64_t ctl) {
+    asm volatile("msr cntp_ctl_el0, %0" : : "r"(ctl));
+    asm volatile("isb");
+}
+
+// load the comparator with the earliest deadline of this core, or turn it off
+static void timer_program(uint64_t* core_deadlines) {
+    uint64_t next = 0;
+    for (uint32_t source = 0; source < TIMER_SOURCE_COUNT; source++) {
+        uint64_t deadline = core_deadlines[source];
+        if (deadline && (!next || deadline < next)) {
+            next = deadline;
+        }
+    }
+    if (next) {
+        write_cval(next);
+        write_ctl(CNTP_CTL_ENABLE);
+    } else {
+        write_ctl(0);
+    }
 }
 
-void timer_enable_interrupt() {
-    *CNTP_TVAL_EL0 = timer_frequency / 100; // 10ms interrupt
-    *CNTP_CTL_EL0 = 1; // enable timer, enable interrupt
+static void timer_handle_interrupt(uint32_t irq) {
+    (void)irq;
+    uint64_t* core_deadlines = deadlines[cpu_get_core_id()];
+    uint64_t now = cpu_get_system_timer_count();
+    for (uint32_t source = 0; source < TIMER_SOURCE_COUNT; source++) {
+        if (core_deadlines[source] && core_deadlines[source] <= now) {
+            core_deadlines[source] = 0;
+        }
+    }
+    // the comparator keeps the interrupt asserted until it moves past now.
+    // expired hrtimers run later in the timer softirq
+    timer_program(core_deadlines);
+    softirq_raise(SOFTIRQ_TIMER);
+    sched_tick();
 }
 
-void timer_disable_interrupt() {
-    *CNTP_CTL_EL0 = 0; // disable timer, disable interrupt
+void timer_init() {
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        for (uint32_t source = 0; source < TIMER_SOURCE_COUNT; source++) {
+            deadlines[core][source] = 0;
+        }
+    }
+    gic_register(TIMER_IRQ, timer_handle_interrupt);
 }
 
-void timer_handle_interrupt() {
-    *CNTP_TVAL_EL0 = timer_frequency / 100; // reset timer for next interrupt
-    sched_yield();
+// the comparator and its ppi are per core, every core calls this before it
+// schedules
+void timer_init_cpu() {
+    write_ctl(0);
+    gic_enable_irq(TIMER_IRQ);
 }
 
+void timer_delay_ms(uint32_t ms) {
+    uint64_t start = cpu_get_system_timer_count();
+    uint64_t ticks = cpu_get_system_timer_frequency() / 1000 * ms;
+    while (cpu_get_system_timer_count() - start < ticks);
+}
 
+// deadlines belong to the calling core; callers keep irqs masked
+void timer_set_deadline(timer_source_t source, uint64_t deadline) {
+    uint64_t* core_deadlines = deadlines[cpu_get_core_id()];
+    core_deadlines[source] = deadline ? deadline : 1;
+    timer_program(core_deadlines);
+}
+
+void timer_clear_deadline(timer_source_t source) {
+    uint64_t* core_deadlines = deadlines[cpu_get_core_id()];
+    if (core_deadlines[source]) {
+        core_deadlines[source] = 0;
+        timer_program(core_deadlines);
+    }
+}
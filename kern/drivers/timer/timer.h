@@ -4,12 +4,22 @@
 typedef unsigned long long uint64_t;
 typedef unsigned int uint32_t;
 
+// the el1 physical timer, ppi 14
+#define TIMER_IRQ 30
+
+// every core has one comparator, shared by several users that each keep a
+// deadline of their own. the comparator is set to the earliest of them and
+// stays off while none is set, so a core gets no tick it does not need
+typedef enum {
+    TIMER_SOURCE_SCHED,   // end of the running task's slice
+    TIMER_SOURCE_HRTIMER, // earliest hrtimer of the core
+    TIMER_SOURCE_COUNT
+} timer_source_t;
+
 void timer_init();
+void timer_init_cpu();
 void timer_delay_ms(uint32_t ms);
-void timer_enable_interrupt();
-void timer_disable_interrupt();
-void timer_handle_interrupt();
+void timer_set_deadline(timer_source_t source, uint64_t deadline);
+void timer_clear_deadline(timer_source_t source);
 
 #endif
-
-
@@ -1,6 +1,7 @@
 #include "fs.h"
 #include "block_device.h"
-#include "kmalloc.h"
+#include "arena.h"
+#include "pmm.h"
 #include "kprintf.h"
 #include "lib.h"
 
@@ -10,6 +11,17 @@ static superblock_t current_superblock;
 static uint8_t* inode_bitmap = 0;
 static uint8_t* block_bitmap = 0;
 
+// block buffers are dma targets, so they are aligned for the block layer
+static uint8_t* alloc_block_buffer(arena_t* scratch) {
+    return arena_alloc_aligned(scratch, FS_BLOCK_SIZE, block_device_buffer_align());
+}
+
+// the bitmaps are read and written in place by dma, so they get whole pages
+static uint8_t* alloc_bitmap(uint32_t blocks) {
+    uint64_t pa = pmm_alloc_pages(pmm_order_for_size((uint64_t)blocks * FS_BLOCK_SIZE));
+    return pa ? (uint8_t*)PHYS_TO_VIRT(pa) : 0;
+}
+
 static int read_block(uint32_t block_num, uint8_t* buffer) {
     return block_device_read(block_num, 1, buffer);
 }
@@ -18,40 +30,49 @@ static int write_block(uint32_t block_num, const uint8_t* buffer) {
     return block_device_write(block_num, 1, buffer);
 }
 
-static inode_t* get_inode(uint32_t inode_id) {
+// the returned copy lives in the caller's scratch arena and goes away with
+// the caller's arena_release(); the block buffer is dropped before returning
+static inode_t* get_inode(arena_t* scratch, uint32_t inode_id) {
     if (inode_id == 0 || inode_id > current_superblock.total_inodes) return 0;
 
     uint32_t block_offset = (inode_id - 1) / (FS_BLOCK_SIZE / sizeof(inode_t));
     uint32_t inode_offset_in_block = (inode_id - 1) % (FS_BLOCK_SIZE / sizeof(inode_t));
     uint32_t inode_block_num = current_superblock.inode_table_start_block + block_offset;
 
-    uint8_t block_buffer[FS_BLOCK_SIZE];
-    if (read_block(inode_block_num, block_buffer) != 0) {
+    inode_t* inode = arena_alloc(scratch, sizeof(inode_t));
+    if (!inode) return 0;
+
+    arena_mark_t mark = arena_mark(scratch);
+    uint8_t* block_buffer = alloc_block_buffer(scratch);
+    if (!block_buffer || read_block(inode_block_num, block_buffer) != 0) {
+        arena_release(scratch, mark);
         return 0;
     }
 
-    inode_t* inode = kmalloc(sizeof(inode_t));
-    if (inode) {
-        memcpy(inode, &((inode_t*)block_buffer)[inode_offset_in_block], sizeof(inode_t));
-    }
+    memcpy(inode, &((inode_t*)block_buffer)[inode_offset_in_block], sizeof(inode_t));
+    arena_release(scratch, mark);
     return inode;
 }
 
-static int write_inode(uint32_t inode_id, const inode_t* inode) {
+static int write_inode(arena_t* scratch, uint32_t inode_id, const inode_t* inode) {
     if (inode_id == 0 || inode_id > current_superblock.total_inodes) return -1;
 
     uint32_t block_offset = (inode_id - 1) / (FS_BLOCK_SIZE / sizeof(inode_t));
     uint32_t inode_offset_in_block = (inode_id - 1) % (FS_BLOCK_SIZE / sizeof(inode_t));
     uint32_t inode_block_num = current_superblock.inode_table_start_block + block_offset;
 
-    uint8_t block_buffer[FS_BLOCK_SIZE];
-    if (read_block(inode_block_num, block_buffer) != 0) {
+    arena_mark_t mark = arena_mark(scratch);
+    uint8_t* block_buffer = alloc_block_buffer(scratch);
+    if (!block_buffer || read_block(inode_block_num, block_buffer) != 0) {
+        arena_release(scratch, mark);
         return -1;
     }
 
     memcpy(&((inode_t*)block_buffer)[inode_offset_in_block], inode, sizeof(inode_t));
 
-    return write_block(inode_block_num, block_buffer);
+    int ret = write_block(inode_block_num, block_buffer);
+    arena_release(scratch, mark);
+    return ret;
 }
 
 static uint32_t allocate_inode() {
@@ -93,7 +114,12 @@ static void free_block(uint32_t block_num) {
 }
 
 void fs_init() {
-    uint8_t superblock_buffer[FS_BLOCK_SIZE];
+    arena_t* scratch = arena_scratch();
+    if (!scratch) return;
+    arena_mark_t mark = arena_mark(scratch);
+    uint8_t* superblock_buffer = alloc_block_buffer(scratch);
+    if (!superblock_buffer) return;
+
     if (read_block(0, superblock_buffer) != 0) {
         memset(&current_superblock, 0, sizeof(superblock_t));
         current_superblock.magic = FS_MAGIC;
@@ -116,8 +142,13 @@ void fs_init() {
         memcpy(superblock_buffer, &current_superblock, sizeof(superblock_t));
         write_block(0, superblock_buffer);
 
-        inode_bitmap = kmalloc(inode_bitmap_blocks * FS_BLOCK_SIZE);
-        block_bitmap = kmalloc(block_bitmap_blocks * FS_BLOCK_SIZE);
+        inode_bitmap = alloc_bitmap(inode_bitmap_blocks);
+        block_bitmap = alloc_bitmap(block_bitmap_blocks);
+        if (!inode_bitmap || !block_bitmap) {
+            kprintf("fs_init: no memory for the bitmaps\n");
+            arena_release(scratch, mark);
+            return;
+        }
         memset(inode_bitmap, 0, inode_bitmap_blocks * FS_BLOCK_SIZE);
         memset(block_bitmap, 0, block_bitmap_blocks * FS_BLOCK_SIZE);
 
@@ -137,7 +168,7 @@ void fs_init() {
         root_inode.size = 0;
         root_inode.creation_time = 0;
         root_inode.modification_time = 0;
-        write_inode(root_inode_id, &root_inode);
+        write_inode(scratch, root_inode_id, &root_inode);
         current_superblock.root_inode = root_inode_id;
 
         memcpy(superblock_buffer, &current_superblock, sizeof(superblock_t));
@@ -145,35 +176,46 @@ void fs_init() {
     } else {
         memcpy(&current_superblock, superblock_buffer, sizeof(superblock_t));
         if (current_superblock.magic != FS_MAGIC) {
+            arena_release(scratch, mark);
             return;
         }
 
         uint32_t inode_bitmap_blocks = (current_superblock.total_inodes / 8 + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
         uint32_t block_bitmap_blocks = (current_superblock.total_blocks / 8 + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
-        inode_bitmap = kmalloc(inode_bitmap_blocks * FS_BLOCK_SIZE);
-        block_bitmap = kmalloc(block_bitmap_blocks * FS_BLOCK_SIZE);
+        inode_bitmap = alloc_bitmap(inode_bitmap_blocks);
+        block_bitmap = alloc_bitmap(block_bitmap_blocks);
+        if (!inode_bitmap || !block_bitmap) {
+            kprintf("fs_init: no memory for the bitmaps\n");
+            arena_release(scratch, mark);
+            return;
+        }
         read_block(current_superblock.inode_bitmap_block, inode_bitmap);
         read_block(current_superblock.block_bitmap_block, block_bitmap);
     }
+    arena_release(scratch, mark);
 }
 
 uint32_t fs_create(uint32_t parent_inode_id, const char* name, uint16_t type) {
     if (strlen(name) > FS_MAX_FILENAME_LEN) return 0;
 
-    inode_t* parent_inode = get_inode(parent_inode_id);
+    arena_t* scratch = arena_scratch();
+    if (!scratch) return 0;
+    arena_mark_t mark = arena_mark(scratch);
+
+    inode_t* parent_inode = get_inode(scratch, parent_inode_id);
     if (!parent_inode || !(parent_inode->type & FS_INODE_TYPE_DIR)) {
-        kfree(parent_inode);
+        arena_release(scratch, mark);
         return 0;
     }
 
     if (fs_lookup(parent_inode_id, name) != 0) {
-        kfree(parent_inode);
+        arena_release(scratch, mark);
         return 0;
     }
 
     uint32_t new_inode_id = allocate_inode();
     if (new_inode_id == 0) {
-        kfree(parent_inode);
+        arena_release(scratch, mark);
         return 0;
     }
 
@@ -184,14 +226,18 @@ uint32_t fs_create(uint32_t parent_inode_id, const char* name, uint16_t type) {
     new_inode.permissions = 0644;
     new_inode.creation_time = 0;
     new_inode.modification_time = 0;
-    write_inode(new_inode_id, &new_inode);
+    write_inode(scratch, new_inode_id, &new_inode);
 
     dir_entry_t new_entry;
     new_entry.inode_id = new_inode_id;
     strncpy(new_entry.name, name, FS_MAX_FILENAME_LEN);
     new_entry.name[FS_MAX_FILENAME_LEN] = '\0';
 
-    uint8_t dir_block_buffer[FS_BLOCK_SIZE];
+    uint8_t* dir_block_buffer = alloc_block_buffer(scratch);
+    if (!dir_block_buffer) {
+        arena_release(scratch, mark);
+        return 0;
+    }
     int found_spot = 0;
     for (int i = 0; i < 10; i++) {
         if (parent_inode->direct_blocks[i] == 0) {
@@ -208,7 +254,7 @@ uint32_t fs_create(uint32_t parent_inode_id, const char* name, uint16_t type) {
                 memcpy(entry, &new_entry, sizeof(dir_entry_t));
                 write_block(parent_inode->direct_blocks[i], dir_block_buffer);
                 parent_inode->size += sizeof(dir_entry_t);
-                write_inode(parent_inode_id, parent_inode);
+                write_inode(scratch, parent_inode_id, parent_inode);
                 found_spot = 1;
                 break;
             }
@@ -216,20 +262,28 @@ uint32_t fs_create(uint32_t parent_inode_id, const char* name, uint16_t type) {
         if (found_spot) break;
     }
 
-    kfree(parent_inode);
+    arena_release(scratch, mark);
     return new_inode_id;
 }
 
 int fs_delete(uint32_t parent_inode_id, const char* name) {
     if (strlen(name) > FS_MAX_FILENAME_LEN) return -1;
 
-    inode_t* parent_inode = get_inode(parent_inode_id);
+    arena_t* scratch = arena_scratch();
+    if (!scratch) return -1;
+    arena_mark_t mark = arena_mark(scratch);
+
+    inode_t* parent_inode = get_inode(scratch, parent_inode_id);
     if (!parent_inode || !(parent_inode->type & FS_INODE_TYPE_DIR)) {
-        kfree(parent_inode);
+        arena_release(scratch, mark);
         return -1;
     }
 
-    uint8_t dir_block_buffer[FS_BLOCK_SIZE];
+    uint8_t* dir_block_buffer = alloc_block_buffer(scratch);
+    if (!dir_block_buffer) {
+        arena_release(scratch, mark);
+        return -1;
+    }
     uint32_t target_inode_id = 0;
     int found_entry = 0;
 
@@ -243,7 +297,7 @@ int fs_delete(uint32_t parent_inode_id, const char* name) {
                 memset(entry, 0, sizeof(dir_entry_t));
                 write_block(parent_inode->direct_blocks[i], dir_block_buffer);
                 parent_inode->size -= sizeof(dir_entry_t);
-                write_inode(parent_inode_id, parent_inode);
+                write_inode(scratch, parent_inode_id, parent_inode);
                 found_entry = 1;
                 break;
             }
@@ -251,12 +305,11 @@ int fs_delete(uint32_t parent_inode_id, const char* name) {
         if (found_entry) break;
     }
 
-    kfree(parent_inode);
-
-    if (target_inode_id == 0) return -1;
-
-    inode_t* target_inode = get_inode(target_inode_id);
-    if (!target_inode) return -1;
+    inode_t* target_inode = target_inode_id ? get_inode(scratch, target_inode_id) : 0;
+    if (!target_inode) {
+        arena_release(scratch, mark);
+        return -1;
+    }
 
     for (int i = 0; i < 10; i++) {
         if (target_inode->direct_blocks[i] != 0) {
@@ -265,7 +318,7 @@ int fs_delete(uint32_t parent_inode_id, const char* name) {
     }
 
     free_inode(target_inode_id);
-    kfree(target_inode);
+    arena_release(scratch, mark);
 
     return 0;
 }
@@ -273,13 +326,21 @@ int fs_delete(uint32_t parent_inode_id, const char* name) {
 uint32_t fs_lookup(uint32_t parent_inode_id, const char* name) {
     if (strlen(name) > FS_MAX_FILENAME_LEN) return 0;
 
-    inode_t* parent_inode = get_inode(parent_inode_id);
+    arena_t* scratch = arena_scratch();
+    if (!scratch) return 0;
+    arena_mark_t mark = arena_mark(scratch);
+
+    inode_t* parent_inode = get_inode(scratch, parent_inode_id);
     if (!parent_inode || !(parent_inode->type & FS_INODE_TYPE_DIR)) {
-        kfree(parent_inode);
+        arena_release(scratch, mark);
         return 0;
     }
 
-    uint8_t dir_block_buffer[FS_BLOCK_SIZE];
+    uint8_t* dir_block_buffer = alloc_block_buffer(scratch);
+    if (!dir_block_buffer) {
+        arena_release(scratch, mark);
+        return 0;
+    }
     for (int i = 0; i < 10; i++) {
         if (parent_inode->direct_blocks[i] == 0) continue;
         read_block(parent_inode->direct_blocks[i], dir_block_buffer);
@@ -287,32 +348,40 @@ uint32_t fs_lookup(uint32_t parent_inode_id, const char* name) {
             dir_entry_t* entry = (dir_entry_t*)&dir_block_buffer[j * sizeof(dir_entry_t)];
             if (entry->inode_id != 0 && strcmp(entry->name, name) == 0) {
                 uint32_t found_id = entry->inode_id;
-                kfree(parent_inode);
+                arena_release(scratch, mark);
                 return found_id;
             }
         }
     }
 
-    kfree(parent_inode);
+    arena_release(scratch, mark);
     return 0;
 }
 
 int fs_read(uint32_t inode_id, uint64_t offset, uint8_t* buffer, uint64_t count) {
-    inode_t* inode = get_inode(inode_id);
+    arena_t* scratch = arena_scratch();
+    if (!scratch) return -1;
+    arena_mark_t mark = arena_mark(scratch);
+
+    inode_t* inode = get_inode(scratch, inode_id);
     if (!inode || !(inode->type & FS_INODE_TYPE_FILE)) {
-        kfree(inode);
+        arena_release(scratch, mark);
         return -1;
     }
     if (offset + count > inode->size) {
         count = inode->size - offset;
     }
     if (count == 0) {
-        kfree(inode);
+        arena_release(scratch, mark);
         return 0;
     }
 
     uint64_t bytes_read = 0;
-    uint8_t data_block_buffer[FS_BLOCK_SIZE];
+    uint8_t* data_block_buffer = alloc_block_buffer(scratch);
+    if (!data_block_buffer) {
+        arena_release(scratch, mark);
+        return -1;
+    }
 
     while (bytes_read < count) {
         uint64_t current_file_offset = offset + bytes_read;
@@ -331,7 +400,7 @@ int fs_read(uint32_t inode_id, uint64_t offset, uint8_t* buffer, uint64_t count)
         }
 
         if (read_block(data_block_num, data_block_buffer) != 0) {
-            kfree(inode);
+            arena_release(scratch, mark);
             return -1;
         }
 
@@ -343,19 +412,27 @@ int fs_read(uint32_t inode_id, uint64_t offset, uint8_t* buffer, uint64_t count)
         bytes_read += bytes_to_copy;
     }
 
-    kfree(inode);
+    arena_release(scratch, mark);
     return bytes_read;
 }
 
 int fs_write(uint32_t inode_id, uint64_t offset, const uint8_t* buffer, uint64_t count) {
-    inode_t* inode = get_inode(inode_id);
+    arena_t* scratch = arena_scratch();
+    if (!scratch) return -1;
+    arena_mark_t mark = arena_mark(scratch);
+
+    inode_t* inode = get_inode(scratch, inode_id);
     if (!inode || !(inode->type & FS_INODE_TYPE_FILE)) {
-        kfree(inode);
+        arena_release(scratch, mark);
         return -1;
     }
 
     uint64_t bytes_written = 0;
-    uint8_t data_block_buffer[FS_BLOCK_SIZE];
+    uint8_t* data_block_buffer = alloc_block_buffer(scratch);
+    if (!data_block_buffer) {
+        arena_release(scratch, mark);
+        return -1;
+    }
 
     while (bytes_written < count) {
         uint64_t current_file_offset = offset + bytes_written;
@@ -371,14 +448,14 @@ int fs_write(uint32_t inode_id, uint64_t offset, const uint8_t* buffer, uint64_t
                     break;
                 }
                 inode->direct_blocks[block_idx] = data_block_num;
-                write_inode(inode_id, inode);
+                write_inode(scratch, inode_id, inode);
             }
         } else {
             break;
         }
 
         if (read_block(data_block_num, data_block_buffer) != 0) {
-            kfree(inode);
+            arena_release(scratch, mark);
             return -1;
         }
 
@@ -393,10 +470,10 @@ int fs_write(uint32_t inode_id, uint64_t offset, const uint8_t* buffer, uint64_t
 
     if (offset + bytes_written > inode->size) {
         inode->size = offset + bytes_written;
-        write_inode(inode_id, inode);
+        write_inode(scratch, inode_id, inode);
     }
 
-    kfree(inode);
+    arena_release(scratch, mark);
     return bytes_written;
 }
 
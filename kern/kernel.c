@@ -6,21 +6,43 @@
 #include "security.h"
 #include "astral_sched.h"
 #include "kmalloc.h"
+#include "pmm.h"
 #include "kprintf.h"
 #include "fs.h"
 #include "block_device.h"
 #include "vfs.h"         
-#include "../drivers/timer/timer.h"
+#include "timer.h"
+#include "hrtimer.h"
+#include "gic.h"
 #include "lib.h"
+#include "bench.h"
+#include "smp.h"
+#include "fpsimd.h"
+#include "softirq.h"
+#include "workqueue.h"
+#include "debug_keys.h"
 
 extern void _exception_vectors();
+extern char __kernel_start[];
+extern char __kernel_end[];
+
+#define KERNEL_HEAP_SIZE (32 * 1024 * 1024)
+
+// move the start of usable ram past a reserved range that overlaps it; ram
+// below the reserved range is simply left unused
+static uint64_t skip_reserved_range(uint64_t start, uint64_t end, uint64_t reserved_start, uint64_t reserved_end) {
+    if (reserved_end > start && reserved_start < end) {
+        return ALIGN_UP(reserved_end, PMM_PAGE_SIZE);
+    }
+    return start;
+}
 
 void dummy_task_func_a() {
     int counter = 0;
     while (1) {
         kprintf("task a running! counter: %d\n", counter);
         counter++;
-        sched_yield();
+        sched_sleep_ns(500000000ULL);
     }
 }
 
@@ -29,27 +51,39 @@ void dummy_task_func_b() {
     while (1) {
         kprintf("task b running! counter: %d\n", counter);
         counter++;
-        sched_yield();
+        sched_sleep_ns(1000000000ULL);
     }
 }
 
+// background task that folds fragmented page mappings back into large blocks
+void vm_promote_task_func() {
+    while (1) {
+        vm_promote_pass();
+        sched_sleep_ns(100000000ULL);
+    }
+}
+
+#ifdef ASTRAL_BENCH
+void bench_task_spawn_func() {
+    bench_task_spawn(1024);
+}
+#endif
+
 void kernel_main(uint64_t dtb_addr) {
     uart_init(); // initialize uart early
 
     check_and_halt_core();
+    cpu_init_states();
     cpu_set_state(CPU_STATE_RUNNING);
     
     asm volatile("msr vbar_el1, %0" : : "r"((uint64_t)_exception_vectors));
 
-    vm_init();
-    cpu_enable_mmu(); 
-    
     uint64_t fb_base = 0;
     uint32_t fb_width = 0;
     uint32_t fb_height = 0;
     uint32_t fb_pitch = 0;
 
-    dtb_init(dtb_addr);
+    dtb_init((uint64_t)PHYS_TO_VIRT(dtb_addr));
 
     // explicitly parse framebuffer info from dtb
     uint32_t len;
@@ -67,7 +101,7 @@ void kernel_main(uint64_t dtb_addr) {
     }
 
     // initialize kprintf with framebuffer parameters
-    uint32_t* fb = (uint32_t*)fb_base;
+    uint32_t* fb = (uint32_t*)PHYS_TO_VIRT(fb_base);
     kprintf_init(fb, fb_width, fb_height, fb_pitch);
 
     // clear the framebuffer
@@ -77,13 +111,55 @@ void kernel_main(uint64_t dtb_addr) {
     
     kprintf("astral os\n");
 
-    // initialize kmalloc with memory range obtained from dtb if available
+    // the kmalloc heap takes the start of ram above the kernel image and the
+    // dtb, the buddy allocator manages everything after it
     uint64_t mem_start, mem_size;
-    if (dtb_get_memory_info(&mem_start, &mem_size) == 0) {
-        kmalloc_init(mem_start, mem_size);
-    } else {
-        kmalloc_init(0x80000000, 256 * 1024 * 1024);
+    if (dtb_get_memory_info(&mem_start, &mem_size) != 0) {
+        mem_start = 0x80000000;
+        mem_size = 256 * 1024 * 1024;
     }
+    uint64_t mem_end = mem_start + mem_size;
+    uint64_t ram_start = mem_start;
+    mem_start = skip_reserved_range(mem_start, mem_end, VIRT_TO_PHYS(__kernel_start), VIRT_TO_PHYS(__kernel_end));
+    uint64_t dtb_start, dtb_size;
+    if (dtb_get_blob_range(&dtb_start, &dtb_size) == 0) {
+        dtb_start = VIRT_TO_PHYS(dtb_start);
+        mem_start = skip_reserved_range(mem_start, mem_end, dtb_start, dtb_start + dtb_size);
+    }
+    kmalloc_init((uint64_t)PHYS_TO_VIRT(mem_start), KERNEL_HEAP_SIZE);
+    pmm_init(mem_start + KERNEL_HEAP_SIZE, mem_end - mem_start - KERNEL_HEAP_SIZE);
+
+    // page tables come from the buddy allocator, so the boot mapping is replaced after it
+    vm_init();
+    if (ram_start < VM_KERNEL_LOW_MAP_END) {
+        ram_start = VM_KERNEL_LOW_MAP_END;
+    }
+    if (mem_end > ram_start) {
+        vm_map((uint64_t)PHYS_TO_VIRT(ram_start), ram_start, mem_end - ram_start, VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXEC | VM_PROT_KERNEL);
+    }
+    // the framebuffer is device memory, whether it sits inside ram or beside it
+    uint64_t fb_map_base = fb_base & ~(PMM_PAGE_SIZE - 1);
+    uint64_t fb_map_size = ALIGN_UP(fb_base + (uint64_t)fb_height * fb_pitch, PMM_PAGE_SIZE) - fb_map_base;
+    uint32_t fb_prot = VM_PROT_READ | VM_PROT_WRITE | VM_PROT_KERNEL | VM_PROT_DEVICE;
+    if (fb_map_base >= VM_KERNEL_LOW_MAP_END) {
+        if (fb_map_base >= ram_start && fb_map_base + fb_map_size <= mem_end) {
+            vm_protect((uint64_t)PHYS_TO_VIRT(fb_map_base), fb_map_size, fb_prot);
+        } else {
+            vm_map((uint64_t)PHYS_TO_VIRT(fb_map_base), fb_map_base, fb_map_size, fb_prot);
+        }
+    }
+    // the uart sits in the low linear map, which is normal memory, and cpu_enable_mmu turns on the caches
+    vm_map_device(UART_PA, PMM_PAGE_SIZE);
+    cpu_enable_mmu();
+    gic_init();
+
+    // the other cores join on the kernel tables, so only after they are live
+    smp_init();
+
+#ifdef ASTRAL_BENCH
+    bench_kmalloc_contention(smp_cores_online());
+    bench_context_switch();
+#endif
 
     // set the active block device and initialize the filesystem layer
     set_active_block_device(BLOCK_DEVICE_TYPE_UFS);
@@ -106,11 +182,18 @@ void kernel_main(uint64_t dtb_addr) {
     }
     
     sched_init();
+    softirq_init();
+    workqueue_init(smp_cores_online());
+    debug_keys_init();
     sched_create_task(dummy_task_func_a, 4096);
     sched_create_task(dummy_task_func_b, 4096);
+    sched_create_task(vm_promote_task_func, 4096);
+#ifdef ASTRAL_BENCH
+    sched_create_task(bench_task_spawn_func, 4096);
+#endif
 
     timer_init();
-    timer_enable_interrupt();
+    hrtimer_init();
     cpu_enable_interrupts();
 
     sched_schedule();
@@ -121,5 +204,18 @@ void kernel_main(uint64_t dtb_addr) {
 }
 
 void exception_handler(uint64_t sp, uint32_t type) {
-    crash_core_panic("unhandled exception type %d at sp 0x%llx\n", type, sp);
+    uint64_t esr, far;
+    asm volatile("mrs %0, esr_el1" : "=r"(esr));
+    asm volatile("mrs %0, far_el1" : "=r"(far));
+
+    // synchronous aborts on lazily backed regions are resolved and retried
+    if ((type == 0 || type == 4) && vm_handle_fault(esr, far) == 0) {
+        return;
+    }
+    // so is the first fp/simd instruction of a task after a switch
+    if ((type == 0 || type == 4) && ((esr >> ESR_EC_SHIFT) & ESR_EC_MASK) == ESR_EC_FP_ACCESS &&
+        fpsimd_handle_trap() == 0) {
+        return;
+    }
+    crash_core_panic("unhandled exception type %d at sp 0x%llx esr 0x%llx far 0x%llx\n", type, sp, esr, far);
 }
@@ -1,8 +1,9 @@
 #include "lib.h"
+#include "pmm.h"
 
 // a very basic uart putc for qemu virt machine
-// this assumes a pl011 uart at 0x09000000
-#define UART_BASE   0x09000000
+// this assumes a pl011 uart at UART_PA, reached through the kernel linear map
+#define UART_BASE   ((uint64_t)PHYS_TO_VIRT(UART_PA))
 #define UART_DR     ((volatile uint32_t*)(UART_BASE + 0x00))
 #define UART_FR     ((volatile uint32_t*)(UART_BASE + 0x18))
 #define UART_IBRD   ((volatile uint32_t*)(UART_BASE + 0x24))
@@ -10,13 +11,17 @@
 #define UART_LCRH   ((volatile uint32_t*)(UART_BASE + 0x2C))
 #define UART_CR     ((volatile uint32_t*)(UART_BASE + 0x30))
 #define UART_IMSC   ((volatile uint32_t*)(UART_BASE + 0x38))
+#define UART_ICR    ((volatile uint32_t*)(UART_BASE + 0x44))
 
+#define UART_FR_RXFE (1 << 4)
 #define UART_FR_TXFF (1 << 5)
 #define UART_CR_UARTEN (1 << 0)
 #define UART_CR_TXE (1 << 8)
 #define UART_CR_RXE (1 << 9)
 #define UART_LCRH_FEN (1 << 4)
 #define UART_LCRH_WLEN_8BIT (0x3 << 5)
+#define UART_INT_RX (1 << 4) // rx fifo reached its trigger level
+#define UART_INT_RT (1 << 6) // rx timeout, fewer bytes than the level are waiting
 
 void uart_init() {
     // disable uart
@@ -38,6 +43,20 @@ void uart_putc(char c) {
     *UART_DR = c;
 }
 
+// next received byte, or -1 when the rx fifo is empty
+int uart_getc() {
+    if (*UART_FR & UART_FR_RXFE) {
+        return -1;
+    }
+    return (int)(*UART_DR & 0xFF);
+}
+
+// raise UART_IRQ when input arrives; draining the fifo with uart_getc clears it
+void uart_enable_rx_interrupt() {
+    *UART_ICR = UART_INT_RX | UART_INT_RT;
+    *UART_IMSC = UART_INT_RX | UART_INT_RT;
+}
+
 void* memset(void* s, int c, uint64_t n) {
     uint8_t* p = (uint8_t*)s;
     while (n--) {
@@ -101,7 +120,9 @@ uint64_t strlen(const char* s) {
     return len;
 }
 
-static void itoa(long long num, char* str, int base) {
+// digits of an unsigned magnitude, so hex of a kernel address (top bit set)
+// comes out right; is_negative only adds the sign
+static void itoa(unsigned long long num, char* str, int base, int is_negative) {
     char* ptr = str;
     char* ptr1 = str;
     char tmp_char;
@@ -113,12 +134,6 @@ static void itoa(long long num, char* str, int base) {
         return;
     }
 
-    int is_negative = 0;
-    if (num < 0 && base == 10) {
-        is_negative = 1;
-        num = -num;
-    }
-
     while (num != 0) {
         tmp_val = num % base;
         *ptr++ = (tmp_val > 9) ? (char)(tmp_val - 10 + 'a') : (char)(tmp_val + '0');
@@ -144,6 +159,15 @@ int vsnprintf(char* str, uint64_t size, const char* format, va_list ap) {
     while (*format && written < size) {
         if (*format == '%') {
             format++;
+            // l and ll select a 64-bit argument for %d, %i and %u; %x and %p always take one
+            int is_long = 0;
+            while (*format == 'l') {
+                is_long = 1;
+                format++;
+            }
+            if (!*format) {
+                break;
+            }
             if (*format == 's') {
                 char* s = va_arg(ap, char*);
                 uint64_t s_len = strlen(s);
@@ -152,9 +176,19 @@ int vsnprintf(char* str, uint64_t size, const char* format, va_list ap) {
                 str_ptr += s_len;
                 written += s_len;
             } else if (*format == 'd' || *format == 'i') {
-                int val = va_arg(ap, int);
+                long long val = is_long ? va_arg(ap, long long) : va_arg(ap, int);
+                char num_buf[32];
+                unsigned long long magnitude = val < 0 ? 0ULL - (unsigned long long)val : (unsigned long long)val;
+                itoa(magnitude, num_buf, 10, val < 0);
+                uint64_t num_len = strlen(num_buf);
+                if (written + num_len >= size) num_len = size - written - 1;
+                memcpy(str_ptr, num_buf, num_len);
+                str_ptr += num_len;
+                written += num_len;
+            } else if (*format == 'u') {
+                unsigned long long val = is_long ? va_arg(ap, unsigned long long) : va_arg(ap, unsigned int);
                 char num_buf[32];
-                itoa(val, num_buf, 10);
+                itoa(val, num_buf, 10, 0);
                 uint64_t num_len = strlen(num_buf);
                 if (written + num_len >= size) num_len = size - written - 1;
                 memcpy(str_ptr, num_buf, num_len);
@@ -163,7 +197,7 @@ int vsnprintf(char* str, uint64_t size, const char* format, va_list ap) {
             } else if (*format == 'x' || *format == 'p') {
                 uint64_t val = va_arg(ap, uint64_t);
                 char num_buf[32];
-                itoa(val, num_buf, 16);
+                itoa(val, num_buf, 16, 0);
                 uint64_t num_len = strlen(num_buf);
                 if (written + num_len >= size) num_len = size - written - 1;
                 memcpy(str_ptr, num_buf, num_len);
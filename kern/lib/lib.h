@@ -17,8 +17,13 @@ uint64_t strlen(const char* s);
 int snprintf(char* str, uint64_t size, const char* format, ...);
 int vsnprintf(char* str, uint64_t size, const char* format, va_list ap);
 void uart_putc(char c);
+int uart_getc();
+void uart_enable_rx_interrupt();
 void uart_init();
 
+#define UART_PA 0x09000000 // pl011 on the qemu virt machine
+#define UART_IRQ 33        // its spi
+
 #define ALIGN_UP(addr, align) (((addr) + (align) - 1) & ~((align) - 1))
 
 #endif // LIB_H
@@ -0,0 +1,52 @@
+#include "arena.h"
+#include "pmm.h"
+#include "kprintf.h"
+#include "astral_sched.h"
+
+// every task gets its own scratch arena on first use, code running before
+// the scheduler starts shares the boot arena
+#define ARENA_SCRATCH_ORDER 2 // 16kb
+#define ARENA_ALIGN 16
+
+static arena_t boot_scratch;
+
+void arena_init(arena_t* arena, void* base, uint64_t size) {
+    arena->base = (uint64_t)base;
+    arena->size = size;
+    arena->top = 0;
+}
+
+void* arena_alloc(arena_t* arena, uint64_t size) {
+    return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+// align is a power of two; the arena base is page aligned, so anything up to
+// a page works, e.g. the cache line for buffers a device writes by dma
+void* arena_alloc_aligned(arena_t* arena, uint64_t size, uint64_t align) {
+    uint64_t offset = (arena->top + align - 1) & ~(align - 1);
+    if (offset + size > arena->size) {
+        kprintf("arena_alloc: out of scratch space for 0x%llx bytes\n", size);
+        return 0;
+    }
+    arena->top = offset + size;
+    return (void*)(arena->base + offset);
+}
+
+arena_mark_t arena_mark(arena_t* arena) {
+    return arena->top;
+}
+
+void arena_release(arena_t* arena, arena_mark_t mark) {
+    arena->top = mark;
+}
+
+arena_t* arena_scratch() {
+    tcb_t* task = sched_current_task();
+    arena_t* arena = task ? &task->scratch : &boot_scratch;
+    if (!arena->base) {
+        uint64_t pa = pmm_alloc_pages(ARENA_SCRATCH_ORDER);
+        if (!pa) return 0;
+        arena_init(arena, PHYS_TO_VIRT(pa), PMM_PAGE_SIZE << ARENA_SCRATCH_ORDER);
+    }
+    return arena;
+}
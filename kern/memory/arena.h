@@ -0,0 +1,24 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// bump-pointer arena: allocation moves top forward, release rolls it back to
+// a mark taken earlier, freeing everything allocated since in one step
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+    uint64_t top;
+} arena_t;
+
+typedef uint64_t arena_mark_t;
+
+void arena_init(arena_t* arena, void* base, uint64_t size);
+void* arena_alloc(arena_t* arena, uint64_t size);
+void* arena_alloc_aligned(arena_t* arena, uint64_t size, uint64_t align);
+arena_mark_t arena_mark(arena_t* arena);
+void arena_release(arena_t* arena, arena_mark_t mark);
+arena_t* arena_scratch();
+
+#endif // ARENA_H
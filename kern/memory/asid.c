@@ -0,0 +1,157 @@
+#include "asid.h"
+#include "cpu.h"
+#include "lib.h"
+#include "astral_sched.h"
+
+// asid allocator with generation rollover. a space keeps its asid for as long
+// as the generation it was allocated in is current; when the bitmap runs out
+// the generation moves on, every core gets a pending local tlb flush, and the
+// asids live on other cores are carried over as reserved so running tasks keep
+// theirs. a switch therefore only flushes the tlb once per rollover, never per
+// task
+
+#define ASID_MAX_BITS 16
+#define ASID_MAP_WORDS ((1 << ASID_MAX_BITS) / 64)
+
+static uint32_t asid_width = 8;
+static uint64_t asid_generation;
+static uint64_t asid_map[ASID_MAP_WORDS];
+static uint64_t asid_next = 1;
+static volatile uint64_t active_asids[MAX_CORES];
+static uint64_t reserved_asids[MAX_CORES];
+static volatile uint32_t flush_pending;
+static spinlock_t asid_lock;
+
+static inline uint64_t asid_count() {
+    return 1ULL << asid_width;
+}
+
+static inline uint64_t asid_mask() {
+    return asid_count() - 1;
+}
+
+static inline int asid_test_and_set(uint64_t asid) {
+    uint64_t bit = 1ULL << (asid & 63);
+    int was_set = (asid_map[asid >> 6] & bit) != 0;
+    asid_map[asid >> 6] |= bit;
+    return was_set;
+}
+
+static uint64_t asid_find_free(uint64_t from) {
+    for (uint64_t asid = from; asid < asid_count(); asid++) {
+        if (!(asid_map[asid >> 6] & (1ULL << (asid & 63)))) {
+            return asid;
+        }
+    }
+    return 0;
+}
+
+void asid_init() {
+    uint64_t mmfr0;
+    asm volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+    asid_width = (((mmfr0 >> 4) & 0xf) == 2) ? 16 : 8;
+    asid_generation = asid_count();
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_map[0] = 1; // asid 0 belongs to the kernel
+    asid_next = 1;
+    for (int i = 0; i < MAX_CORES; i++) {
+        active_asids[i] = 0;
+        reserved_asids[i] = 0;
+    }
+    flush_pending = 0;
+    spinlock_init(&asid_lock);
+}
+
+uint32_t asid_bits() {
+    return asid_width;
+}
+
+uint64_t asid_of(vm_space_t* space) {
+    return space->context_id & asid_mask();
+}
+
+// start a new generation. the asid each core is running is kept (or the one it
+// kept last time if it has rolled over since) so those tasks stay valid
+static void asid_rollover() {
+    asid_generation += asid_count();
+    memset(asid_map, 0, asid_count() / 8);
+    asid_map[0] = 1;
+
+    for (int i = 0; i < MAX_CORES; i++) {
+        uint64_t asid = __atomic_exchange_n(&active_asids[i], 0, __ATOMIC_RELAXED);
+        if (asid == 0) {
+            asid = reserved_asids[i];
+        }
+        asid_test_and_set(asid & asid_mask());
+        reserved_asids[i] = asid;
+    }
+    flush_pending = (1U << MAX_CORES) - 1;
+}
+
+// a reserved id from the old generation is moved into the new one in place
+static int asid_update_reserved(uint64_t context_id, uint64_t new_context_id) {
+    int hit = 0;
+    for (int i = 0; i < MAX_CORES; i++) {
+        if (reserved_asids[i] == context_id) {
+            reserved_asids[i] = new_context_id;
+            hit = 1;
+        }
+    }
+    return hit;
+}
+
+static uint64_t asid_new_context(vm_space_t* space) {
+    uint64_t context_id = space->context_id;
+    if (context_id != 0) {
+        uint64_t new_context_id = asid_generation | (context_id & asid_mask());
+        if (asid_update_reserved(context_id, new_context_id)) {
+            return new_context_id;
+        }
+        if (!asid_test_and_set(context_id & asid_mask())) {
+            return new_context_id;
+        }
+    }
+
+    uint64_t asid = asid_find_free(asid_next);
+    if (!asid) {
+        asid_rollover();
+        asid = asid_find_free(1);
+    }
+    asid_test_and_set(asid);
+    asid_next = asid;
+    return asid_generation | asid;
+}
+
+// make space current on this core and return the ttbr0 value now in use.
+// the fast path is a generation compare and one exchange, no lock
+uint64_t asid_switch_context(vm_space_t* space) {
+    uint64_t core_id = cpu_get_core_id();
+    uint64_t flags = cpu_irq_save();
+
+    uint64_t context_id = __atomic_load_n(&space->context_id, __ATOMIC_RELAXED);
+    uint64_t old_active = (core_id < MAX_CORES) ? __atomic_load_n(&active_asids[core_id], __ATOMIC_RELAXED) : 0;
+    int fast = old_active && context_id && !((context_id ^ asid_generation) >> asid_width) &&
+               __atomic_compare_exchange_n(&active_asids[core_id], &old_active, context_id, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+    if (!fast) {
+        spinlock_acquire(&asid_lock);
+        context_id = space->context_id;
+        if (!context_id || ((context_id ^ asid_generation) >> asid_width)) {
+            context_id = asid_new_context(space);
+            __atomic_store_n(&space->context_id, context_id, __ATOMIC_RELAXED);
+        }
+        if (core_id < MAX_CORES) {
+            if (flush_pending & (1U << core_id)) {
+                flush_pending &= ~(1U << core_id);
+                asm volatile("tlbi vmalle1\n dsb nsh" : : : "memory");
+            }
+            active_asids[core_id] = context_id;
+        }
+        spinlock_release(&asid_lock);
+    }
+
+    uint64_t ttbr = space->root_pa | ((context_id & asid_mask()) << ASID_TTBR_SHIFT);
+    asm volatile("msr ttbr0_el1, %0\n isb" : : "r"(ttbr) : "memory");
+    cpu_irq_restore(flags);
+    return ttbr;
+}
@@ -0,0 +1,19 @@
+#ifndef ASID_H
+#define ASID_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+#include "vm_maps.h"
+
+// a vm_space's context id is generation | asid. the generation lives above the
+// asid bits and moves on at every rollover, so a stale id is spotted by one
+// compare on the switch path. asid 0 is never handed out: it tags the kernel
+#define ASID_TTBR_SHIFT 48
+
+void asid_init();
+uint32_t asid_bits();
+uint64_t asid_of(vm_space_t* space);
+uint64_t asid_switch_context(vm_space_t* space);
+
+#endif // ASID_H
@@ -1,63 +1,516 @@
 #include "kmalloc.h"
 #include "kprintf.h"
 #include "lib.h"
+#include "cpu.h"
+#include "astral_sched.h"
 
+// small requests are served from per-class free lists; anything above
+// SLAB_MAX_SIZE falls through to the first-fit block list
+#define SLAB_NUM_CLASSES 8
+#define SLAB_MIN_SHIFT   4
+#define SLAB_MAX_SIZE    (1 << (SLAB_MIN_SHIFT + SLAB_NUM_CLASSES - 1))
+#define SLAB_CHUNK_SIZE  0x4000  // 16kb taken from the block list per refill
+
+// tags stored in the 4 bytes right before every payload so kfree can tell
+// which allocator a pointer came from
+#define BLOCK_MAGIC 0xB10C0000
+#define SLAB_MAGIC  0x51AB0000
+
+// every list block carries a header and a footer with its payload size, so
+// both physical neighbours can be found in constant time (boundary tags)
 typedef struct block_header {
     uint64_t size;
-    struct block_header* next;
-    int free;
+    uint32_t free;
+    uint32_t magic;
 } block_header_t;
 
+typedef struct {
+    uint64_t size;
+} block_footer_t;
+
+// free blocks keep their free list links in the payload
+typedef struct {
+    block_header_t* prev;
+    block_header_t* next;
+} block_links_t;
+
+#define BLOCK_OVERHEAD     (sizeof(block_header_t) + sizeof(block_footer_t))
+#define BLOCK_MIN_PAYLOAD  sizeof(block_links_t)
+
+typedef struct {
+    uint32_t class_index;
+    uint32_t magic;
+} slab_tag_t;
+
+typedef struct slab_object {
+    struct slab_object* next;
+} slab_object_t;
+
 static block_header_t* heap_start_ptr = 0;
+static uint64_t heap_end = 0;
 static uint64_t total_heap_size = 0;
+static block_header_t* block_free_list = 0;
 
-void kmalloc_init(uint64_t heap_start, uint64_t heap_size) {
-    heap_start_ptr = (block_header_t*)heap_start;
-    total_heap_size = heap_size;
+static slab_object_t* slab_free_lists[SLAB_NUM_CLASSES];
 
-    heap_start_ptr->size = heap_size - sizeof(block_header_t);
-    heap_start_ptr->next = 0;
-    heap_start_ptr->free = 1;
+// protects the block list and the slab free lists
+static spinlock_t heap_lock;
+
+// per-cpu magazine layer (bonwick): each core keeps a loaded and a previous
+// magazine per class and only goes to the depot when both are exhausted
+#define MAGAZINE_SIZE 15
+
+typedef struct magazine {
+    struct magazine* next;
+    uint64_t rounds;
+    void* objects[MAGAZINE_SIZE];
+} magazine_t;
+
+typedef struct {
+    magazine_t* loaded;
+    magazine_t* previous;
+} cpu_cache_t;
+
+typedef struct {
+    spinlock_t lock;
+    magazine_t* full;
+    magazine_t* empty;
+} depot_t;
+
+static cpu_cache_t cpu_caches[MAX_CORES][SLAB_NUM_CLASSES];
+static depot_t depots[SLAB_NUM_CLASSES];
+
+// counters are kept per core so the fast path never shares a cache line;
+// the extra slot is for cores beyond MAX_CORES, which take the locked path
+typedef struct {
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t bytes_allocated;
+    uint64_t bytes_freed;
+    uint64_t failed_allocs;
+} __attribute__((aligned(64))) kmalloc_counters_t;
+
+static kmalloc_counters_t cpu_counters[MAX_CORES + 1];
+static uint64_t slab_chunk_bytes = 0;
+
+#ifdef KMALLOC_TRACE
+// per call site allocation histogram, keyed by the caller's return address
+#define KMALLOC_TRACE_SITES 128
+
+typedef struct {
+    uint64_t site;
+    uint64_t count;
+    uint64_t bytes;
+} kmalloc_site_t;
+
+static kmalloc_site_t trace_sites[KMALLOC_TRACE_SITES];
+static uint64_t trace_dropped = 0;
+static spinlock_t trace_lock;
+
+// irqs masked while the lock is held: an allocation from an interrupt handler
+// on this core would otherwise spin on it forever
+static void trace_record(uint64_t site, uint64_t size) {
+    uint64_t flags = spinlock_acquire_irqsave(&trace_lock);
+    uint32_t slot = (uint32_t)((site >> 2) * 0x9E3779B1u) % KMALLOC_TRACE_SITES;
+    for (uint32_t probe = 0; probe < KMALLOC_TRACE_SITES; probe++) {
+        kmalloc_site_t* entry = &trace_sites[(slot + probe) % KMALLOC_TRACE_SITES];
+        if (entry->site == site || entry->site == 0) {
+            entry->site = site;
+            entry->count++;
+            entry->bytes += size;
+            spinlock_release_irqrestore(&trace_lock, flags);
+            return;
+        }
+    }
+    trace_dropped++;
+    spinlock_release_irqrestore(&trace_lock, flags);
 }
+#endif
 
-void* kmalloc(uint64_t size) {
-    if (size == 0) return 0;
+// map a request size to its class: 16, 32, 64, ... SLAB_MAX_SIZE bytes
+static inline uint32_t slab_class_index(uint64_t size) {
+    if (size <= (1 << SLAB_MIN_SHIFT)) return 0;
+    return 64 - __builtin_clzll(size - 1) - SLAB_MIN_SHIFT;
+}
+
+static inline uint64_t slab_class_size(uint32_t class_index) {
+    return 1ULL << (class_index + SLAB_MIN_SHIFT);
+}
+
+static inline block_links_t* block_links(block_header_t* block) {
+    return (block_links_t*)(block + 1);
+}
 
+static inline void block_set_size(block_header_t* block, uint64_t size) {
+    block->size = size;
+    ((block_footer_t*)((uint64_t)(block + 1) + size))->size = size;
+}
+
+static inline block_header_t* block_next(block_header_t* block) {
+    uint64_t next = (uint64_t)(block + 1) + block->size + sizeof(block_footer_t);
+    return (next < heap_end) ? (block_header_t*)next : 0;
+}
+
+static inline block_header_t* block_prev(block_header_t* block) {
+    if (block == heap_start_ptr) return 0;
+    block_footer_t* prev_footer = (block_footer_t*)block - 1;
+    return (block_header_t*)((uint64_t)prev_footer - prev_footer->size - sizeof(block_header_t));
+}
+
+static void free_list_insert(block_header_t* block) {
+    block_links(block)->prev = 0;
+    block_links(block)->next = block_free_list;
+    if (block_free_list) {
+        block_links(block_free_list)->prev = block;
+    }
+    block_free_list = block;
+}
+
+static void free_list_remove(block_header_t* block) {
+    block_links_t* links = block_links(block);
+    if (links->prev) {
+        block_links(links->prev)->next = links->next;
+    } else {
+        block_free_list = links->next;
+    }
+    if (links->next) {
+        block_links(links->next)->prev = links->prev;
+    }
+}
+
+static void* block_alloc(uint64_t size) {
     size = (size + 7) & ~7;
+    if (size < BLOCK_MIN_PAYLOAD) size = BLOCK_MIN_PAYLOAD;
 
-    block_header_t* current = heap_start_ptr;
+    // first fit over free blocks only; allocated blocks are never visited
+    block_header_t* current = block_free_list;
     while (current) {
-        if (current->free && current->size >= size) {
-            if (current->size > size + sizeof(block_header_t)) {
-                block_header_t* new_block = (block_header_t*)((uint64_t)current + sizeof(block_header_t) + size);
-                new_block->size = current->size - size - sizeof(block_header_t);
-                new_block->next = current->next;
+        if (current->size >= size) {
+            free_list_remove(current);
+            if (current->size >= size + BLOCK_OVERHEAD + BLOCK_MIN_PAYLOAD) {
+                uint64_t remaining = current->size - size - BLOCK_OVERHEAD;
+                block_set_size(current, size);
+                block_header_t* new_block = block_next(current);
                 new_block->free = 1;
-                current->next = new_block;
-                current->size = size;
+                new_block->magic = BLOCK_MAGIC;
+                block_set_size(new_block, remaining);
+                free_list_insert(new_block);
             }
             current->free = 0;
-            return (void*)((uint64_t)current + sizeof(block_header_t));
+            return (void*)(current + 1);
         }
-        current = current->next;
+        current = block_links(current)->next;
     }
     return 0;
 }
 
+// merge with free physical neighbours using the boundary tags, O(1)
+static void block_free(block_header_t* block) {
+    if (block->free) {
+        kprintf("kfree: double free of 0x%llx\n", (uint64_t)(block + 1));
+        return;
+    }
+    block->free = 1;
+
+    block_header_t* next = block_next(block);
+    if (next && next->free) {
+        free_list_remove(next);
+        block_set_size(block, block->size + BLOCK_OVERHEAD + next->size);
+    }
+
+    block_header_t* prev = block_prev(block);
+    if (prev && prev->free) {
+        block_set_size(prev, prev->size + BLOCK_OVERHEAD + block->size);
+        return;
+    }
+    free_list_insert(block);
+}
+
+// carve a fresh chunk from the block list into objects of one class
+static int slab_refill(uint32_t class_index) {
+    uint64_t slot_size = sizeof(slab_tag_t) + slab_class_size(class_index);
+    uint8_t* chunk = (uint8_t*)block_alloc(SLAB_CHUNK_SIZE);
+    if (!chunk) return -1;
+    slab_chunk_bytes += SLAB_CHUNK_SIZE;
+
+    for (uint64_t offset = 0; offset + slot_size <= SLAB_CHUNK_SIZE; offset += slot_size) {
+        slab_tag_t* tag = (slab_tag_t*)(chunk + offset);
+        tag->class_index = class_index;
+        tag->magic = SLAB_MAGIC;
+        slab_object_t* obj = (slab_object_t*)(tag + 1);
+        obj->next = slab_free_lists[class_index];
+        slab_free_lists[class_index] = obj;
+    }
+    return 0;
+}
+
+static void* slab_alloc(uint32_t class_index) {
+    if (!slab_free_lists[class_index] && slab_refill(class_index) != 0) {
+        return 0;
+    }
+    slab_object_t* obj = slab_free_lists[class_index];
+    slab_free_lists[class_index] = obj->next;
+    return obj;
+}
+
+static void slab_free(void* ptr) {
+    slab_tag_t* tag = (slab_tag_t*)ptr - 1;
+    slab_object_t* obj = (slab_object_t*)ptr;
+    obj->next = slab_free_lists[tag->class_index];
+    slab_free_lists[tag->class_index] = obj;
+}
+
+static void* slab_alloc_locked(uint32_t class_index) {
+    spinlock_acquire(&heap_lock);
+    void* obj = slab_alloc(class_index);
+    spinlock_release(&heap_lock);
+    return obj;
+}
+
+static void slab_free_locked(void* ptr) {
+    spinlock_acquire(&heap_lock);
+    slab_free(ptr);
+    spinlock_release(&heap_lock);
+}
+
+static inline int magazine_empty(magazine_t* mag) {
+    return !mag || mag->rounds == 0;
+}
+
+static inline int magazine_full(magazine_t* mag) {
+    return mag && mag->rounds == MAGAZINE_SIZE;
+}
+
+// magazines themselves come straight from the slab layer
+static magazine_t* magazine_new() {
+    magazine_t* mag = (magazine_t*)slab_alloc_locked(slab_class_index(sizeof(magazine_t)));
+    if (mag) {
+        mag->next = 0;
+        mag->rounds = 0;
+    }
+    return mag;
+}
+
+static void* cache_alloc(cpu_cache_t* cache, uint32_t class_index) {
+    if (magazine_empty(cache->loaded)) {
+        if (!magazine_empty(cache->previous)) {
+            magazine_t* tmp = cache->loaded;
+            cache->loaded = cache->previous;
+            cache->previous = tmp;
+        } else {
+            depot_t* depot = &depots[class_index];
+            spinlock_acquire(&depot->lock);
+            magazine_t* full = depot->full;
+            if (full) {
+                depot->full = full->next;
+                if (cache->previous) {
+                    cache->previous->next = depot->empty;
+                    depot->empty = cache->previous;
+                }
+                cache->previous = cache->loaded;
+                cache->loaded = full;
+            }
+            spinlock_release(&depot->lock);
+            if (!full) {
+                return slab_alloc_locked(class_index);
+            }
+        }
+    }
+    return cache->loaded->objects[--cache->loaded->rounds];
+}
+
+static void cache_free(cpu_cache_t* cache, uint32_t class_index, void* ptr) {
+    if (!cache->loaded || magazine_full(cache->loaded)) {
+        if (cache->previous && magazine_empty(cache->previous)) {
+            magazine_t* tmp = cache->loaded;
+            cache->loaded = cache->previous;
+            cache->previous = tmp;
+        } else {
+            depot_t* depot = &depots[class_index];
+            spinlock_acquire(&depot->lock);
+            magazine_t* empty = depot->empty;
+            if (empty) {
+                depot->empty = empty->next;
+            }
+            spinlock_release(&depot->lock);
+            if (!empty) {
+                empty = magazine_new();
+                if (!empty) {
+                    slab_free_locked(ptr);
+                    return;
+                }
+            }
+            if (cache->previous) {
+                spinlock_acquire(&depot->lock);
+                cache->previous->next = depot->full;
+                depot->full = cache->previous;
+                spinlock_release(&depot->lock);
+            }
+            cache->previous = cache->loaded;
+            cache->loaded = empty;
+        }
+    }
+    cache->loaded->objects[cache->loaded->rounds++] = ptr;
+}
+
+void kmalloc_init(uint64_t heap_start, uint64_t heap_size) {
+    heap_start_ptr = (block_header_t*)heap_start;
+    total_heap_size = heap_size;
+    block_free_list = 0;
+
+    heap_start_ptr->free = 1;
+    heap_start_ptr->magic = BLOCK_MAGIC;
+    block_set_size(heap_start_ptr, (heap_size - BLOCK_OVERHEAD) & ~7ULL);
+    heap_end = heap_start + BLOCK_OVERHEAD + heap_start_ptr->size;
+    free_list_insert(heap_start_ptr);
+
+    memset(slab_free_lists, 0, sizeof(slab_free_lists));
+    memset(cpu_caches, 0, sizeof(cpu_caches));
+    memset(depots, 0, sizeof(depots));
+    memset(cpu_counters, 0, sizeof(cpu_counters));
+    slab_chunk_bytes = 0;
+    spinlock_init(&heap_lock);
+#ifdef KMALLOC_TRACE
+    memset(trace_sites, 0, sizeof(trace_sites));
+    trace_dropped = 0;
+    spinlock_init(&trace_lock);
+#endif
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        spinlock_init(&depots[i].lock);
+    }
+}
+
+static inline kmalloc_counters_t* local_counters(uint64_t core_id) {
+    return &cpu_counters[core_id < MAX_CORES ? core_id : MAX_CORES];
+}
+
+void* kmalloc(uint64_t size) {
+    if (size == 0) return 0;
+
+    // irqs stay masked so the per-cpu caches are never entered reentrantly
+    uint64_t flags = cpu_irq_save();
+    uint64_t core_id = cpu_get_core_id();
+    uint64_t granted;
+    void* ptr;
+    if (size <= SLAB_MAX_SIZE) {
+        uint32_t class_index = slab_class_index(size);
+        granted = slab_class_size(class_index);
+        if (core_id < MAX_CORES) {
+            ptr = cache_alloc(&cpu_caches[core_id][class_index], class_index);
+        } else {
+            ptr = slab_alloc_locked(class_index);
+        }
+    } else {
+        spinlock_acquire(&heap_lock);
+        ptr = block_alloc(size);
+        spinlock_release(&heap_lock);
+        granted = ptr ? ((block_header_t*)ptr - 1)->size : 0;
+    }
+
+    kmalloc_counters_t* counters = local_counters(core_id);
+    if (ptr) {
+        counters->alloc_count++;
+        counters->bytes_allocated += granted;
+    } else {
+        counters->failed_allocs++;
+    }
+    cpu_irq_restore(flags);
+
+#ifdef KMALLOC_TRACE
+    if (ptr) {
+        trace_record((uint64_t)__builtin_return_address(0), granted);
+    }
+#endif
+    return ptr;
+}
+
 void kfree(void* ptr) {
     if (ptr == 0) return;
 
-    block_header_t* block = (block_header_t*)((uint64_t)ptr - sizeof(block_header_t));
-    block->free = 1;
+    uint32_t magic = ((uint32_t*)ptr)[-1];
+    if (magic != SLAB_MAGIC && magic != BLOCK_MAGIC) {
+        kprintf("kfree: bad pointer 0x%llx\n", (uint64_t)ptr);
+        return;
+    }
 
-    block_header_t* current = heap_start_ptr;
-    while (current) {
-        if (current->free && current->next && current->next->free && (uint64_t)current + sizeof(block_header_t) + current->size == (uint64_t)current->next) {
-            current->size += sizeof(block_header_t) + current->next->size;
-            current->next = current->next->next;
+    uint64_t flags = cpu_irq_save();
+    uint64_t core_id = cpu_get_core_id();
+    uint64_t released;
+    if (magic == SLAB_MAGIC) {
+        uint32_t class_index = ((slab_tag_t*)ptr - 1)->class_index;
+        released = slab_class_size(class_index);
+        if (core_id < MAX_CORES) {
+            cache_free(&cpu_caches[core_id][class_index], class_index, ptr);
+        } else {
+            slab_free_locked(ptr);
         }
-        current = current->next;
+    } else {
+        released = ((block_header_t*)ptr - 1)->size;
+        spinlock_acquire(&heap_lock);
+        block_free((block_header_t*)ptr - 1);
+        spinlock_release(&heap_lock);
     }
+
+    kmalloc_counters_t* counters = local_counters(core_id);
+    counters->free_count++;
+    counters->bytes_freed += released;
+    cpu_irq_restore(flags);
 }
 
+// the free list walk is only done here, never on the allocation path
+void kmalloc_stats(kmalloc_stats_t* stats) {
+    memset(stats, 0, sizeof(kmalloc_stats_t));
+    stats->heap_size = total_heap_size;
+
+    uint64_t bytes_allocated = 0;
+    uint64_t bytes_freed = 0;
+    for (int i = 0; i <= MAX_CORES; i++) {
+        stats->alloc_count += cpu_counters[i].alloc_count;
+        stats->free_count += cpu_counters[i].free_count;
+        stats->failed_allocs += cpu_counters[i].failed_allocs;
+        bytes_allocated += cpu_counters[i].bytes_allocated;
+        bytes_freed += cpu_counters[i].bytes_freed;
+    }
+    stats->bytes_in_use = bytes_allocated - bytes_freed;
+
+    uint64_t flags = spinlock_acquire_irqsave(&heap_lock);
+    stats->slab_bytes = slab_chunk_bytes;
+    for (block_header_t* block = block_free_list; block; block = block_links(block)->next) {
+        stats->free_blocks++;
+        stats->free_bytes += block->size;
+        if (block->size > stats->largest_free_block) {
+            stats->largest_free_block = block->size;
+        }
+    }
+    spinlock_release_irqrestore(&heap_lock, flags);
 
+    if (stats->free_bytes) {
+        stats->fragmentation = 1000 - (uint32_t)(stats->largest_free_block * 1000 / stats->free_bytes);
+    }
+}
+
+void kmalloc_dump_stats() {
+    kmalloc_stats_t stats;
+    kmalloc_stats(&stats);
+
+    kprintf_uart("kmalloc: heap %llu kb, in use %llu kb, slab chunks %llu kb\n",
+                 stats.heap_size >> 10, stats.bytes_in_use >> 10, stats.slab_bytes >> 10);
+    kprintf_uart("kmalloc: free %llu kb in %llu blocks, largest %llu kb, fragmentation %u.%u%%\n",
+                 stats.free_bytes >> 10, stats.free_blocks, stats.largest_free_block >> 10,
+                 stats.fragmentation / 10, stats.fragmentation % 10);
+    kprintf_uart("kmalloc: %llu allocs, %llu frees, %llu failed\n",
+                 stats.alloc_count, stats.free_count, stats.failed_allocs);
+
+#ifdef KMALLOC_TRACE
+    uint64_t flags = spinlock_acquire_irqsave(&trace_lock);
+    for (int i = 0; i < KMALLOC_TRACE_SITES; i++) {
+        if (trace_sites[i].site == 0) continue;
+        kprintf_uart("  site 0x%x: %llu allocs, %llu bytes\n",
+                     trace_sites[i].site, trace_sites[i].count, trace_sites[i].bytes);
+    }
+    if (trace_dropped) {
+        kprintf_uart("  %llu allocations from untracked sites\n", trace_dropped);
+    }
+    spinlock_release_irqrestore(&trace_lock, flags);
+#endif
+}
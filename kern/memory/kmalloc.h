@@ -5,9 +5,24 @@ typedef unsigned long long uint64_t;
 typedef unsigned int uint32_t;
 typedef unsigned char uint8_t;
 
+typedef struct {
+    uint64_t heap_size;
+    uint64_t bytes_in_use;       // payload bytes currently handed out
+    uint64_t slab_bytes;         // bytes carved into size-class chunks
+    uint64_t free_bytes;         // payload bytes on the block free list
+    uint64_t free_blocks;
+    uint64_t largest_free_block;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t failed_allocs;
+    uint32_t fragmentation;      // 0 (one free extent) .. 1000 (all free space in tiny pieces)
+} kmalloc_stats_t;
+
 void kmalloc_init(uint64_t heap_start, uint64_t heap_size);
 void* kmalloc(uint64_t size);
 void kfree(void* ptr);
+void kmalloc_stats(kmalloc_stats_t* stats);
+void kmalloc_dump_stats();
 
 #endif // KMALLOC_H
 
@@ -0,0 +1,545 @@
+#include "pgtable.h"
+#include "pmm.h"
+#include "kprintf.h"
+#include "lib.h"
+
+// walker/builder for aarch64 stage 1 translation tables. a leaf is a page at
+// l3 or a block at l1/l2; map picks the largest block the va/pa alignment
+// allows and splits existing blocks when only part of one changes. a leaf
+// without PTE_VALID keeps its output address so it can be made accessible
+// again by pgtable_protect.
+//
+// runs of 16 l3 pages or l2 blocks that are aligned, physically contiguous and
+// share their attributes get PTE_CONT, so one tlb entry covers the run. the
+// bit is managed here only: callers never pass it, any change to one entry of
+// a run first clears it on the whole run, and map/protect set it again on the
+// runs they leave uniform. a tlb holding the run both ways would conflict, so
+// the bit never flips on live entries: the whole run is cleared and flushed
+// first, then written back with the new bit, like any other break-before-make.
+// as with a split, the walk must not run from memory inside such a run.
+//
+// a live translation that changes its output or its size (a block split into
+// a table, a table or leaf replaced by another leaf) goes through
+// break-before-make: the entry is cleared, the caller's flush invalidates the
+// tlb, and only then is the new entry written. table pages unlinked from a
+// live space are freed only after such a flush, so no walk cache can still
+// point at them when the pmm hands them out again.
+
+// a walk's flush callback and the table pages it unlinked but has not freed.
+// a null flush means the space is not live on any core
+#define DEFERRED_TABLES 32
+
+typedef struct {
+    pgtable_flush_fn flush;
+    void* ctx;
+    uint64_t va;    // the walk's range, flushed before deferred tables are freed
+    uint64_t size;
+    uint32_t count;
+    uint64_t tables[DEFERRED_TABLES];
+} walk_ctx_t;
+
+static inline uint32_t level_shift(uint32_t level) {
+    return 39 - 9 * level;
+}
+
+static inline uint64_t level_index(uint64_t va, uint32_t level) {
+    return (va >> level_shift(level)) & (PGTABLE_ENTRIES - 1);
+}
+
+static inline uint64_t* table_virt(uint64_t entry) {
+    return (uint64_t*)PHYS_TO_VIRT(entry & PTE_ADDR_MASK);
+}
+
+static inline int entry_is_table(uint64_t entry, uint32_t level) {
+    return level < 3 && (entry & PTE_TYPE_MASK) == (PTE_TABLE | PTE_VALID);
+}
+
+static inline uint64_t make_leaf(uint64_t pa, uint64_t attrs, uint32_t level) {
+    uint64_t type = (level == 3) ? PTE_PAGE : PTE_BLOCK;
+    return (pa & PTE_ADDR_MASK) | (attrs & ((PTE_ATTR_MASK & ~PTE_CONT) | PTE_VALID)) | type;
+}
+
+// attributes of a valid leaf as make_leaf would take them, or 0 for anything else
+static inline uint64_t leaf_attrs(uint64_t entry, uint32_t level) {
+    uint64_t type = (level == 3) ? (PTE_PAGE | PTE_VALID) : (PTE_BLOCK | PTE_VALID);
+    if ((entry & PTE_TYPE_MASK) != type) return 0;
+    return entry & ((PTE_ATTR_MASK & ~PTE_CONT) | PTE_VALID);
+}
+
+static uint64_t alloc_table() {
+    uint64_t pa = pmm_alloc_page();
+    if (pa) {
+        memset(PHYS_TO_VIRT(pa), 0, PGTABLE_PAGE_SIZE);
+    }
+    return pa;
+}
+
+static void free_table(uint64_t table_pa, uint32_t level) {
+    uint64_t* table = (uint64_t*)PHYS_TO_VIRT(table_pa);
+    for (int i = 0; i < PGTABLE_ENTRIES; i++) {
+        if (entry_is_table(table[i], level)) {
+            free_table(table[i] & PTE_ADDR_MASK, level + 1);
+        }
+    }
+    pmm_free_page(table_pa);
+}
+
+static void walk_init(walk_ctx_t* walk, uint64_t va, uint64_t size, pgtable_flush_fn flush, void* ctx) {
+    walk->flush = flush;
+    walk->ctx = ctx;
+    walk->va = va;
+    walk->size = size;
+    walk->count = 0;
+}
+
+static void walk_flush(walk_ctx_t* walk, uint64_t va, uint64_t size) {
+    asm volatile("dsb ishst" : : : "memory");
+    if (walk->flush) {
+        walk->flush(va, size, walk->ctx);
+    }
+}
+
+// invalidate the walk's whole range, then hand the unlinked tables back
+static void release_tables(walk_ctx_t* walk) {
+    if (!walk->count) return;
+    walk_flush(walk, walk->va, walk->size);
+    for (uint32_t i = 0; i < walk->count; i++) {
+        pmm_free_page(walk->tables[i]);
+    }
+    walk->count = 0;
+}
+
+// queue an already unlinked subtree for freeing. its entries are left as they
+// are, a stale walk may still read them until the flush
+static void defer_table(walk_ctx_t* walk, uint64_t table_pa, uint32_t level) {
+    uint64_t* table = (uint64_t*)PHYS_TO_VIRT(table_pa);
+    for (int i = 0; i < PGTABLE_ENTRIES; i++) {
+        if (entry_is_table(table[i], level)) {
+            defer_table(walk, table[i] & PTE_ADDR_MASK, level + 1);
+        }
+    }
+    if (walk->count == DEFERRED_TABLES) {
+        release_tables(walk);
+    }
+    walk->tables[walk->count++] = table_pa;
+}
+
+// the run an entry belongs to. tables are page aligned, so it starts at the
+// entry address rounded down to 16 entries
+static inline uint64_t* run_start(uint64_t* entry) {
+    return (uint64_t*)((uint64_t)entry & ~(uint64_t)(PGTABLE_CONT_ENTRIES * sizeof(uint64_t) - 1));
+}
+
+// drop PTE_CONT from the run entry belongs to, va being any address entry
+// translates. the run is broken and written back without the bit; entry
+// itself stays cleared when drop is set. returns 1 if the run was flushed
+static int unfold_contiguous(walk_ctx_t* walk, uint64_t* entry, uint32_t level, uint64_t va, int drop) {
+    if (!(*entry & PTE_CONT)) return 0;
+    uint64_t run_size = (uint64_t)PGTABLE_CONT_ENTRIES << level_shift(level);
+    uint64_t* run = run_start(entry);
+    uint64_t saved[PGTABLE_CONT_ENTRIES];
+    for (int i = 0; i < PGTABLE_CONT_ENTRIES; i++) {
+        saved[i] = run[i] & ~PTE_CONT;
+        run[i] = 0;
+    }
+    walk_flush(walk, va & ~(run_size - 1), run_size);
+    for (int i = 0; i < PGTABLE_CONT_ENTRIES; i++) {
+        if (!drop || &run[i] != entry) {
+            run[i] = saved[i];
+        }
+    }
+    return 1;
+}
+
+// set PTE_CONT on the run starting at table[first], which translates run_va,
+// if all 16 entries are valid leaves with the same attributes mapping one
+// aligned physical range. a null walk means the table is not linked yet and
+// its entries can be changed in place
+static void fold_contiguous(walk_ctx_t* walk, uint64_t* table, uint32_t level, uint64_t first, uint64_t run_va) {
+    uint64_t entry_size = 1ULL << level_shift(level);
+    uint64_t base = table[first] & PTE_ADDR_MASK;
+    uint64_t attrs = leaf_attrs(table[first], level);
+    if (!attrs || (base & (PGTABLE_CONT_ENTRIES * entry_size - 1))) return;
+    int folded = 1;
+    for (int i = 0; i < PGTABLE_CONT_ENTRIES; i++) {
+        uint64_t entry = table[first + i];
+        if (leaf_attrs(entry, level) != attrs || (entry & PTE_ADDR_MASK) != base + i * entry_size) return;
+        folded &= (entry & PTE_CONT) != 0;
+    }
+    if (folded) return;
+    uint64_t saved[PGTABLE_CONT_ENTRIES];
+    for (int i = 0; i < PGTABLE_CONT_ENTRIES; i++) {
+        saved[i] = table[first + i] | PTE_CONT;
+        if (walk) {
+            table[first + i] = 0;
+        }
+    }
+    if (walk) {
+        walk_flush(walk, run_va, PGTABLE_CONT_ENTRIES * entry_size);
+    }
+    for (int i = 0; i < PGTABLE_CONT_ENTRIES; i++) {
+        table[first + i] = saved[i];
+    }
+}
+
+// try every run of this table that [va, va + size) touches; only l2 blocks
+// and l3 pages have a contiguous hint here
+static void fold_range(walk_ctx_t* walk, uint64_t* table, uint32_t level, uint64_t va, uint64_t size) {
+    if (level < 2 || !size) return;
+    uint64_t run_size = (uint64_t)PGTABLE_CONT_ENTRIES << level_shift(level);
+    uint64_t run_va = va & ~(run_size - 1);
+    uint64_t first = level_index(va, level) & ~(uint64_t)(PGTABLE_CONT_ENTRIES - 1);
+    uint64_t last = level_index(va + size - 1, level);
+    for (uint64_t index = first; index <= last; index += PGTABLE_CONT_ENTRIES, run_va += run_size) {
+        fold_contiguous(walk, table, level, index, run_va);
+    }
+}
+
+// the break half: no core may use the old translation of the entry at level
+// that covers va once this returns
+static void break_entry(walk_ctx_t* walk, uint64_t* entry, uint32_t level, uint64_t va) {
+    if (unfold_contiguous(walk, entry, level, va, 1)) return;
+    uint64_t entry_size = 1ULL << level_shift(level);
+    *entry = 0;
+    walk_flush(walk, va & ~(entry_size - 1), entry_size);
+}
+
+static int table_empty(uint64_t* table) {
+    for (int i = 0; i < PGTABLE_ENTRIES; i++) {
+        if (table[i]) return 0;
+    }
+    return 1;
+}
+
+// replace the block covering va by a next-level table that maps the same
+// range with the same attributes. the block is broken first, so the range is
+// briefly unmapped: the walk must not run from memory inside it
+static uint64_t* split_block(walk_ctx_t* walk, uint64_t* entry, uint32_t level, uint64_t va) {
+    uint64_t table_pa = alloc_table();
+    if (!table_pa) return 0;
+
+    uint64_t* table = (uint64_t*)PHYS_TO_VIRT(table_pa);
+    uint64_t child_size = 1ULL << level_shift(level + 1);
+    uint64_t base = *entry & PTE_ADDR_MASK;
+    uint64_t attrs = *entry & (PTE_ATTR_MASK | PTE_VALID);
+    for (int i = 0; i < PGTABLE_ENTRIES; i++) {
+        table[i] = make_leaf(base + i * child_size, attrs, level + 1);
+    }
+    fold_range(0, table, level + 1, 0, PGTABLE_ENTRIES * child_size);
+    if (*entry & PTE_VALID) {
+        break_entry(walk, entry, level, va);
+    } else {
+        unfold_contiguous(walk, entry, level, va, 0);
+    }
+    asm volatile("dsb ishst" : : : "memory");
+    *entry = table_pa | PTE_TABLE | PTE_VALID;
+    return table;
+}
+
+static uint64_t* next_table(walk_ctx_t* walk, uint64_t* entry, uint32_t level, uint64_t va, int create) {
+    if (entry_is_table(*entry, level)) {
+        return table_virt(*entry);
+    }
+    if (*entry) {
+        return split_block(walk, entry, level, va);
+    }
+    if (!create) return 0;
+
+    uint64_t table_pa = alloc_table();
+    if (!table_pa) return 0;
+    *entry = table_pa | PTE_TABLE | PTE_VALID;
+    return (uint64_t*)PHYS_TO_VIRT(table_pa);
+}
+
+static int map_range(walk_ctx_t* walk, uint64_t* table, uint32_t level, uint64_t va, uint64_t pa, uint64_t size, uint64_t attrs) {
+    uint64_t entry_size = 1ULL << level_shift(level);
+    uint64_t start = va;
+    uint64_t total = size;
+    while (size) {
+        uint64_t* entry = &table[level_index(va, level)];
+        uint64_t chunk = entry_size - (va & (entry_size - 1));
+        if (chunk > size) chunk = size;
+
+        if (level == 3 || (level >= 1 && chunk == entry_size && !(pa & (entry_size - 1)))) {
+            if (entry_is_table(*entry, level)) {
+                uint64_t next_pa = *entry & PTE_ADDR_MASK;
+                break_entry(walk, entry, level, va);
+                defer_table(walk, next_pa, level + 1);
+            } else if (*entry & PTE_VALID) {
+                break_entry(walk, entry, level, va);
+            } else {
+                unfold_contiguous(walk, entry, level, va, 0);
+            }
+            *entry = make_leaf(pa, attrs, level);
+        } else {
+            uint64_t* next = next_table(walk, entry, level, va, 1);
+            if (!next || map_range(walk, next, level + 1, va, pa, chunk, attrs) != 0) {
+                return -1;
+            }
+        }
+        va += chunk;
+        pa += chunk;
+        size -= chunk;
+    }
+    fold_range(walk, table, level, start, total);
+    return 0;
+}
+
+static int unmap_range(walk_ctx_t* walk, uint64_t* table, uint32_t level, uint64_t va, uint64_t size, pgtable_leaf_fn leaf_fn, void* ctx) {
+    uint64_t entry_size = 1ULL << level_shift(level);
+    while (size) {
+        uint64_t* entry = &table[level_index(va, level)];
+        uint64_t chunk = entry_size - (va & (entry_size - 1));
+        if (chunk > size) chunk = size;
+
+        if (*entry) {
+            if (entry_is_table(*entry, level)) {
+                uint64_t* next = table_virt(*entry);
+                // a fully covered subtree is dropped without a walk unless its
+                // leaves have to be reported
+                if ((chunk != entry_size || leaf_fn) && unmap_range(walk, next, level + 1, va, chunk, leaf_fn, ctx) != 0) {
+                    return -1;
+                }
+                if (chunk == entry_size || table_empty(next)) {
+                    uint64_t next_pa = *entry & PTE_ADDR_MASK;
+                    *entry = 0;
+                    defer_table(walk, next_pa, level + 1);
+                }
+            } else if (level == 3 || chunk == entry_size) {
+                if (leaf_fn) {
+                    leaf_fn(*entry & PTE_ADDR_MASK, entry_size, ctx);
+                }
+                // the final flush of the unmap covers the entry itself
+                unfold_contiguous(walk, entry, level, va, 1);
+                *entry = 0;
+            } else {
+                uint64_t* next = split_block(walk, entry, level, va);
+                if (!next || unmap_range(walk, next, level + 1, va, chunk, leaf_fn, ctx) != 0) {
+                    return -1;
+                }
+                if (table_empty(next)) {
+                    uint64_t next_pa = *entry & PTE_ADDR_MASK;
+                    *entry = 0;
+                    defer_table(walk, next_pa, level + 1);
+                }
+            }
+        }
+        va += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+static int protect_range(walk_ctx_t* walk, uint64_t* table, uint32_t level, uint64_t va, uint64_t size, uint64_t attrs) {
+    uint64_t entry_size = 1ULL << level_shift(level);
+    uint64_t start = va;
+    uint64_t total = size;
+    while (size) {
+        uint64_t* entry = &table[level_index(va, level)];
+        uint64_t chunk = entry_size - (va & (entry_size - 1));
+        if (chunk > size) chunk = size;
+
+        if (*entry) {
+            if (!entry_is_table(*entry, level) && (level == 3 || chunk == entry_size)) {
+                // copy-on-write pages stay read-only whatever the new protection
+                uint64_t leaf_attrs = attrs;
+                if (*entry & PTE_SW_COW) {
+                    leaf_attrs |= PTE_AP_RDONLY | PTE_SW_COW;
+                }
+                // only the permissions of the entry change, which needs no break
+                unfold_contiguous(walk, entry, level, va, 0);
+                *entry = make_leaf(*entry & PTE_ADDR_MASK, leaf_attrs, level);
+            } else {
+                uint64_t* next = next_table(walk, entry, level, va, 0);
+                if (!next || protect_range(walk, next, level + 1, va, chunk, attrs) != 0) {
+                    return -1;
+                }
+            }
+        }
+        va += chunk;
+        size -= chunk;
+    }
+    fold_range(walk, table, level, start, total);
+    return 0;
+}
+
+uint64_t pgtable_alloc_root() {
+    return alloc_table();
+}
+
+void pgtable_free_root(uint64_t root_pa) {
+    if (root_pa) {
+        free_table(root_pa, 0);
+    }
+}
+
+// va, pa and size must be page aligned. flush is called for every live
+// translation that is replaced; new ones need no invalidate
+int pgtable_map(uint64_t root_pa, uint64_t va, uint64_t pa, uint64_t size, uint64_t attrs, pgtable_flush_fn flush, void* flush_ctx) {
+    if ((va | pa | size) & (PGTABLE_PAGE_SIZE - 1)) {
+        kprintf("pgtable_map: unaligned mapping va: 0x%llx\n", va);
+        return -1;
+    }
+    walk_ctx_t walk;
+    walk_init(&walk, va, size, flush, flush_ctx);
+    int ret = map_range(&walk, (uint64_t*)PHYS_TO_VIRT(root_pa), 0, va, pa, size, attrs);
+    asm volatile("dsb ishst" : : : "memory");
+    release_tables(&walk);
+    return ret;
+}
+
+// the range is flushed before this returns, so the frames reported to leaf_fn
+// can be reused as soon as it does
+int pgtable_unmap(uint64_t root_pa, uint64_t va, uint64_t size, pgtable_leaf_fn leaf_fn, void* ctx, pgtable_flush_fn flush, void* flush_ctx) {
+    if ((va | size) & (PGTABLE_PAGE_SIZE - 1)) {
+        kprintf("pgtable_unmap: unaligned range va: 0x%llx\n", va);
+        return -1;
+    }
+    walk_ctx_t walk;
+    walk_init(&walk, va, size, flush, flush_ctx);
+    int ret = unmap_range(&walk, (uint64_t*)PHYS_TO_VIRT(root_pa), 0, va, size, leaf_fn, ctx);
+    walk_flush(&walk, va, size);
+    for (uint32_t i = 0; i < walk.count; i++) {
+        pmm_free_page(walk.tables[i]);
+    }
+    return ret;
+}
+
+// flush is used for the blocks that have to be split; the caller invalidates
+// the range once the new permissions are in
+int pgtable_protect(uint64_t root_pa, uint64_t va, uint64_t size, uint64_t attrs, pgtable_flush_fn flush, void* flush_ctx) {
+    if ((va | size) & (PGTABLE_PAGE_SIZE - 1)) {
+        kprintf("pgtable_protect: unaligned range va: 0x%llx\n", va);
+        return -1;
+    }
+    walk_ctx_t walk;
+    walk_init(&walk, va, size, flush, flush_ctx);
+    int ret = protect_range(&walk, (uint64_t*)PHYS_TO_VIRT(root_pa), 0, va, size, attrs);
+    asm volatile("dsb ishst" : : : "memory");
+    return ret;
+}
+
+// walk to the entry that translates va; level reports where the walk stopped
+// (an l1/l2 block, an l3 page, or an empty entry at any level)
+uint64_t* pgtable_lookup(uint64_t root_pa, uint64_t va, uint32_t* level) {
+    uint64_t* table = (uint64_t*)PHYS_TO_VIRT(root_pa);
+    for (uint32_t current = 0; current < PGTABLE_LEVELS; current++) {
+        uint64_t* entry = &table[level_index(va, current)];
+        if (!entry_is_table(*entry, current)) {
+            if (level) *level = current;
+            return entry;
+        }
+        table = table_virt(*entry);
+    }
+    return 0;
+}
+
+static void walk_range(uint64_t* table, uint32_t level, uint64_t va, uint64_t size, pgtable_walk_fn fn, void* ctx) {
+    uint64_t entry_size = 1ULL << level_shift(level);
+    while (size) {
+        uint64_t* entry = &table[level_index(va, level)];
+        uint64_t chunk = entry_size - (va & (entry_size - 1));
+        if (chunk > size) chunk = size;
+
+        if (entry_is_table(*entry, level)) {
+            walk_range(table_virt(*entry), level + 1, va, chunk, fn, ctx);
+        } else if (*entry) {
+            fn(va & ~(entry_size - 1), entry, level, ctx);
+        }
+        va += chunk;
+        size -= chunk;
+    }
+}
+
+// call fn for every leaf (valid or not) that translates part of [va, va + size)
+int pgtable_walk(uint64_t root_pa, uint64_t va, uint64_t size, pgtable_walk_fn fn, void* ctx) {
+    if ((va | size) & (PGTABLE_PAGE_SIZE - 1)) {
+        kprintf("pgtable_walk: unaligned range va: 0x%llx\n", va);
+        return -1;
+    }
+    walk_range((uint64_t*)PHYS_TO_VIRT(root_pa), 0, va, size, fn, ctx);
+    return 0;
+}
+
+// rewrite the l3 entry for va in place; the caller owns break-before-make for
+// the entry itself, flush is only used to take its run apart first
+void pgtable_set_page(uint64_t* entry, uint64_t va, uint64_t pa, uint64_t attrs, pgtable_flush_fn flush, void* ctx) {
+    walk_ctx_t walk;
+    walk_init(&walk, va, PGTABLE_PAGE_SIZE, flush, ctx);
+    unfold_contiguous(&walk, entry, 3, va, 0);
+    *entry = make_leaf(pa, attrs, 3);
+    asm volatile("dsb ishst" : : : "memory");
+}
+
+// the break half of break-before-make for the l3 entry for va
+void pgtable_clear_page(uint64_t* entry, uint64_t va, pgtable_flush_fn flush, void* ctx) {
+    walk_ctx_t walk;
+    walk_init(&walk, va, PGTABLE_PAGE_SIZE, flush, ctx);
+    unfold_contiguous(&walk, entry, 3, va, 1);
+    *entry = 0;
+    asm volatile("dsb ishst" : : : "memory");
+}
+
+// whether a table could be replaced by one block: every entry a valid leaf
+// with the same attributes, together one physically contiguous range aligned
+// to the replacing block
+static int table_is_block(uint64_t* table, uint32_t level, uint64_t* base, uint64_t* attrs) {
+    uint64_t entry_size = 1ULL << level_shift(level);
+    *base = table[0] & PTE_ADDR_MASK;
+    *attrs = leaf_attrs(table[0], level);
+    if (!*attrs || (*base & (PGTABLE_ENTRIES * entry_size - 1))) return 0;
+    for (int i = 1; i < PGTABLE_ENTRIES; i++) {
+        if (leaf_attrs(table[i], level) != *attrs || (table[i] & PTE_ADDR_MASK) != *base + i * entry_size) return 0;
+    }
+    return 1;
+}
+
+static int promote_range(walk_ctx_t* walk, uint64_t* table, uint32_t level, uint64_t va, uint64_t size) {
+    uint64_t entry_size = 1ULL << level_shift(level);
+    uint64_t start = va;
+    uint64_t total = size;
+    int promoted = 0;
+    while (size) {
+        uint64_t* entry = &table[level_index(va, level)];
+        uint64_t chunk = entry_size - (va & (entry_size - 1));
+        if (chunk > size) chunk = size;
+
+        if (entry_is_table(*entry, level)) {
+            uint64_t* next = table_virt(*entry);
+            promoted += promote_range(walk, next, level + 1, va, chunk);
+            uint64_t base, attrs;
+            // only l1/l2 hold blocks, and only whole entries inside the range are replaced
+            if (level >= 1 && chunk == entry_size && table_is_block(next, level + 1, &base, &attrs)) {
+                // changing the size of a translation needs break-before-make
+                uint64_t next_pa = *entry & PTE_ADDR_MASK;
+                *entry = 0;
+                walk_flush(walk, va, entry_size);
+                *entry = make_leaf(base, attrs, level);
+                asm volatile("dsb ishst" : : : "memory");
+                pmm_free_page(next_pa);
+                promoted++;
+            }
+        }
+        va += chunk;
+        size -= chunk;
+    }
+    fold_range(walk, table, level, start, total);
+    return promoted;
+}
+
+// rebuild the largest leaves the mappings in [va, va + size) allow: l3 tables
+// and l2 tables that map one aligned contiguous range with uniform attributes
+// become 2mb and 1gb blocks, and uniform runs get PTE_CONT again. returns how
+// many tables were replaced. translations in a replaced range are briefly
+// absent, so callers keep faults in it retrying until this returns
+int pgtable_promote(uint64_t root_pa, uint64_t va, uint64_t size, pgtable_flush_fn flush, void* ctx) {
+    if ((va | size) & (PGTABLE_PAGE_SIZE - 1)) {
+        kprintf("pgtable_promote: unaligned range va: 0x%llx\n", va);
+        return -1;
+    }
+    walk_ctx_t walk;
+    walk_init(&walk, va, size, flush, ctx);
+    int ret = promote_range(&walk, (uint64_t*)PHYS_TO_VIRT(root_pa), 0, va, size);
+    asm volatile("dsb ishst" : : : "memory");
+    return ret;
+}
@@ -0,0 +1,67 @@
+#ifndef PGTABLE_H
+#define PGTABLE_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// 4kb granule, 48-bit va: four levels, l0 (512gb per entry) down to l3 (4kb pages)
+#define PGTABLE_LEVELS      4
+#define PGTABLE_ENTRIES     512
+#define PGTABLE_PAGE_SIZE   0x1000ULL
+#define PGTABLE_L2_BLOCK    0x200000ULL   // 2mb
+#define PGTABLE_L1_BLOCK    0x40000000ULL // 1gb
+#define PGTABLE_CONT_ENTRIES 16           // one contiguous run: 64kb of pages or 32mb of 2mb blocks
+
+// memory type definitions for mair setting
+#define MT_DEVICE_NGNRNE    0x00
+#define MT_NORMAL_NC        0x01
+#define MT_NORMAL           0x02
+
+// page table entry flags
+#define PTE_VALID                (1ULL << 0)
+#define PTE_TABLE                (1ULL << 1)
+#define PTE_BLOCK                (0ULL << 1)
+#define PTE_PAGE                 (1ULL << 1)
+#define PTE_ATTR_INDEX(mt)       ((uint64_t)(mt) << 2)
+#define PTE_AP_RW_EL1            (0x0ULL << 6)
+#define PTE_AP_RW_EL0            (0x1ULL << 6)
+#define PTE_AP_RO_EL1            (0x2ULL << 6)
+#define PTE_AP_RO_EL0            (0x3ULL << 6)
+#define PTE_AP_MASK              (0x3ULL << 6)
+#define PTE_SH_INNER_SHAREABLE   (0x3ULL << 8)
+#define PTE_AF                   (1ULL << 10)
+#define PTE_NG                   (1ULL << 11)
+#define PTE_CONT                 (1ULL << 52)  // entry is part of an aligned run of 16 sharing one tlb entry
+#define PTE_PXN                  (1ULL << 53)
+#define PTE_UXN                  (1ULL << 54)
+#define PTE_AP_RDONLY            (1ULL << 7)   // ap[2], turns either rw encoding read-only
+#define PTE_SW_COW               (1ULL << 55)  // software bit: read-only until the first write copies it
+
+#define PTE_ADDR_MASK            0x0000FFFFFFFFF000ULL
+#define PTE_TYPE_MASK            0x3ULL
+// attribute bits that pgtable_map/pgtable_protect take from the caller
+#define PTE_ATTR_MASK            (~(PTE_ADDR_MASK | PTE_TYPE_MASK))
+
+// called for every leaf an unmap removes, e.g. to hand its frame back later
+typedef void (*pgtable_leaf_fn)(uint64_t pa, uint64_t size, void* ctx);
+
+// called for every leaf in a walked range with the va it starts at
+typedef void (*pgtable_walk_fn)(uint64_t va, uint64_t* entry, uint32_t level, void* ctx);
+
+// called between clearing a live entry and reusing it or what it pointed to,
+// e.g. by promote before writing the replacing block; must invalidate the tlb,
+// walk caches included, for [va, va + size)
+typedef void (*pgtable_flush_fn)(uint64_t va, uint64_t size, void* ctx);
+
+uint64_t pgtable_alloc_root();
+void pgtable_free_root(uint64_t root_pa);
+int pgtable_map(uint64_t root_pa, uint64_t va, uint64_t pa, uint64_t size, uint64_t attrs, pgtable_flush_fn flush, void* flush_ctx);
+int pgtable_unmap(uint64_t root_pa, uint64_t va, uint64_t size, pgtable_leaf_fn leaf_fn, void* ctx, pgtable_flush_fn flush, void* flush_ctx);
+int pgtable_protect(uint64_t root_pa, uint64_t va, uint64_t size, uint64_t attrs, pgtable_flush_fn flush, void* flush_ctx);
+uint64_t* pgtable_lookup(uint64_t root_pa, uint64_t va, uint32_t* level);
+int pgtable_walk(uint64_t root_pa, uint64_t va, uint64_t size, pgtable_walk_fn fn, void* ctx);
+void pgtable_set_page(uint64_t* entry, uint64_t va, uint64_t pa, uint64_t attrs, pgtable_flush_fn flush, void* ctx);
+void pgtable_clear_page(uint64_t* entry, uint64_t va, pgtable_flush_fn flush, void* ctx);
+int pgtable_promote(uint64_t root_pa, uint64_t va, uint64_t size, pgtable_flush_fn flush, void* ctx);
+
+#endif // PGTABLE_H
@@ -0,0 +1,297 @@
+#include "pmm.h"
+#include "cpu.h"
+#include "kprintf.h"
+#include "lib.h"
+#include "astral_sched.h"
+#include "crash_core.h"
+
+// binary buddy allocator over 4kb frames, orders 0 (4kb) to PMM_MAX_ORDER (2mb).
+// blocks are naturally aligned in physical memory, so an order-9 block can
+// back a 2mb block mapping directly.
+
+#define PMM_FRAME_FREE     0x01 // head of a block sitting on a free list
+#define PMM_FRAME_RESERVED 0x02 // never handed to the buddy lists
+#define PMM_FRAME_CACHED   0x04 // free page sitting in a per-cpu cache
+
+// single pages are served from a small per-cpu stack first
+#define PMM_PCP_CACHE_SIZE  32
+#define PMM_PCP_CACHE_BATCH 16
+
+typedef struct {
+    uint8_t order;
+    uint8_t flags;
+    uint32_t refcount; // mappings sharing an allocated page, see pmm_page_get/put
+} page_frame_t;
+
+typedef struct pmm_free_node {
+    struct pmm_free_node* prev;
+    struct pmm_free_node* next;
+} pmm_free_node_t;
+
+typedef struct {
+    uint32_t count;
+    uint64_t pages[PMM_PCP_CACHE_SIZE];
+} pmm_page_cache_t;
+
+static page_frame_t* frames = 0;
+static uint64_t base_pfn = 0;
+static uint64_t end_pfn = 0;
+static pmm_free_node_t* free_areas[PMM_MAX_ORDER + 1];
+static uint64_t free_pages = 0;
+static spinlock_t pmm_lock;
+static pmm_page_cache_t page_caches[MAX_CORES];
+
+static inline page_frame_t* pfn_to_frame(uint64_t pfn) {
+    return &frames[pfn - base_pfn];
+}
+
+static inline pmm_free_node_t* pfn_to_node(uint64_t pfn) {
+    return (pmm_free_node_t*)PHYS_TO_VIRT(pfn << PMM_PAGE_SHIFT);
+}
+
+static inline uint64_t node_to_pfn(pmm_free_node_t* node) {
+    return VIRT_TO_PHYS(node) >> PMM_PAGE_SHIFT;
+}
+
+static void free_area_push(uint64_t pfn, uint32_t order) {
+    pmm_free_node_t* node = pfn_to_node(pfn);
+    node->prev = 0;
+    node->next = free_areas[order];
+    if (free_areas[order]) {
+        free_areas[order]->prev = node;
+    }
+    free_areas[order] = node;
+
+    page_frame_t* frame = pfn_to_frame(pfn);
+    frame->order = order;
+    frame->flags = PMM_FRAME_FREE;
+}
+
+static void free_area_remove(uint64_t pfn, uint32_t order) {
+    pmm_free_node_t* node = pfn_to_node(pfn);
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        free_areas[order] = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+    pfn_to_frame(pfn)->flags = 0;
+}
+
+// take the smallest free block that fits and split it down to the requested
+// order, handing the upper halves back to the lower free lists
+static uint64_t buddy_alloc(uint32_t order) {
+    uint32_t current = order;
+    while (current <= PMM_MAX_ORDER && !free_areas[current]) {
+        current++;
+    }
+    if (current > PMM_MAX_ORDER) return 0;
+
+    uint64_t pfn = node_to_pfn(free_areas[current]);
+    free_area_remove(pfn, current);
+    while (current > order) {
+        current--;
+        free_area_push(pfn + (1ULL << current), current);
+    }
+    pfn_to_frame(pfn)->order = order;
+    pfn_to_frame(pfn)->refcount = 1;
+    free_pages -= 1ULL << order;
+    return pfn << PMM_PAGE_SHIFT;
+}
+
+// merge with the buddy for as long as it is free and of the same order
+static void buddy_free(uint64_t pfn, uint32_t order) {
+    free_pages += 1ULL << order;
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = pfn ^ (1ULL << order);
+        if (buddy < base_pfn || buddy + (1ULL << order) > end_pfn) break;
+        page_frame_t* buddy_frame = pfn_to_frame(buddy);
+        if (!(buddy_frame->flags & PMM_FRAME_FREE) || buddy_frame->order != order) break;
+        free_area_remove(buddy, order);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+    free_area_push(pfn, order);
+}
+
+// frame metadata lives at the bottom of the managed range; everything after it
+// is released to the buddy lists in the largest naturally aligned blocks
+void pmm_init(uint64_t mem_start, uint64_t mem_size) {
+    uint64_t start = ALIGN_UP(mem_start, PMM_PAGE_SIZE);
+    uint64_t end = (mem_start + mem_size) & ~(PMM_PAGE_SIZE - 1);
+    if (end <= start) {
+        kprintf("pmm_init: empty memory range\n");
+        return;
+    }
+
+    base_pfn = start >> PMM_PAGE_SHIFT;
+    end_pfn = end >> PMM_PAGE_SHIFT;
+    memset(free_areas, 0, sizeof(free_areas));
+    memset(page_caches, 0, sizeof(page_caches));
+    free_pages = 0;
+    spinlock_init(&pmm_lock);
+
+    uint64_t frames_size = (end_pfn - base_pfn) * sizeof(page_frame_t);
+    frames = (page_frame_t*)PHYS_TO_VIRT(start);
+    memset(frames, 0, frames_size);
+
+    uint64_t first_free_pfn = (ALIGN_UP(start + frames_size, PMM_PAGE_SIZE)) >> PMM_PAGE_SHIFT;
+    for (uint64_t pfn = base_pfn; pfn < first_free_pfn && pfn < end_pfn; pfn++) {
+        pfn_to_frame(pfn)->flags = PMM_FRAME_RESERVED;
+    }
+
+    uint64_t pfn = first_free_pfn;
+    while (pfn < end_pfn) {
+        uint32_t order = PMM_MAX_ORDER;
+        while (order > 0 && ((pfn & ((1ULL << order) - 1)) || pfn + (1ULL << order) > end_pfn)) {
+            order--;
+        }
+        free_area_push(pfn, order);
+        free_pages += 1ULL << order;
+        pfn += 1ULL << order;
+    }
+
+    kprintf("pmm: %d free pages (%d mb)\n", (int)free_pages, (int)((free_pages << PMM_PAGE_SHIFT) >> 20));
+}
+
+uint64_t pmm_alloc_pages(uint32_t order) {
+    if (order > PMM_MAX_ORDER) return 0;
+
+    uint64_t flags = spinlock_acquire_irqsave(&pmm_lock);
+    uint64_t pa = buddy_alloc(order);
+    spinlock_release_irqrestore(&pmm_lock, flags);
+
+    if (!pa) {
+        kprintf("pmm_alloc_pages: out of memory for order %d\n", order);
+    }
+    return pa;
+}
+
+// a freed block must be one pmm handed out: in range, allocated, freed with
+// the order it was allocated with and no longer shared. anything else means
+// the frame is about to get two owners, so stop right here
+static void check_free(const char* who, uint64_t pa, uint32_t order) {
+    uint64_t pfn = pa >> PMM_PAGE_SHIFT;
+    if (!pa || (pa & (PMM_PAGE_SIZE - 1)) || pfn < base_pfn || pfn >= end_pfn || order > PMM_MAX_ORDER) {
+        crash_core_panic("%s: bad frame 0x%llx order %d", who, pa, (int)order);
+    }
+    page_frame_t* frame = pfn_to_frame(pfn);
+    if (frame->flags) {
+        crash_core_panic("%s: double free of 0x%llx", who, pa);
+    }
+    if (frame->order != order || frame->refcount > 1) {
+        crash_core_panic("%s: 0x%llx is order %d with %d users, freed as order %d", who, pa,
+                         (int)frame->order, (int)frame->refcount, (int)order);
+    }
+}
+
+void pmm_free_pages(uint64_t pa, uint32_t order) {
+    uint64_t flags = spinlock_acquire_irqsave(&pmm_lock);
+    check_free("pmm_free_pages", pa, order);
+    pfn_to_frame(pa >> PMM_PAGE_SHIFT)->refcount = 0;
+    buddy_free(pa >> PMM_PAGE_SHIFT, order);
+    spinlock_release_irqrestore(&pmm_lock, flags);
+}
+
+// order-0 fast path: pop from this core's cache, refilling it in one batch
+uint64_t pmm_alloc_page() {
+    uint64_t core_id = cpu_get_core_id();
+    if (core_id >= MAX_CORES) {
+        return pmm_alloc_pages(0);
+    }
+
+    uint64_t flags = cpu_irq_save();
+    pmm_page_cache_t* cache = &page_caches[core_id];
+    if (cache->count == 0) {
+        spinlock_acquire(&pmm_lock);
+        while (cache->count < PMM_PCP_CACHE_BATCH) {
+            uint64_t pa = buddy_alloc(0);
+            if (!pa) break;
+            pfn_to_frame(pa >> PMM_PAGE_SHIFT)->flags = PMM_FRAME_CACHED;
+            cache->pages[cache->count++] = pa;
+        }
+        spinlock_release(&pmm_lock);
+    }
+    uint64_t pa = cache->count ? cache->pages[--cache->count] : 0;
+    if (pa) {
+        page_frame_t* frame = pfn_to_frame(pa >> PMM_PAGE_SHIFT);
+        frame->flags = 0;
+        frame->refcount = 1;
+    }
+    cpu_irq_restore(flags);
+
+    if (!pa) {
+        kprintf("pmm_alloc_page: out of memory\n");
+    }
+    return pa;
+}
+
+// the frame is claimed for the cache with a compare-and-swap on its flags,
+// so of two cores freeing the same page only one gets it past the check
+void pmm_free_page(uint64_t pa) {
+    uint64_t core_id = cpu_get_core_id();
+    if (core_id >= MAX_CORES) {
+        pmm_free_pages(pa, 0);
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    check_free("pmm_free_page", pa, 0);
+    page_frame_t* frame = pfn_to_frame(pa >> PMM_PAGE_SHIFT);
+    uint8_t expected = 0;
+    if (!__atomic_compare_exchange_n(&frame->flags, &expected, PMM_FRAME_CACHED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        crash_core_panic("pmm_free_page: double free of 0x%llx", pa);
+    }
+    frame->refcount = 0;
+    pmm_page_cache_t* cache = &page_caches[core_id];
+    if (cache->count == PMM_PCP_CACHE_SIZE) {
+        spinlock_acquire(&pmm_lock);
+        while (cache->count > PMM_PCP_CACHE_SIZE - PMM_PCP_CACHE_BATCH) {
+            uint64_t pfn = cache->pages[--cache->count] >> PMM_PAGE_SHIFT;
+            pfn_to_frame(pfn)->flags = 0;
+            buddy_free(pfn, 0);
+        }
+        spinlock_release(&pmm_lock);
+    }
+    cache->pages[cache->count++] = pa;
+    cpu_irq_restore(flags);
+}
+
+// order-0 pages can be shared between address spaces (copy-on-write); the
+// last pmm_page_put returns the page
+void pmm_page_get(uint64_t pa) {
+    uint64_t pfn = pa >> PMM_PAGE_SHIFT;
+    if (pfn < base_pfn || pfn >= end_pfn) return;
+    // a wrapped count would free the page under its remaining users
+    if (__atomic_add_fetch(&pfn_to_frame(pfn)->refcount, 1, __ATOMIC_RELAXED) == 0) {
+        crash_core_panic("pmm_page_get: refcount of 0x%llx overflowed", pa);
+    }
+}
+
+void pmm_page_put(uint64_t pa) {
+    uint64_t pfn = pa >> PMM_PAGE_SHIFT;
+    if (pfn < base_pfn || pfn >= end_pfn) return;
+    if (__atomic_sub_fetch(&pfn_to_frame(pfn)->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        pmm_free_page(pa);
+    }
+}
+
+uint32_t pmm_page_refcount(uint64_t pa) {
+    uint64_t pfn = pa >> PMM_PAGE_SHIFT;
+    if (pfn < base_pfn || pfn >= end_pfn) return 0;
+    return __atomic_load_n(&pfn_to_frame(pfn)->refcount, __ATOMIC_RELAXED);
+}
+
+uint32_t pmm_order_for_size(uint64_t size) {
+    uint32_t order = 0;
+    while ((PMM_PAGE_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+uint64_t pmm_free_page_count() {
+    return free_pages;
+}
@@ -0,0 +1,30 @@
+#ifndef PMM_H
+#define PMM_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+typedef unsigned short uint16_t;
+typedef unsigned char uint8_t;
+
+#define PMM_PAGE_SHIFT 12
+#define PMM_PAGE_SIZE  (1ULL << PMM_PAGE_SHIFT)
+#define PMM_MAX_ORDER  9 // 2^9 pages = 2mb, the largest block handed out
+
+// the kernel runs in the upper half (ttbr1) and reaches physical memory through
+// a linear map at KERNEL_VIRT_BASE; the image itself is linked inside that map
+#define KERNEL_VIRT_BASE 0xFFFF000000000000ULL
+#define PHYS_TO_VIRT(pa) ((void*)((uint64_t)(pa) + KERNEL_VIRT_BASE))
+#define VIRT_TO_PHYS(va) ((uint64_t)(va) - KERNEL_VIRT_BASE)
+
+void pmm_init(uint64_t mem_start, uint64_t mem_size);
+uint64_t pmm_alloc_pages(uint32_t order);
+void pmm_free_pages(uint64_t pa, uint32_t order);
+uint64_t pmm_alloc_page();
+void pmm_free_page(uint64_t pa);
+void pmm_page_get(uint64_t pa);
+void pmm_page_put(uint64_t pa);
+uint32_t pmm_page_refcount(uint64_t pa);
+uint32_t pmm_order_for_size(uint64_t size);
+uint64_t pmm_free_page_count();
+
+#endif // PMM_H
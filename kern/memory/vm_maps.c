@@ -2,24 +2,29 @@
 #include "kprintf.h"
 #include "lib.h"
 #include "kmalloc.h"
-
-#define MAX_VM_MAP_ENTRIES 64
-static vm_map_entry_t vm_map_entries[MAX_VM_MAP_ENTRIES];
+#include "pmm.h"
+#include "pgtable.h"
+#include "asid.h"
+#include "cpu.h"
+#include "cache.h"
+#include "fs.h"
+#include "astral_sched.h"
+#include "workqueue.h"
 
 #define PAGE_SIZE 0x1000
-#define ALLOC_ALIGN 0x100000     // 1mb alignment for vm allocation
-#define BLOCK_SIZE 0x200000      // 2mb blocks for page table mapping
-#define INITIAL_MAPPING_BASE 0x40000000
-
-// kernel's level 1 page table allocated with 1kb alignment
-static uint64_t kernel_l1_page_table[512] __attribute__((aligned(PAGE_SIZE)));
-// a global level 2 page table for initial mapping (simple, static allocation)
-static uint64_t kernel_l2_page_table[512] __attribute__((aligned(PAGE_SIZE)));
+#define BLOCK_SIZE 0x200000      // allocations this large are 2mb aligned so they can use a block mapping
+#define VM_ALLOC_BASE VM_LINEAR_MAP_END // vm_map_allocate window, clear of the linear map
+#define VM_ALLOC_END  0xFFFF900000000000ULL
+#define USER_VA_END   0x0001000000000000ULL // ttbr0 covers the low 48 bits
 
-// memory type definitions for mair setting
-#define MT_DEVICE_NGNRNE    0x00
-#define MT_NORMAL_NC        0x01
-#define MT_NORMAL           0x02
+// the kernel address space, installed in ttbr1; its root (level 0) table is allocated from the pmm
+static vm_space_t kernel_space;
+// empty ttbr0 root for when no user address space is current
+static uint64_t empty_user_root_pa = 0;
+// task spaces, newest first. lock order: task_spaces_lock, then a space's
+// lock; a clone takes the parent's before the child's
+static spinlock_t task_spaces_lock;
+static vm_space_t* task_spaces = 0;
 
 // major attribute register value setup
 #define MAIR_VALUE ( (0x00 << (MT_DEVICE_NGNRNE * 8)) | \
@@ -32,196 +37,940 @@ static uint64_t kernel_l2_page_table[512] __attribute__((aligned(PAGE_SIZE)));
 #define TCR_ORGN0_WBWA      (0x1 << 10)
 #define TCR_SH0_INNER       (0x3 << 12)
 #define TCR_TG0_4KB         (0x0 << 14)
-#define TCR_PS_48BIT        (0x5 << 16)
-#define TCR_VALUE (TCR_T0SZ(48) | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA | TCR_SH0_INNER | TCR_TG0_4KB | TCR_PS_48BIT)
-
-// page table entry flags
-#define PTE_VALID                (1ULL << 0)
-#define PTE_TABLE                (1ULL << 1)
-#define PTE_BLOCK                (0ULL << 1)
-#define PTE_AF                   (1ULL << 10)
-#define PTE_SH_INNER_SHAREABLE   (0x3ULL << 8)
-#define PTE_AP_RW_EL1            (0x0ULL << 6)
-#define PTE_PXN                  (1ULL << 53)
-#define PTE_UXN                  (1ULL << 54)
-
-// basic tlb invalidation function
-static void tlb_invalidate(void) {
-    asm volatile("tlbi vmalle1is");
-    asm volatile("dsb sy");
-    asm volatile("isb sy");
+#define TCR_T1SZ(x)         ((uint64_t)(64 - (x)) << 16)
+#define TCR_IRGN1_WBWA      (0x1ULL << 24)
+#define TCR_ORGN1_WBWA      (0x1ULL << 26)
+#define TCR_SH1_INNER       (0x3ULL << 28)
+#define TCR_TG1_4KB         (0x2ULL << 30)
+#define TCR_IPS_48BIT       (0x5ULL << 32)
+#define TCR_AS_16BIT        (0x1ULL << 36)  // set when the core implements 16-bit asids
+#define TCR_VALUE (TCR_T0SZ(48) | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA | TCR_SH0_INNER | TCR_TG0_4KB | \
+                   TCR_T1SZ(48) | TCR_IRGN1_WBWA | TCR_ORGN1_WBWA | TCR_SH1_INNER | TCR_TG1_4KB | TCR_IPS_48BIT)
+
+// past this many pages one asid-wide flush is cheaper than per-page tlbis
+#define TLBI_RANGE_MAX_PAGES 64
+
+// invalidate the translations of [va, va + size) in a space on all cores.
+// kernel mappings are global, which vae1is also matches, so asid 0 serves them;
+// large ranges fall back to dropping the whole asid
+static void tlb_invalidate_range(vm_space_t* space, uint64_t va, uint64_t size) {
+    uint64_t asid = asid_of(space);
+    asm volatile("dsb ishst" : : : "memory");
+    if (size / PAGE_SIZE > TLBI_RANGE_MAX_PAGES) {
+        if (space == &kernel_space) {
+            asm volatile("tlbi vmalle1is" : : : "memory");
+        } else {
+            asm volatile("tlbi aside1is, %0" : : "r"(asid << ASID_TTBR_SHIFT) : "memory");
+        }
+    } else {
+        for (uint64_t page = va; page < va + size; page += PAGE_SIZE) {
+            asm volatile("tlbi vae1is, %0" : : "r"((asid << ASID_TTBR_SHIFT) | ((page >> 12) & 0xFFFFFFFFFFFULL)) : "memory");
+        }
+    }
+    asm volatile("dsb ish" : : : "memory");
+    asm volatile("isb" : : : "memory");
+}
+
+// the pgtable flush callback, ctx is the space whose tables are walked
+static void space_flush(uint64_t va, uint64_t size, void* ctx) {
+    tlb_invalidate_range((vm_space_t*)ctx, va, size);
+}
+
+// new translations need no tlbi since invalid entries are never cached, only
+// the table writes have to be visible to the walker
+static void tlb_publish(void) {
+    asm volatile("dsb ishst" : : : "memory");
+    asm volatile("isb" : : : "memory");
 }
 
-// find a free slot in the vm map entries array by scanning for an entry marked as free
-static int find_free_vm_map_entry_slot() {
-    for (int i = 0; i < MAX_VM_MAP_ENTRIES; i++) {
-        if (vm_map_entries[i].protection_flags == VM_PROT_FREE)
-            return i;
+// translate vm_prot flags into stage 1 descriptor attributes. kernel mappings are
+// never executable from el0, user mappings never from el1. a mapping without
+// read, write or exec keeps its descriptor but has PTE_VALID clear
+static uint64_t prot_to_attrs(uint32_t protection_flags) {
+    uint64_t attrs = PTE_AF | PTE_SH_INNER_SHAREABLE;
+    if (protection_flags & (VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXEC)) {
+        attrs |= PTE_VALID;
     }
-    return -1;
+    if (protection_flags & VM_PROT_DEVICE) {
+        attrs |= PTE_ATTR_INDEX(MT_DEVICE_NGNRNE) | PTE_PXN | PTE_UXN;
+    } else {
+        attrs |= PTE_ATTR_INDEX(MT_NORMAL);
+    }
+
+    if (protection_flags & VM_PROT_KERNEL) {
+        attrs |= (protection_flags & VM_PROT_WRITE) ? PTE_AP_RW_EL1 : PTE_AP_RO_EL1;
+        attrs |= PTE_UXN;
+        if (!(protection_flags & VM_PROT_EXEC)) attrs |= PTE_PXN;
+    } else {
+        attrs |= (protection_flags & VM_PROT_WRITE) ? PTE_AP_RW_EL0 : PTE_AP_RO_EL0;
+        attrs |= PTE_PXN | PTE_NG;
+        if (!(protection_flags & VM_PROT_EXEC)) attrs |= PTE_UXN;
+    }
+    return attrs;
 }
 
-// check if a given mapping range overlaps with an existing mapping
-static int check_range_overlap(uint64_t va, uint64_t size) {
-    uint64_t new_end = va + size;
-    for (int i = 0; i < MAX_VM_MAP_ENTRIES; i++) {
-        if (vm_map_entries[i].protection_flags != VM_PROT_FREE) {
-            uint64_t existing_start = vm_map_entries[i].virtual_address;
-            uint64_t existing_end = existing_start + vm_map_entries[i].size;
-            if ((va < existing_end) && (new_end > existing_start))
-                return 1;
-        }
+// make addr a region boundary by cutting the region that straddles it in two
+static int split_region_at(vm_space_t* space, uint64_t addr) {
+    vm_region_t* region = vm_region_find(space->regions, addr);
+    if (!region || region->start == addr) {
+        return 0;
+    }
+    vm_region_t* upper = (vm_region_t*)kmalloc(sizeof(vm_region_t));
+    if (!upper) {
+        kprintf("vm_space: failed to split region at va: 0x%llx\n", addr);
+        return -1;
     }
+    upper->start = addr;
+    upper->end = region->end;
+    upper->physical_address = region->physical_address + (addr - region->start);
+    upper->protection_flags = region->protection_flags;
+    upper->backing = region->backing;
+    upper->file_inode = region->file_inode;
+    upper->file_offset = region->file_offset + (addr - region->start);
+    upper->file_size = region->file_size > addr - region->start ? region->file_size - (addr - region->start) : 0;
+
+    // shrinking a node changes the cached spans on its path, so reinsert it
+    vm_region_remove(&space->regions, region);
+    region->end = addr;
+    if (region->file_size > addr - region->start) {
+        region->file_size = addr - region->start;
+    }
+    vm_region_insert(&space->regions, region);
+    vm_region_insert(&space->regions, upper);
+    space->region_count++;
     return 0;
 }
 
-// add a new vm mapping entry to the tracking array, checking for free slot and range overlap
-void vm_map_add_entry(uint64_t virtual_address, uint64_t physical_address, uint64_t size, uint32_t protection_flags) {
-    // check for overlap with existing mappings
-    if (check_range_overlap(virtual_address, size)) {
-        kprintf("vm_map_add_entry: mapping overlap detected at va: 0x%llx\n", virtual_address);
-        return;
+// resolve a size of 0 to the rest of the region containing va
+static int resolve_range(vm_space_t* space, uint64_t va, uint64_t* size) {
+    if (*size == 0) {
+        vm_region_t* region = vm_region_find(space->regions, va);
+        if (!region) return -1;
+        *size = region->end - va;
+    }
+    if ((va | *size) & (PAGE_SIZE - 1)) {
+        kprintf("vm_space: unaligned range at va: 0x%llx\n", va);
+        return -1;
     }
+    if (!vm_region_overlaps(space->regions, va, va + *size)) {
+        return -1;
+    }
+    return 0;
+}
 
-    int index = find_free_vm_map_entry_slot();
-    if (index == -1) {
-        kprintf("vm_map_add_entry: no free vm map entries!\n");
-        return;
+void vm_space_init(vm_space_t* space, uint64_t root_pa) {
+    spinlock_init(&space->lock);
+    space->root_pa = root_pa;
+    space->context_id = 0;
+    space->regions = 0;
+    space->region_count = 0;
+    space->promote_pending = 0;
+    space->refs = 1;
+    space->dead = 0;
+    space->next = 0;
+}
+
+vm_space_t* vm_kernel_space() {
+    return &kernel_space;
+}
+
+// the region containing va. it only stays valid while nothing unmaps or
+// splits it, which the caller has to ensure
+vm_region_t* vm_space_find(vm_space_t* space, uint64_t va) {
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    vm_region_t* region = vm_region_find(space->regions, va);
+    spinlock_release_irqrestore(&space->lock, flags);
+    return region;
+}
+
+static uint64_t find_gap_locked(vm_space_t* space, uint64_t low, uint64_t high, uint64_t size, uint64_t align) {
+    uint64_t va;
+    if (vm_region_find_gap(space->regions, low, high, size, align, &va) != 0) {
+        return 0;
     }
-    vm_map_entries[index].virtual_address = virtual_address;
-    vm_map_entries[index].physical_address = physical_address;
-    vm_map_entries[index].size = size;
-    vm_map_entries[index].protection_flags = protection_flags;
-    // invalidate tlb after adding a new mapping
-    tlb_invalidate();
+    return va;
 }
 
-// initialize all vm map entries to free and add the initial kernel mapping
-void vm_init() {
-    for (int i = 0; i < MAX_VM_MAP_ENTRIES; i++) {
-        vm_map_entries[i].protection_flags = VM_PROT_FREE;
+// lowest free, align-aligned range of size bytes inside [low, high), or 0
+uint64_t vm_space_find_gap(vm_space_t* space, uint64_t low, uint64_t high, uint64_t size, uint64_t align) {
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    uint64_t va = find_gap_locked(space, low, high, size, align);
+    spinlock_release_irqrestore(&space->lock, flags);
+    return va;
+}
+
+// record a region without touching the tables beyond what map_eagerly asks for
+static int insert_region(vm_space_t* space, uint64_t virtual_address, uint64_t size, uint32_t protection_flags, vm_region_t** out) {
+    if (size == 0 || ((virtual_address | size) & (PAGE_SIZE - 1))) {
+        kprintf("vm_map: unaligned mapping at va: 0x%llx\n", virtual_address);
+        return -1;
+    }
+    // the kernel space lives in the upper half, task spaces in the lower
+    int in_kernel_half = virtual_address >= KERNEL_VIRT_BASE;
+    if ((space == &kernel_space) != in_kernel_half || (!in_kernel_half && virtual_address + size > USER_VA_END)) {
+        kprintf("vm_map: va 0x%llx outside the address space\n", virtual_address);
+        return -1;
+    }
+    if (vm_region_overlaps(space->regions, virtual_address, virtual_address + size)) {
+        kprintf("vm_map: mapping overlap detected at va: 0x%llx\n", virtual_address);
+        return -1;
+    }
+    vm_region_t* region = (vm_region_t*)kmalloc(sizeof(vm_region_t));
+    if (!region) {
+        kprintf("vm_map: failed to allocate region for va: 0x%llx\n", virtual_address);
+        return -1;
     }
-    // add kernel mapping: map first 1gb of physical address space with full permissions
-    vm_map_add_entry(0x0, 0x0, 0x40000000, VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXEC | VM_PROT_KERNEL);
+    memset(region, 0, sizeof(vm_region_t));
+    region->start = virtual_address;
+    region->end = virtual_address + size;
+    region->protection_flags = protection_flags;
+    vm_region_insert(&space->regions, region);
+    space->region_count++;
+    *out = region;
+    return 0;
 }
 
-// map a given virtual address range to a physical address range with specific protection flags
-int vm_map(uint64_t virtual_address, uint64_t physical_address, uint64_t size, uint32_t protection_flags) {
-    vm_map_add_entry(virtual_address, physical_address, size, protection_flags);
-    // invalidate tlb after mapping change
-    tlb_invalidate();
+static void drop_region(vm_space_t* space, vm_region_t* region) {
+    vm_region_remove(&space->regions, region);
+    space->region_count--;
+    kfree(region);
+}
+
+static int map_locked(vm_space_t* space, uint64_t virtual_address, uint64_t physical_address, uint64_t size, uint32_t protection_flags) {
+    if (physical_address & (PAGE_SIZE - 1)) {
+        kprintf("vm_map: unaligned mapping at va: 0x%llx\n", virtual_address);
+        return -1;
+    }
+    vm_region_t* region;
+    if (insert_region(space, virtual_address, size, protection_flags, &region) != 0) {
+        return -1;
+    }
+    region->backing = VM_BACKING_FIXED;
+    region->physical_address = physical_address;
+    if (pgtable_map(space->root_pa, virtual_address, physical_address, size, prot_to_attrs(protection_flags), space_flush, space) != 0) {
+        kprintf("vm_map: failed to build page tables for va: 0x%llx\n", virtual_address);
+        pgtable_unmap(space->root_pa, virtual_address, size, 0, 0, space_flush, space);
+        drop_region(space, region);
+        return -1;
+    }
+    space->promote_pending = 1;
+    tlb_publish();
     return 0;
 }
 
-// unmap a given virtual address range; size parameter is currently ignored and unmaps the entire mapping
-int vm_unmap(uint64_t virtual_address, uint64_t size) {
-    for (int i = 0; i < MAX_VM_MAP_ENTRIES; i++) {
-        if (vm_map_entries[i].virtual_address == virtual_address && vm_map_entries[i].protection_flags != VM_PROT_FREE) {
-            vm_map_entries[i].protection_flags = VM_PROT_FREE;
-            // invalidate tlb after unmapping
-            tlb_invalidate();
-            return 0;
+// map a virtual address range to a physical address range with specific protection flags.
+// the range is written into the space's tables using the largest blocks its alignment allows
+int vm_space_map(vm_space_t* space, uint64_t virtual_address, uint64_t physical_address, uint64_t size, uint32_t protection_flags) {
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    int ret = map_locked(space, virtual_address, physical_address, size, protection_flags);
+    spinlock_release_irqrestore(&space->lock, flags);
+    return ret;
+}
+
+// reserve a zero-filled range; frames are allocated by the fault handler on
+// first touch and freed when the range is unmapped
+int vm_space_map_anon(vm_space_t* space, uint64_t virtual_address, uint64_t size, uint32_t protection_flags) {
+    vm_region_t* region;
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    int ret = insert_region(space, virtual_address, size, protection_flags, &region);
+    if (ret == 0) {
+        region->backing = VM_BACKING_ANON;
+    }
+    spinlock_release_irqrestore(&space->lock, flags);
+    return ret;
+}
+
+// reserve a range whose first file_size bytes come from an inode starting at
+// file_offset, read a page at a time as they are touched; the rest is zero filled
+int vm_space_map_file(vm_space_t* space, uint64_t virtual_address, uint64_t size, uint32_t protection_flags,
+                      uint32_t inode_id, uint64_t file_offset, uint64_t file_size) {
+    vm_region_t* region;
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    int ret = insert_region(space, virtual_address, size, protection_flags, &region);
+    if (ret == 0) {
+        region->backing = VM_BACKING_FILE;
+        region->file_inode = inode_id;
+        region->file_offset = file_offset;
+        region->file_size = file_size < size ? file_size : size;
+    }
+    spinlock_release_irqrestore(&space->lock, flags);
+    return ret;
+}
+
+// frames of unmapped anon/file pages are collected while the tables are torn
+// down and only dropped once the tlb can no longer reach them. a frame still
+// shared copy-on-write with another space survives the put
+#define FRAME_BATCH 64
+
+typedef struct {
+    vm_space_t* space;
+    uint64_t count;
+    uint64_t frames[FRAME_BATCH];
+} frame_batch_t;
+
+static void release_frames(frame_batch_t* batch) {
+    for (uint64_t i = 0; i < batch->count; i++) {
+        pmm_page_put(batch->frames[i]);
+    }
+    batch->count = 0;
+}
+
+static void queue_frame(uint64_t pa, uint64_t size, void* ctx) {
+    frame_batch_t* batch = (frame_batch_t*)ctx;
+    for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        if (batch->count == FRAME_BATCH) {
+            // a full batch is flushed early: drop the whole asid once, then
+            // the frames are safe to hand back
+            tlb_invalidate_range(batch->space, 0, ~0ULL);
+            release_frames(batch);
         }
+        batch->frames[batch->count++] = pa + offset;
     }
-    return -1;
 }
 
-// change protection flags for a given vm mapping range; size parameter is not used for now
-int vm_protect(uint64_t virtual_address, uint64_t size, uint32_t new_protection_flags) {
-    for (int i = 0; i < MAX_VM_MAP_ENTRIES; i++) {
-        if (vm_map_entries[i].virtual_address == virtual_address && vm_map_entries[i].protection_flags != VM_PROT_FREE) {
-            vm_map_entries[i].protection_flags = new_protection_flags;
-            // invalidate tlb after permission change
-            tlb_invalidate();
-            return 0;
+static int unmap_locked(vm_space_t* space, uint64_t virtual_address, uint64_t size) {
+    if (resolve_range(space, virtual_address, &size) != 0) {
+        return -1;
+    }
+    uint64_t end = virtual_address + size;
+    if (split_region_at(space, virtual_address) != 0 || split_region_at(space, end) != 0) {
+        return -1;
+    }
+    int ret = 0;
+    frame_batch_t frames;
+    frames.space = space;
+    frames.count = 0;
+    uint64_t cursor = virtual_address;
+    vm_region_t* region;
+    while ((region = vm_region_first_ending_after(space->regions, cursor)) && region->start < end) {
+        cursor = region->end;
+        pgtable_leaf_fn leaf_fn = (region->backing == VM_BACKING_FIXED) ? 0 : queue_frame;
+        if (pgtable_unmap(space->root_pa, region->start, region->end - region->start, leaf_fn, &frames, space_flush, space) != 0) {
+            kprintf("vm_unmap: failed to split block at va: 0x%llx\n", region->start);
+            ret = -1;
+            break;
         }
+        drop_region(space, region);
     }
-    return -1;
+    space->promote_pending = 1;
+    // pgtable_unmap flushed every range it cleared, the frames are unreachable
+    release_frames(&frames);
+    return ret;
 }
 
-// allocate a new vm mapping using a simple linear allocation scheme with fixed alignment
-uint64_t vm_map_allocate(uint64_t size, uint32_t protection_flags) {
-    int index = find_free_vm_map_entry_slot();
-    if (index == -1) {
-        kprintf("vm_map_allocate: no free mapping slots available\n");
+// unmap every mapped page in [va, va + size), splitting regions that straddle
+// either end; a size of 0 unmaps the rest of the region containing va
+int vm_space_unmap(vm_space_t* space, uint64_t virtual_address, uint64_t size) {
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    int ret = unmap_locked(space, virtual_address, size);
+    spinlock_release_irqrestore(&space->lock, flags);
+    return ret;
+}
+
+static int protect_locked(vm_space_t* space, uint64_t virtual_address, uint64_t size, uint32_t new_protection_flags) {
+    if (resolve_range(space, virtual_address, &size) != 0) {
+        return -1;
+    }
+    uint64_t end = virtual_address + size;
+    if (split_region_at(space, virtual_address) != 0 || split_region_at(space, end) != 0) {
+        return -1;
+    }
+    if (pgtable_protect(space->root_pa, virtual_address, size, prot_to_attrs(new_protection_flags), space_flush, space) != 0) {
+        kprintf("vm_protect: failed to split block at va: 0x%llx\n", virtual_address);
+        tlb_invalidate_range(space, virtual_address, size);
+        return -1;
+    }
+    uint64_t cursor = virtual_address;
+    vm_region_t* region;
+    while ((region = vm_region_first_ending_after(space->regions, cursor)) && region->start < end) {
+        region->protection_flags = new_protection_flags;
+        cursor = region->end;
+    }
+    space->promote_pending = 1;
+    // invalidate tlb after permission change
+    tlb_invalidate_range(space, virtual_address, size);
+    return 0;
+}
+
+// change protection flags for every region in [va, va + size); a size of 0
+// covers the rest of the region containing va
+int vm_space_protect(vm_space_t* space, uint64_t virtual_address, uint64_t size, uint32_t new_protection_flags) {
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    int ret = protect_locked(space, virtual_address, size, new_protection_flags);
+    spinlock_release_irqrestore(&space->lock, flags);
+    return ret;
+}
+
+// a file read for the fault handler. the abort handler runs with irqs masked
+// and must not do block i/o or take the block device mutex, so the read goes
+// to a worker task while the faulting task sleeps. the request lives on the
+// faulting task's stack: once done is set the worker no longer touches it
+typedef struct {
+    work_t work;
+    uint32_t inode_id;
+    uint64_t offset;
+    uint8_t* page;
+    uint64_t count;
+    int result;
+    tcb_t* waiter;
+    volatile uint32_t done;
+} file_fill_t;
+
+static void file_fill_fn(void* ctx) {
+    file_fill_t* fill = (file_fill_t*)ctx;
+    tcb_t* waiter = fill->waiter;
+    fill->result = fs_read(fill->inode_id, fill->offset, fill->page, fill->count) < 0 ? -1 : 0;
+    __atomic_store_n(&fill->done, 1, __ATOMIC_RELEASE);
+    sched_wake(waiter);
+}
+
+static int fill_from_file(uint32_t inode_id, uint64_t offset, uint8_t* page, uint64_t count) {
+    file_fill_t fill;
+    work_init(&fill.work, file_fill_fn, &fill);
+    fill.inode_id = inode_id;
+    fill.offset = offset;
+    fill.page = page;
+    fill.count = count;
+    fill.result = -1;
+    fill.waiter = sched_current_task();
+    fill.done = 0;
+    work_queue(&fill.work);
+    while (1) {
+        sched_prepare_block();
+        if (__atomic_load_n(&fill.done, __ATOMIC_ACQUIRE)) {
+            sched_cancel_block();
+            break;
+        }
+        sched_block();
+    }
+    return fill.result;
+}
+
+// populate one page of a lazily backed region, with space->lock held. a
+// file-backed page is read while the faulting task sleeps without the lock,
+// so the region is checked again afterwards and the fault just retried if it
+// changed or the page got mapped meanwhile
+static int fault_in_page(vm_space_t* space, vm_region_t* region, uint64_t page_va) {
+    uint64_t pa;
+    if (region->backing == VM_BACKING_FIXED) {
+        pa = region->physical_address + (page_va - region->start);
+    } else {
+        uint64_t offset = page_va - region->start;
+        int from_file = region->backing == VM_BACKING_FILE && offset < region->file_size;
+        if (from_file && !sched_can_block()) {
+            kprintf("vm_fault: file-backed va 0x%llx touched outside a task\n", page_va);
+            return -1;
+        }
+        pa = pmm_alloc_page();
+        if (!pa) {
+            return -1;
+        }
+        uint8_t* page = (uint8_t*)PHYS_TO_VIRT(pa);
+        memset(page, 0, PAGE_SIZE);
+
+        if (from_file) {
+            uint32_t inode_id = region->file_inode;
+            uint64_t file_offset = region->file_offset + offset;
+            uint64_t count = region->file_size - offset;
+            if (count > PAGE_SIZE) count = PAGE_SIZE;
+            // irqs stay masked from the fault handler's irqsave
+            spinlock_release(&space->lock);
+            int filled = fill_from_file(inode_id, file_offset, page, count);
+            spinlock_acquire(&space->lock);
+            if (filled != 0) {
+                kprintf("vm_fault: failed to read inode %d for va: 0x%llx\n", (int)inode_id, page_va);
+                pmm_free_page(pa);
+                return -1;
+            }
+            region = vm_region_find(space->regions, page_va);
+            uint32_t level;
+            uint64_t* pte = pgtable_lookup(space->root_pa, page_va, &level);
+            if (!region || region->backing != VM_BACKING_FILE || region->file_inode != inode_id ||
+                region->file_offset + (page_va - region->start) != file_offset || (pte && (*pte & PTE_VALID))) {
+                pmm_free_page(pa);
+                return 0;
+            }
+        }
+    }
+    if (pgtable_map(space->root_pa, page_va, pa, PAGE_SIZE, prot_to_attrs(region->protection_flags), space_flush, space) != 0) {
+        if (region->backing != VM_BACKING_FIXED) {
+            pmm_free_page(pa);
+        }
+        return -1;
+    }
+    tlb_publish();
+    return 0;
+}
+
+// first write to a copy-on-write page: the last sharer just gets write access
+// back, everyone else takes a private copy
+static int break_cow(vm_space_t* space, vm_region_t* region, uint64_t page_va, uint64_t* pte) {
+    uint64_t old_pa = *pte & PTE_ADDR_MASK;
+    uint64_t attrs = prot_to_attrs(region->protection_flags);
+    if (pmm_page_refcount(old_pa) == 1) {
+        pgtable_set_page(pte, page_va, old_pa, attrs, space_flush, space);
+        tlb_invalidate_range(space, page_va, PAGE_SIZE);
         return 0;
     }
-    // calculate allocated virtual address based on index and fixed allocation alignment
-    uint64_t allocated_va = INITIAL_MAPPING_BASE + (index * ALLOC_ALIGN);
-    // assume pa = va mapping for now; in production, a real physical allocator should be used
-    uint64_t allocated_pa = allocated_va;
-    vm_map_add_entry(allocated_va, allocated_pa, size, protection_flags);
-    return allocated_va;
+
+    uint64_t new_pa = pmm_alloc_page();
+    if (!new_pa) {
+        return -1;
+    }
+    memcpy(PHYS_TO_VIRT(new_pa), PHYS_TO_VIRT(old_pa), PAGE_SIZE);
+    // break before make: no tlb may hold the shared frame once the copy is mapped
+    pgtable_clear_page(pte, page_va, space_flush, space);
+    tlb_invalidate_range(space, page_va, PAGE_SIZE);
+    pgtable_set_page(pte, page_va, new_pa, attrs, space_flush, space);
+    tlb_publish();
+    pmm_page_put(old_pa);
+    return 0;
 }
 
-// deallocate vm mapping by unmapping at the given virtual address
-int vm_map_deallocate(uint64_t virtual_address) {
-    return vm_unmap(virtual_address, 0);
+static int handle_fault_locked(vm_space_t* space, uint64_t far, uint32_t fault_type, int is_write, int is_exec, int from_user) {
+    vm_region_t* region = vm_region_find(space->regions, far);
+    if (!region) {
+        return -1;
+    }
+
+    // the region decides what is allowed; a copy-on-write mark only says how
+    // a write the region permits is served
+    uint32_t prot = region->protection_flags;
+    if ((is_write && !(prot & VM_PROT_WRITE)) || (is_exec && !(prot & VM_PROT_EXEC)) ||
+        !(prot & (VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXEC)) || (from_user && (prot & VM_PROT_KERNEL))) {
+        return -1;
+    }
+
+    uint64_t page_va = far & ~(uint64_t)(PAGE_SIZE - 1);
+    uint32_t level;
+    uint64_t* pte = pgtable_lookup(space->root_pa, page_va, &level);
+    if (fault_type == ESR_FSC_PERMISSION) {
+        if (is_write && pte && level == 3 && (*pte & PTE_SW_COW)) {
+            return break_cow(space, region, page_va, pte);
+        }
+        return -1;
+    }
+    // another core may have populated the page, or finished replacing the
+    // tables around it, since the walk that faulted
+    if (pte && (*pte & PTE_VALID)) {
+        return 0;
+    }
+    return fault_in_page(space, region, page_va);
 }
 
-// enable the mmu with basic page table setup
-void cpu_enable_mmu() {
-    // clear kernel level 1 and level 2 page tables
-    memset(kernel_l1_page_table, 0, sizeof(kernel_l1_page_table));
-    memset(kernel_l2_page_table, 0, sizeof(kernel_l2_page_table));
+// resolve a synchronous abort from esr_el1/far_el1. returns 0 once the access
+// can be retried, -1 if it is a real fault. a fault that races with a change
+// to the same space waits on its lock, then sees the finished tables
+int vm_handle_fault(uint64_t esr, uint64_t far) {
+    uint32_t ec = (esr >> ESR_EC_SHIFT) & ESR_EC_MASK;
+    int is_exec = (ec == ESR_EC_IABT_LOWER || ec == ESR_EC_IABT_CURRENT);
+    if (!is_exec && ec != ESR_EC_DABT_LOWER && ec != ESR_EC_DABT_CURRENT) {
+        return -1;
+    }
+    int from_user = (ec == ESR_EC_IABT_LOWER || ec == ESR_EC_DABT_LOWER);
+    int is_write = !is_exec && (esr & ESR_ISS_WNR) && !(esr & ESR_ISS_CM);
+    uint32_t fault_type = esr & ESR_FSC_TYPE_MASK;
+    if (fault_type != ESR_FSC_TRANSLATION && fault_type != ESR_FSC_PERMISSION) {
+        return -1;
+    }
+
+    vm_space_t* space = &kernel_space;
+    if (far < KERNEL_VIRT_BASE) {
+        tcb_t* task = sched_current_task();
+        space = task ? task->space : 0;
+    }
+    if (!space) {
+        return -1;
+    }
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    int ret = handle_fault_locked(space, far, fault_type, is_write, is_exec, from_user);
+    spinlock_release_irqrestore(&space->lock, flags);
+    return ret;
+}
+
+typedef struct {
+    vm_space_t* parent;
+    vm_space_t* child;
+    vm_region_t* region;
+    int failed;
+} clone_ctx_t;
+
+// share one present page of a private region: both sides lose write access
+// and the frame gains a reference for the child. the page is marked
+// copy-on-write even in a region that is read-only now, so a later
+// vm_protect cannot make the shared frame writable in both spaces
+static void clone_page(uint64_t va, uint64_t* entry, uint32_t level, void* ctx) {
+    clone_ctx_t* clone = (clone_ctx_t*)ctx;
+    if (clone->failed || level != 3) {
+        clone->failed |= (level != 3);
+        return;
+    }
+    uint64_t pa = *entry & PTE_ADDR_MASK;
+    uint64_t attrs = (*entry & (PTE_ATTR_MASK | PTE_VALID)) | PTE_AP_RDONLY | PTE_SW_COW;
+    pgtable_set_page(entry, va, pa, attrs, space_flush, clone->parent);
+    // the child is not live on any core yet, so nothing needs flushing
+    if (pgtable_map(clone->child->root_pa, va, pa, PAGE_SIZE, attrs, 0, 0) != 0) {
+        clone->failed = 1;
+        return;
+    }
+    pmm_page_get(pa);
+}
+
+static void clear_locked(vm_space_t* space) {
+    vm_region_t* region;
+    while ((region = space->regions) != 0) {
+        if (unmap_locked(space, region->start, region->end - region->start) != 0) {
+            drop_region(space, region);
+        }
+    }
+}
+
+static int clone_regions(vm_space_t* parent, vm_space_t* child, vm_region_t* region) {
+    if (!region) {
+        return 0;
+    }
+    if (clone_regions(parent, child, region->left) != 0) {
+        return -1;
+    }
+
+    vm_region_t* copy;
+    uint64_t size = region->end - region->start;
+    if (insert_region(child, region->start, size, region->protection_flags, &copy) != 0) {
+        return -1;
+    }
+    copy->physical_address = region->physical_address;
+    copy->backing = region->backing;
+    copy->file_inode = region->file_inode;
+    copy->file_offset = region->file_offset;
+    copy->file_size = region->file_size;
+
+    if (region->backing == VM_BACKING_FIXED) {
+        // fixed frames belong to whoever mapped them, so both spaces share them as is
+        if (pgtable_map(child->root_pa, region->start, region->physical_address, size, prot_to_attrs(region->protection_flags), 0, 0) != 0) {
+            return -1;
+        }
+    } else {
+        clone_ctx_t clone = { parent, child, region, 0 };
+        pgtable_walk(parent->root_pa, region->start, size, clone_page, &clone);
+        if (clone.failed) {
+            return -1;
+        }
+    }
+    return clone_regions(parent, child, region->right);
+}
 
-    // map first 1gb of physical memory as 2mb blocks using the global level 2 table
-    kernel_l1_page_table[0] = (uint64_t)kernel_l2_page_table | PTE_TABLE | PTE_VALID;
+// fill an empty task address space with a copy-on-write duplicate of another:
+// the child gets the same regions, private pages are shared read-only with a
+// reference per space, and only pages written afterwards are copied. pages
+// never touched stay lazy in both. on failure the child is left empty
+int vm_space_clone_into(vm_space_t* parent, vm_space_t* child) {
+    if (!parent || !child || parent == child || parent == &kernel_space || child == &kernel_space) {
+        return -1;
+    }
+    uint64_t flags = spinlock_acquire_irqsave(&parent->lock);
+    spinlock_acquire(&child->lock);
+    int ret = -1;
+    if (!child->regions) {
+        ret = clone_regions(parent, child, parent->regions);
+        // the parent lost write access to its private pages
+        tlb_invalidate_range(parent, 0, ~0ULL);
+        if (ret != 0) {
+            kprintf("vm_space_clone_into: out of memory\n");
+            clear_locked(child);
+        }
+    }
+    spinlock_release(&child->lock);
+    spinlock_release_irqrestore(&parent->lock, flags);
+    if (ret == 0) {
+        tlb_publish();
+    }
+    return ret;
+}
 
-    for (int i = 0; i < 512; i++) {
-        uint64_t pa = i * BLOCK_SIZE;
-        uint64_t attributes = PTE_VALID | PTE_BLOCK | PTE_AF | PTE_SH_INNER_SHAREABLE | PTE_AP_RW_EL1;
-        attributes |= (MT_NORMAL << 2);
-        kernel_l2_page_table[i] = pa | attributes;
+vm_space_t* vm_clone_address_space(vm_space_t* parent) {
+    vm_space_t* child = vm_space_create();
+    if (!child) {
+        return 0;
+    }
+    if (vm_space_clone_into(parent, child) != 0) {
+        vm_space_destroy(child);
+        return 0;
     }
+    return child;
+}
 
-    // map the framebuffer as device memory, assuming framebuffer is 16mb at 0x40000000
-    uint64_t fb_base_pa = INITIAL_MAPPING_BASE;
-    uint64_t fb_size = 0x1000000; // 16mb
-    uint64_t l1_idx = (fb_base_pa >> 30) & 0x1FF;
+// unmap everything in a task address space but keep its root table and asid,
+// so the space can be handed to another task
+void vm_space_clear(vm_space_t* space) {
+    if (!space || space == &kernel_space) {
+        return;
+    }
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    clear_locked(space);
+    spinlock_release_irqrestore(&space->lock, flags);
+}
 
-    // if the l1 entry for fb region does not have a valid l2 table, allocate one
-    if (!(kernel_l1_page_table[l1_idx] & PTE_VALID)) {
-        uint64_t* new_l2_table = (uint64_t*)kmalloc(PAGE_SIZE);
-        memset(new_l2_table, 0, PAGE_SIZE);
-        kernel_l1_page_table[l1_idx] = (uint64_t)new_l2_table | PTE_TABLE | PTE_VALID;
+// drop a reference with task_spaces_lock held. the last one unlinks the
+// space and returns 1: the caller frees it once the lock is released
+static int space_put_locked(vm_space_t* space) {
+    if (--space->refs) {
+        return 0;
+    }
+    vm_space_t** link = &task_spaces;
+    while (*link && *link != space) {
+        link = &(*link)->next;
     }
-    // use the existing l2 table for framebuffer mapping
-    uint64_t* fb_l2_table = (uint64_t*)(kernel_l1_page_table[l1_idx] & ~0xFFFULL);
-    uint64_t fb_attributes = PTE_VALID | PTE_BLOCK | PTE_AF | PTE_SH_INNER_SHAREABLE | PTE_AP_RW_EL1 | PTE_PXN | PTE_UXN;
-    fb_attributes |= (MT_DEVICE_NGNRNE << 2);
-    // map framebuffer over the required 2mb blocks
-    for (uint64_t current_pa = fb_base_pa; current_pa < fb_base_pa + fb_size; current_pa += BLOCK_SIZE) {
-        uint64_t l2_idx = (current_pa >> 21) & 0x1FF;
-        fb_l2_table[l2_idx] = current_pa | fb_attributes;
+    if (*link) {
+        *link = space->next;
     }
+    return 1;
+}
 
+static void space_free(vm_space_t* space) {
+    vm_space_clear(space);
+    pgtable_free_root(space->root_pa);
+    kfree(space);
+}
+
+// unmap everything in a task address space and free it with its tables. a
+// space the promotion pass has pinned is freed by the pass when it lets go
+void vm_space_destroy(vm_space_t* space) {
+    if (!space || space == &kernel_space) {
+        return;
+    }
+    uint64_t flags = spinlock_acquire_irqsave(&task_spaces_lock);
+    space->dead = 1;
+    int last = space_put_locked(space);
+    spinlock_release_irqrestore(&task_spaces_lock, flags);
+    if (last) {
+        space_free(space);
+    }
+}
+
+// fold fragmented fixed mappings of a space back into contiguous runs and
+// blocks. lazily backed regions stay at page granularity, since their frames
+// are faulted in, shared and copied one page at a time. in the kernel space
+// only the vm_map_allocate window is rebuilt: the linear map holds the code
+// and stacks this pass runs on. returns how many tables were replaced.
+// the space lock is held one region at a time; faults in a range being
+// replaced wait on it and then find the block in place. the caller keeps
+// the space alive
+int vm_space_promote(vm_space_t* space) {
+    int promoted = 0;
+    uint64_t low = (space == &kernel_space) ? VM_ALLOC_BASE : 0;
+    uint64_t high = (space == &kernel_space) ? VM_ALLOC_END : USER_VA_END;
+    uint64_t cursor = low;
+    // cleared under the lock before the scan starts, so a change that lands
+    // behind the cursor sets it again for the next pass
+    uint64_t flags = spinlock_acquire_irqsave(&space->lock);
+    space->promote_pending = 0;
+    spinlock_release_irqrestore(&space->lock, flags);
+    while (1) {
+        flags = spinlock_acquire_irqsave(&space->lock);
+        vm_region_t* region = vm_region_first_ending_after(space->regions, cursor);
+        if (!region || region->start >= high) {
+            spinlock_release_irqrestore(&space->lock, flags);
+            break;
+        }
+        cursor = region->end;
+        if (region->backing == VM_BACKING_FIXED && region->end - region->start >= PAGE_SIZE * PGTABLE_CONT_ENTRIES) {
+            int ret = pgtable_promote(space->root_pa, region->start, region->end - region->start, space_flush, space);
+            if (ret > 0) {
+                promoted += ret;
+            }
+        }
+        spinlock_release_irqrestore(&space->lock, flags);
+    }
+    tlb_publish();
+    return promoted;
+}
+
+// background pass over every space whose mappings changed since it last ran.
+// each space is pinned for its whole walk, which runs without the list lock;
+// a pinned space stays linked, so its next pointer is still good afterwards.
+// spaces destroyed meanwhile are freed once the list lock is dropped
+void vm_promote_pass() {
+    if (kernel_space.promote_pending) {
+        vm_space_promote(&kernel_space);
+    }
+    vm_space_t* released = 0;
+    uint64_t flags = spinlock_acquire_irqsave(&task_spaces_lock);
+    vm_space_t* space = task_spaces;
+    while (space) {
+        vm_space_t* next = space->next;
+        if (!space->dead && space->promote_pending) {
+            space->refs++;
+            spinlock_release_irqrestore(&task_spaces_lock, flags);
+            vm_space_promote(space);
+            flags = spinlock_acquire_irqsave(&task_spaces_lock);
+            next = space->next;
+            if (space_put_locked(space)) {
+                space->next = released;
+                released = space;
+            }
+        }
+        space = next;
+    }
+    spinlock_release_irqrestore(&task_spaces_lock, flags);
+    while (released) {
+        space = released;
+        released = space->next;
+        space_free(space);
+    }
+}
+
+// build the kernel translation tables that replace the boot mapping
+void vm_init() {
+    asid_init();
+    spinlock_init(&task_spaces_lock);
+    vm_space_init(&kernel_space, pgtable_alloc_root());
+    if (!kernel_space.root_pa) {
+        kprintf("vm_init: failed to allocate kernel root table\n");
+        return;
+    }
+    empty_user_root_pa = pgtable_alloc_root();
+    // add kernel mapping: linear map of the first 1gb of physical address space with full permissions
+    vm_map((uint64_t)PHYS_TO_VIRT(0), 0x0, VM_KERNEL_LOW_MAP_END, VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXEC | VM_PROT_KERNEL);
+}
+
+int vm_map(uint64_t virtual_address, uint64_t physical_address, uint64_t size, uint32_t protection_flags) {
+    return vm_space_map(&kernel_space, virtual_address, physical_address, size, protection_flags);
+}
+
+int vm_unmap(uint64_t virtual_address, uint64_t size) {
+    return vm_space_unmap(&kernel_space, virtual_address, size);
+}
+
+int vm_protect(uint64_t virtual_address, uint64_t size, uint32_t new_protection_flags) {
+    return vm_space_protect(&kernel_space, virtual_address, size, new_protection_flags);
+}
+
+// allocate a new vm mapping in the first free gap of the allocation window,
+// backed by physically contiguous frames from the buddy allocator
+uint64_t vm_map_allocate(uint64_t size, uint32_t protection_flags) {
+    if (size == 0 || size > (PMM_PAGE_SIZE << PMM_MAX_ORDER)) {
+        kprintf("vm_map_allocate: unsupported size 0x%llx\n", size);
+        return 0;
+    }
+    size = ALIGN_UP(size, PAGE_SIZE);
+    uint64_t align = (size >= BLOCK_SIZE) ? BLOCK_SIZE : PAGE_SIZE;
+    uint64_t allocated_pa = pmm_alloc_pages(pmm_order_for_size(size));
+    if (!allocated_pa) {
+        return 0;
+    }
+    // the gap stays free only while the lock is held
+    uint64_t flags = spinlock_acquire_irqsave(&kernel_space.lock);
+    uint64_t allocated_va = find_gap_locked(&kernel_space, VM_ALLOC_BASE, VM_ALLOC_END, size, align);
+    if (!allocated_va) {
+        kprintf("vm_map_allocate: no free virtual range for 0x%llx bytes\n", size);
+    } else if (map_locked(&kernel_space, allocated_va, allocated_pa, size, protection_flags) != 0) {
+        allocated_va = 0;
+    }
+    spinlock_release_irqrestore(&kernel_space.lock, flags);
+    if (!allocated_va) {
+        pmm_free_pages(allocated_pa, pmm_order_for_size(size));
+    }
+    return allocated_va;
+}
+
+// deallocate vm mapping by unmapping at the given virtual address and returning its frames
+int vm_map_deallocate(uint64_t virtual_address) {
+    uint64_t flags = spinlock_acquire_irqsave(&kernel_space.lock);
+    vm_region_t* region = vm_region_find(kernel_space.regions, virtual_address);
+    if (!region || region->start != virtual_address) {
+        spinlock_release_irqrestore(&kernel_space.lock, flags);
+        return -1;
+    }
+    uint64_t pa = region->physical_address;
+    uint32_t order = pmm_order_for_size(region->end - region->start);
+    int ret = unmap_locked(&kernel_space, virtual_address, 0);
+    spinlock_release_irqrestore(&kernel_space.lock, flags);
+    // the frames go back only once no translation can reach them
+    if (ret != 0) {
+        return -1;
+    }
+    pmm_free_pages(pa, order);
+    return 0;
+}
+
+// move from the boot mapping onto the tables built by vm_init and later vm_map
+// calls: the kernel space goes into ttbr1 and ttbr0 is left without mappings
+// until a task's space is switched in
+void cpu_enable_mmu() {
+    uint64_t tcr = TCR_VALUE;
+    if (asid_bits() == 16) {
+        tcr |= TCR_AS_16BIT;
+    }
     // set mmu attributes and translation control registers
-    asm volatile("msr mair_el1, %0" : : "r"(MAIR_VALUE));
-    asm volatile("msr tcr_el1, %0" : : "r"(TCR_VALUE));
-    asm volatile("msr ttbr0_el1, %0" : : "r"((uint64_t)kernel_l1_page_table));
+    asm volatile("msr mair_el1, %0" : : "r"((uint64_t)MAIR_VALUE));
+    asm volatile("msr tcr_el1, %0" : : "r"(tcr));
+    asm volatile("msr ttbr1_el1, %0" : : "r"(kernel_space.root_pa));
+    asm volatile("msr ttbr0_el1, %0" : : "r"(empty_user_root_pa));
+    asm volatile("isb sy");
 
     // invalidate tlb and perform barrier operations
-    tlb_invalidate();
+    asm volatile("tlbi vmalle1is");
+    asm volatile("dsb sy");
+    asm volatile("isb sy");
 
     uint64_t sctlr;
     asm volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
     sctlr |= (1 << 0);
     asm volatile("msr sctlr_el1, %0" : : "r"(sctlr));
     asm volatile("isb sy");
+
+    cache_init();
+    cache_enable();
+}
+
+// point ttbr0 at the empty root when the core runs no task address space, so
+// a space can be freed while the core is idle
+void vm_space_deactivate() {
+    asm volatile("msr ttbr0_el1, %0" : : "r"(empty_user_root_pa));
+    asm volatile("isb");
 }
 
-// create a new task-specific pagetable by copying kernel mappings
-uint64_t vm_create_task_pagetable() {
-    uint64_t* task_l1_table = (uint64_t*)kmalloc(PAGE_SIZE);
-    if (!task_l1_table) {
-        kprintf("vm_create_task_pagetable: failed to allocate task l1 table\n");
+// map a device's registers into the kernel linear map (once) and return their va.
+// registers that fall inside a normal memory mapping, like the low linear map,
+// are turned into device memory there, since cached accesses would never
+// reach the device
+void* vm_map_device(uint64_t physical_address, uint64_t size) {
+    uint64_t base = physical_address & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = ALIGN_UP(physical_address + size, PAGE_SIZE);
+    uint64_t va = (uint64_t)PHYS_TO_VIRT(base);
+    uint32_t prot = VM_PROT_READ | VM_PROT_WRITE | VM_PROT_KERNEL | VM_PROT_DEVICE;
+    uint64_t flags = spinlock_acquire_irqsave(&kernel_space.lock);
+    int ret = 0;
+    vm_region_t* region = vm_region_find(kernel_space.regions, va);
+    if (!region || region->end < va + (end - base)) {
+        ret = map_locked(&kernel_space, va, base, end - base, prot);
+    } else if (region->protection_flags != prot) {
+        ret = protect_locked(&kernel_space, va, end - base, prot);
+    }
+    spinlock_release_irqrestore(&kernel_space.lock, flags);
+    if (ret != 0) {
+        return 0;
+    }
+    return PHYS_TO_VIRT(physical_address);
+}
+
+// create an empty task address space for ttbr0; kernel mappings come from
+// ttbr1, so nothing is copied. it gets an asid the first time it is switched to
+vm_space_t* vm_space_create() {
+    vm_space_t* space = (vm_space_t*)kmalloc(sizeof(vm_space_t));
+    if (!space) {
         return 0;
     }
-    memset(task_l1_table, 0, PAGE_SIZE);
-    // copy kernel mappings into task's level 1 table
-    for (int i = 0; i < 512; i++) {
-        task_l1_table[i] = kernel_l1_page_table[i];
+    uint64_t task_root_pa = pgtable_alloc_root();
+    if (!task_root_pa) {
+        kprintf("vm_space_create: failed to allocate task root table\n");
+        kfree(space);
+        return 0;
     }
-    return (uint64_t)task_l1_table;
+    vm_space_init(space, task_root_pa);
+    uint64_t flags = spinlock_acquire_irqsave(&task_spaces_lock);
+    space->next = task_spaces;
+    task_spaces = space;
+    spinlock_release_irqrestore(&task_spaces_lock, flags);
+    return space;
 }
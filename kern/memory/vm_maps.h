@@ -5,19 +5,36 @@ typedef unsigned long long uint64_t;
 typedef unsigned int uint32_t;
 typedef unsigned char uint8_t;
 
+#include "vm_region.h"
+#include "spinlock.h"
+
 #define VM_PROT_NONE  0x00
 #define VM_PROT_READ  0x01
 #define VM_PROT_WRITE 0x02
 #define VM_PROT_EXEC  0x04
 #define VM_PROT_KERNEL 0x08
 #define VM_PROT_FREE   0x10
+#define VM_PROT_DEVICE 0x20 // device-ngnrne memory, never executable
+
+// vm_init linear maps the low 1gb; physical memory above it is mapped explicitly
+#define VM_KERNEL_LOW_MAP_END 0x40000000
+// kernel addresses below this are the linear map, pa = va - KERNEL_VIRT_BASE,
+// so a buffer there is physically contiguous and can be handed to dma as is
+#define VM_LINEAR_MAP_END 0xFFFF800000000000ULL
 
-typedef struct {
-    uint64_t virtual_address;
-    uint64_t physical_address;
-    uint64_t size;
-    uint32_t protection_flags;
-} vm_map_entry_t;
+// one address space: its translation tables and the regions mapped in them.
+// lock guards the region tree, the tables and promote_pending
+typedef struct vm_space {
+    spinlock_t lock;
+    uint64_t root_pa;
+    uint64_t context_id; // asid generation | asid, 0 until first switched to
+    vm_region_t* regions;
+    uint64_t region_count;
+    uint32_t promote_pending; // mappings changed since the last promotion pass
+    uint32_t refs;            // the owner plus promotion pass pins, under the task space list lock
+    uint32_t dead;            // destroyed by its owner, freed with the last pin
+    struct vm_space* next;    // every live space, for the promotion pass
+} vm_space_t;
 
 void vm_init();
 int vm_map(uint64_t virtual_address, uint64_t physical_address, uint64_t size, uint32_t protection_flags);
@@ -25,9 +42,27 @@ int vm_unmap(uint64_t virtual_address, uint64_t size);
 int vm_protect(uint64_t virtual_address, uint64_t size, uint32_t new_protection_flags);
 uint64_t vm_map_allocate(uint64_t size, uint32_t protection_flags);
 int vm_map_deallocate(uint64_t virtual_address);
-void vm_map_add_entry(uint64_t virtual_address, uint64_t physical_address, uint64_t size, uint32_t protection_flags);
+void* vm_map_device(uint64_t physical_address, uint64_t size);
+void vm_space_init(vm_space_t* space, uint64_t root_pa);
+vm_space_t* vm_kernel_space();
+vm_region_t* vm_space_find(vm_space_t* space, uint64_t va);
+uint64_t vm_space_find_gap(vm_space_t* space, uint64_t low, uint64_t high, uint64_t size, uint64_t align);
+int vm_space_map(vm_space_t* space, uint64_t virtual_address, uint64_t physical_address, uint64_t size, uint32_t protection_flags);
+int vm_space_unmap(vm_space_t* space, uint64_t virtual_address, uint64_t size);
+int vm_space_protect(vm_space_t* space, uint64_t virtual_address, uint64_t size, uint32_t new_protection_flags);
+int vm_space_map_anon(vm_space_t* space, uint64_t virtual_address, uint64_t size, uint32_t protection_flags);
+int vm_space_map_file(vm_space_t* space, uint64_t virtual_address, uint64_t size, uint32_t protection_flags,
+                      uint32_t inode_id, uint64_t file_offset, uint64_t file_size);
+int vm_handle_fault(uint64_t esr, uint64_t far);
 void cpu_enable_mmu();
-uint64_t vm_create_task_pagetable();
+vm_space_t* vm_space_create();
+void vm_space_destroy(vm_space_t* space);
+void vm_space_clear(vm_space_t* space);
+void vm_space_deactivate();
+int vm_space_clone_into(vm_space_t* parent, vm_space_t* child);
+vm_space_t* vm_clone_address_space(vm_space_t* parent);
+int vm_space_promote(vm_space_t* space);
+void vm_promote_pass();
 
 #endif
 
@@ -0,0 +1,184 @@
+#include "vm_region.h"
+#include "lib.h"
+
+static inline int32_t region_height(vm_region_t* region) {
+    return region ? region->height : 0;
+}
+
+static inline uint64_t max_u64(uint64_t a, uint64_t b) {
+    return a > b ? a : b;
+}
+
+// recompute the cached height, span and largest inner gap from the children
+static void region_update(vm_region_t* region) {
+    int32_t left_height = region_height(region->left);
+    int32_t right_height = region_height(region->right);
+    region->height = 1 + (left_height > right_height ? left_height : right_height);
+
+    uint64_t gap = 0;
+    region->subtree_start = region->start;
+    region->subtree_end = region->end;
+    if (region->left) {
+        region->subtree_start = region->left->subtree_start;
+        gap = max_u64(region->left->subtree_max_gap, region->start - region->left->subtree_end);
+    }
+    if (region->right) {
+        region->subtree_end = region->right->subtree_end;
+        gap = max_u64(gap, region->right->subtree_max_gap);
+        gap = max_u64(gap, region->right->subtree_start - region->end);
+    }
+    region->subtree_max_gap = gap;
+}
+
+static vm_region_t* rotate_right(vm_region_t* region) {
+    vm_region_t* pivot = region->left;
+    region->left = pivot->right;
+    pivot->right = region;
+    region_update(region);
+    region_update(pivot);
+    return pivot;
+}
+
+static vm_region_t* rotate_left(vm_region_t* region) {
+    vm_region_t* pivot = region->right;
+    region->right = pivot->left;
+    pivot->left = region;
+    region_update(region);
+    region_update(pivot);
+    return pivot;
+}
+
+static vm_region_t* rebalance(vm_region_t* region) {
+    region_update(region);
+    int32_t balance = region_height(region->left) - region_height(region->right);
+    if (balance > 1) {
+        if (region_height(region->left->left) < region_height(region->left->right)) {
+            region->left = rotate_left(region->left);
+        }
+        return rotate_right(region);
+    }
+    if (balance < -1) {
+        if (region_height(region->right->right) < region_height(region->right->left)) {
+            region->right = rotate_right(region->right);
+        }
+        return rotate_left(region);
+    }
+    return region;
+}
+
+static vm_region_t* insert_node(vm_region_t* node, vm_region_t* region) {
+    if (!node) return region;
+    if (region->start < node->start) {
+        node->left = insert_node(node->left, region);
+    } else {
+        node->right = insert_node(node->right, region);
+    }
+    return rebalance(node);
+}
+
+// detach the leftmost node of a subtree, handing it back through min
+static vm_region_t* remove_min(vm_region_t* node, vm_region_t** min) {
+    if (!node->left) {
+        *min = node;
+        return node->right;
+    }
+    node->left = remove_min(node->left, min);
+    return rebalance(node);
+}
+
+static vm_region_t* remove_node(vm_region_t* node, vm_region_t* region) {
+    if (!node) return 0;
+    if (region->start < node->start) {
+        node->left = remove_node(node->left, region);
+    } else if (region->start > node->start) {
+        node->right = remove_node(node->right, region);
+    } else {
+        vm_region_t* left = node->left;
+        vm_region_t* right = node->right;
+        if (!right) return left;
+        vm_region_t* successor;
+        right = remove_min(right, &successor);
+        successor->left = left;
+        successor->right = right;
+        return rebalance(successor);
+    }
+    return rebalance(node);
+}
+
+void vm_region_insert(vm_region_t** root, vm_region_t* region) {
+    region->left = 0;
+    region->right = 0;
+    region_update(region);
+    *root = insert_node(*root, region);
+}
+
+void vm_region_remove(vm_region_t** root, vm_region_t* region) {
+    *root = remove_node(*root, region);
+    region->left = 0;
+    region->right = 0;
+}
+
+// the region containing va, if any
+vm_region_t* vm_region_find(vm_region_t* root, uint64_t va) {
+    vm_region_t* region = vm_region_first_ending_after(root, va);
+    return (region && region->start <= va) ? region : 0;
+}
+
+// the lowest region whose end lies above va. regions are disjoint, so ends
+// are ordered like starts and a single descent finds it
+vm_region_t* vm_region_first_ending_after(vm_region_t* root, uint64_t va) {
+    vm_region_t* best = 0;
+    while (root) {
+        if (root->end > va) {
+            best = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+    return best;
+}
+
+int vm_region_overlaps(vm_region_t* root, uint64_t start, uint64_t end) {
+    vm_region_t* region = vm_region_first_ending_after(root, start);
+    return region && region->start < end;
+}
+
+// in-order walk that skips every subtree whose holes are all too small.
+// cursor is the lowest address still free after the regions visited so far
+static int gap_search(vm_region_t* node, uint64_t* cursor, uint64_t size, uint64_t align) {
+    if (!node) return 0;
+
+    uint64_t candidate = ALIGN_UP(*cursor, align);
+    if (node->subtree_start >= candidate && node->subtree_start - candidate >= size) {
+        *cursor = candidate;
+        return 1;
+    }
+    if (node->subtree_max_gap < size) {
+        *cursor = max_u64(*cursor, node->subtree_end);
+        return 0;
+    }
+
+    if (gap_search(node->left, cursor, size, align)) return 1;
+    candidate = ALIGN_UP(*cursor, align);
+    if (node->start >= candidate && node->start - candidate >= size) {
+        *cursor = candidate;
+        return 1;
+    }
+    *cursor = max_u64(*cursor, node->end);
+    return gap_search(node->right, cursor, size, align);
+}
+
+// lowest align-aligned address in [low, high) with size free bytes after it;
+// align must be a power of two
+int vm_region_find_gap(vm_region_t* root, uint64_t low, uint64_t high, uint64_t size, uint64_t align, uint64_t* out) {
+    uint64_t cursor = low;
+    if (!gap_search(root, &cursor, size, align)) {
+        cursor = ALIGN_UP(cursor, align);
+    }
+    if (cursor < low || cursor > high || high - cursor < size) {
+        return -1;
+    }
+    *out = cursor;
+    return 0;
+}
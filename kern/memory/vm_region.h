@@ -0,0 +1,43 @@
+#ifndef VM_REGION_H
+#define VM_REGION_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+typedef int int32_t;
+
+// where the pages of a region come from. fixed regions are mapped eagerly onto
+// caller-owned frames; anon and file regions are populated by the fault handler
+// and own the frames it allocates
+#define VM_BACKING_FIXED 0
+#define VM_BACKING_ANON  1 // zero filled on first touch
+#define VM_BACKING_FILE  2 // read from an fs inode on first touch
+
+// a mapped range [start, end). regions of one address space never overlap, so
+// they are kept in an avl tree keyed by start. every node also caches the span
+// of its subtree and the largest hole between regions inside it, which makes
+// overlap checks and gap searches o(log n)
+typedef struct vm_region {
+    uint64_t start;
+    uint64_t end;
+    uint64_t physical_address;
+    uint32_t protection_flags;
+    uint32_t backing;
+    uint32_t file_inode;
+    uint64_t file_offset; // file offset that start maps
+    uint64_t file_size;   // bytes of file data from start, the rest reads as zeros
+    int32_t height;
+    uint64_t subtree_start;
+    uint64_t subtree_end;
+    uint64_t subtree_max_gap;
+    struct vm_region* left;
+    struct vm_region* right;
+} vm_region_t;
+
+void vm_region_insert(vm_region_t** root, vm_region_t* region);
+void vm_region_remove(vm_region_t** root, vm_region_t* region);
+vm_region_t* vm_region_find(vm_region_t* root, uint64_t va);
+vm_region_t* vm_region_first_ending_after(vm_region_t* root, uint64_t va);
+int vm_region_overlaps(vm_region_t* root, uint64_t start, uint64_t end);
+int vm_region_find_gap(vm_region_t* root, uint64_t low, uint64_t high, uint64_t size, uint64_t align, uint64_t* out);
+
+#endif // VM_REGION_H
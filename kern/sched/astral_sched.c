@@ -4,125 +4,939 @@
 #include "lib.h"
 #include "../memory/kmalloc.h"
 #include "../memory/vm_maps.h"
+#include "../memory/pmm.h"
+#include "../memory/asid.h"
+#include "gic.h"
+#include "timer.h"
+#include "hrtimer.h"
+#include "fpsimd.h"
+#include "softirq.h"
 
-static tcb_t* current_task = 0;
-static tcb_t* task_list[MAX_TASKS];
-static int num_tasks = 0;
-static int current_task_index = -1;
-static spinlock_t sched_lock;
+// run queues and idle contexts, indexed by core id
+static run_queue_t run_queues[MAX_CORES];
+static tcb_t idle_tasks[MAX_CORES];
+static volatile uint32_t num_tasks = 0;
+static volatile uint32_t sched_started = 0;
 
-extern void context_switch(cpu_context_t* old_context, cpu_context_t* new_context);
+// every live task has a slot in the task table and its id is the slot index.
+// the table doubles when it fills up and the ids of exited tasks are reused
+#define TASK_TABLE_INITIAL 64
+
+static spinlock_t task_table_lock;
+static tcb_t** task_table = 0;
+static uint32_t* free_ids = 0;  // released slots, used before new ones
+static uint32_t free_id_count = 0;
+static uint32_t task_table_size = 0;
+static uint32_t next_unused_id = 0;
+
+// an exited task leaves its tcb, stack, scratch arena and emptied address
+// space behind as one bundle, kept in a pool per core and stack order, so the
+// next spawn skips kmalloc, the buddy allocator and a fresh root table.
+// larger stacks and bundles past the pool depth are freed
+#define TASK_POOL_MAX_ORDER 2 // stacks up to 16kb
+#define TASK_POOL_DEPTH     128
+
+typedef struct {
+    spinlock_t lock;
+    tcb_t* head;  // linked through next
+    uint32_t count;
+} task_pool_t;
+
+static task_pool_t task_pools[MAX_CORES][TASK_POOL_MAX_ORDER + 1];
+
+// how often a core compares its queue with the busiest one, in microseconds
+#define SCHED_BALANCE_INTERVAL_US 10000
+
+// multilevel feedback: a task that uses up its slice drops a level, up to
+// SCHED_FEEDBACK_LEVELS below its base priority, and gets a longer slice
+// there; a task that blocks climbs back SCHED_WAKE_BOOST levels when woken.
+// every SCHED_BOOST_INTERVAL_US all queued tasks return to their base, so
+// demoted work cannot starve
+#define SCHED_SLICE_US          2000
+#define SCHED_FEEDBACK_LEVELS   8
+#define SCHED_WAKE_BOOST        2
+#define SCHED_BOOST_INTERVAL_US 1000000
+// there is no periodic tick. a core arms a timer for the end of the running
+// task's slice only while another task waits in its queue, and idle cores
+// sleep in wfi with no timer at all. cores queueing work on another core
+// wake it with this sgi, and wake an idle core to steal when the target is busy
+#define SCHED_KICK_SGI 0
 
 void spinlock_init(spinlock_t* lock) {
     lock->lock = 0;
 }
 
+// take a ticket with one exclusive add to the high half, then wait for the
+// low half to reach it. waiters sleep in wfe with the owner half loaded
+// exclusively, so only the releasing store wakes them, and they get the lock
+// in the order they arrived. sevl makes the first wfe fall through, in case
+// the release came before the exclusive load
 void spinlock_acquire(spinlock_t* lock) {
-    uint32_t temp;
+    uint32_t ticket, temp, status;
     asm volatile(
-        "1: ldaxr %w0, [%1]\n"
-        "   cbnz %w0, 1b\n"
-        "   stxr %w0, %w2, [%1]\n"
-        "   cbnz %w0, 1b\n"
-        : "=&r"(temp)
-        : "r"(&lock->lock), "r"(1)
+        "   prfm pstl1strm, [%3]\n"
+        "1: ldaxr %w0, [%3]\n"
+        "   add %w1, %w0, %w4\n"
+        "   stxr %w2, %w1, [%3]\n"
+        "   cbnz %w2, 1b\n"
+        "   eor %w1, %w0, %w0, ror #16\n"
+        "   cbz %w1, 3f\n"
+        "   sevl\n"
+        "2: wfe\n"
+        "   ldaxrh %w2, [%3]\n"
+        "   eor %w1, %w2, %w0, lsr #16\n"
+        "   cbnz %w1, 2b\n"
+        "3:\n"
+        : "=&r"(ticket), "=&r"(temp), "=&r"(status)
+        : "r"(&lock->lock), "r"(1 << 16)
         : "memory"
     );
 }
 
+// only the holder writes the owner half, so a plain load and a release store
+// are enough; the store clears the waiters' exclusive monitors and wakes them
 void spinlock_release(spinlock_t* lock) {
+    uint32_t owner;
     asm volatile(
-        "stlr %w1, [%0]\n"
-        : : "r"(&lock->lock), "r"(0)
+        "ldrh %w0, [%1]\n"
+        "add %w0, %w0, #1\n"
+        "stlrh %w0, [%1]\n"
+        : "=&r"(owner)
+        : "r"(&lock->lock)
         : "memory"
     );
 }
 
+// for locks also taken from interrupt handlers: mask irqs first, so the
+// holder cannot be interrupted by a handler spinning on the same lock
+uint64_t spinlock_acquire_irqsave(spinlock_t* lock) {
+    uint64_t flags = cpu_irq_save();
+    spinlock_acquire(lock);
+    return flags;
+}
+
+void spinlock_release_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spinlock_release(lock);
+    cpu_irq_restore(flags);
+}
+
+static void sched_kick_irq(uint32_t irq) {
+    (void)irq;
+    sched_tick();
+}
+
+static void reap_dead(void* ctx);
+
 void sched_init() {
-    memset(task_list, 0, sizeof(task_list));
+    memset(run_queues, 0, sizeof(run_queues));
+    memset(idle_tasks, 0, sizeof(idle_tasks));
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        spinlock_init(&run_queues[core].lock);
+        run_queues[core].idle = &idle_tasks[core];
+        idle_tasks[core].id = (uint32_t)-1;
+        idle_tasks[core].state = TASK_RUNNING;
+        idle_tasks[core].cpu = core;
+        idle_tasks[core].base_priority = SCHED_PRIO_LEVELS - 1;
+        idle_tasks[core].priority = SCHED_PRIO_LEVELS - 1;
+        idle_tasks[core].fpsimd_cpu = FPSIMD_CPU_NONE;
+        work_init(&run_queues[core].reap_work, reap_dead, &run_queues[core]);
+    }
+    gic_register(SCHED_KICK_SGI, sched_kick_irq);
+    memset(task_pools, 0, sizeof(task_pools));
     num_tasks = 0;
-    current_task_index = -1;
-    spinlock_init(&sched_lock);
+    spinlock_init(&task_table_lock);
+    task_table = 0;
+    free_ids = 0;
+    free_id_count = 0;
+    task_table_size = 0;
+    next_unused_id = 0;
 }
 
-void sched_add_task(tcb_t* task) {
-    spinlock_acquire(&sched_lock);
-    if (num_tasks >= MAX_TASKS) {
-        spinlock_release(&sched_lock);
+// callers keep irqs masked, so the core cannot change under them
+static inline run_queue_t* this_rq() {
+    return &run_queues[cpu_get_core_id()];
+}
+
+static inline uint64_t us_to_ticks(uint64_t us) {
+    return cpu_get_system_timer_frequency() / 1000000 * us;
+}
+
+static inline uint64_t level_bit(uint32_t level) {
+    return 1ULL << (SCHED_PRIO_LEVELS - 1 - level);
+}
+
+static void enqueue_locked(run_queue_t* rq, tcb_t* task) {
+    task_list_t* list = &rq->levels[task->priority];
+    task->next = 0;
+    task->prev = list->tail;
+    if (list->tail) {
+        list->tail->next = task;
+    } else {
+        list->head = task;
+    }
+    list->tail = task;
+    rq->ready_bitmap |= level_bit(task->priority);
+    task->cpu = (uint32_t)(rq - run_queues);
+    task->queued = 1;
+    rq->nr_ready++;
+}
+
+static void dequeue_locked(run_queue_t* rq, tcb_t* task) {
+    task_list_t* list = &rq->levels[task->priority];
+    if (task->prev) {
+        task->prev->next = task->next;
+    } else {
+        list->head = task->next;
+    }
+    if (task->next) {
+        task->next->prev = task->prev;
+    } else {
+        list->tail = task->prev;
+    }
+    if (!list->head) {
+        rq->ready_bitmap &= ~level_bit(task->priority);
+    }
+    task->next = 0;
+    task->prev = 0;
+    task->queued = 0;
+    rq->nr_ready--;
+}
+
+// the first task of the most urgent non-empty level, found in one clz
+static tcb_t* pick_next_locked(run_queue_t* rq) {
+    if (!rq->ready_bitmap) {
+        return 0;
+    }
+    tcb_t* task = rq->levels[__builtin_clzll(rq->ready_bitmap)].head;
+    dequeue_locked(rq, task);
+    return task;
+}
+
+// take up to count tasks off the tails of another core's least urgent levels
+// and queue them locally. a task still being switched out elsewhere, or whose
+// fp/simd state is still in that core's registers, is left alone. only one queue lock is ever held at a time, so stealing cores cannot deadlock
+static uint32_t pull_tasks(run_queue_t* rq, run_queue_t* victim, uint32_t count) {
+    tcb_t* pulled = 0;
+    uint32_t moved = 0;
+    spinlock_acquire(&victim->lock);
+    uint64_t levels = victim->ready_bitmap;
+    while (levels && moved < count) {
+        // lowest set bit: the least urgent level left
+        uint32_t level = SCHED_PRIO_LEVELS - 1 - __builtin_ctzll(levels);
+        levels &= levels - 1;
+        tcb_t* task = victim->levels[level].tail;
+        while (task && moved < count) {
+            tcb_t* prev = task->prev;
+            if (!task->on_cpu && fpsimd_can_migrate(task, (uint32_t)(rq - run_queues))) {
+                dequeue_locked(victim, task);
+                // anyone locking the task's queue from here on waits for the new one
+                task->cpu = (uint32_t)(rq - run_queues);
+                task->next = pulled;
+                pulled = task;
+                moved++;
+            }
+            task = prev;
+        }
+    }
+    spinlock_release(&victim->lock);
+
+    if (moved) {
+        spinlock_acquire(&rq->lock);
+        while (pulled) {
+            tcb_t* next = pulled->next;
+            enqueue_locked(rq, pulled);
+            pulled = next;
+        }
+        spinlock_release(&rq->lock);
+    }
+    return moved;
+}
+
+// nr_ready is read unlocked and may change between reads, so each queue's
+// count is loaded once and the winner's is handed back in busiest_ready
+static run_queue_t* busiest_queue(run_queue_t* rq, uint32_t* busiest_ready) {
+    run_queue_t* busiest = 0;
+    uint32_t most = 0;
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        run_queue_t* other = &run_queues[core];
+        uint32_t ready = other->nr_ready;
+        if (other != rq && ready > most) {
+            busiest = other;
+            most = ready;
+        }
+    }
+    *busiest_ready = most;
+    return busiest;
+}
+
+// an empty queue takes one task from the busiest core
+static int steal_task(run_queue_t* rq) {
+    uint32_t ready;
+    run_queue_t* victim = busiest_queue(rq, &ready);
+    return victim ? pull_tasks(rq, victim, 1) != 0 : 0;
+}
+
+// drop the feedback penalty of every queued task
+static void boost_queued(run_queue_t* rq) {
+    spinlock_acquire(&rq->lock);
+    uint64_t levels = rq->ready_bitmap;
+    while (levels) {
+        uint32_t level = __builtin_clzll(levels);
+        levels &= ~level_bit(level);
+        tcb_t* task = rq->levels[level].head;
+        while (task) {
+            tcb_t* next = task->next;
+            if (task->priority != task->base_priority) {
+                dequeue_locked(rq, task);
+                task->priority = task->base_priority;
+                enqueue_locked(rq, task);
+            }
+            task = next;
+        }
+    }
+    spinlock_release(&rq->lock);
+}
+
+// periodically even out against the busiest core by pulling half the
+// difference, so long-running tasks spread even when no core goes idle
+static void balance(run_queue_t* rq) {
+    uint64_t now = cpu_get_system_timer_count();
+    if (now >= rq->next_boost) {
+        rq->next_boost = now + us_to_ticks(SCHED_BOOST_INTERVAL_US);
+        boost_queued(rq);
+    }
+    if (now < rq->next_balance) {
         return;
     }
-    task_list[num_tasks] = task;
-    num_tasks++;
-    spinlock_release(&sched_lock);
+    rq->next_balance = now + us_to_ticks(SCHED_BALANCE_INTERVAL_US);
+    uint32_t busiest_ready;
+    run_queue_t* busiest = busiest_queue(rq, &busiest_ready);
+    uint32_t local_ready = rq->nr_ready;
+    if (busiest && busiest_ready > local_ready + 1) {
+        pull_tasks(rq, busiest, (busiest_ready - local_ready) / 2);
+    }
 }
 
-void sched_schedule() {
-    spinlock_acquire(&sched_lock);
-    if (num_tasks == 0) {
-        spinlock_release(&sched_lock);
-        cpu_set_state(CPU_STATE_HALTED);
+// the queue a new or woken task goes to: the online core with the fewest waiting
+static run_queue_t* least_loaded_queue() {
+    run_queue_t* best = this_rq();
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        run_queue_t* rq = &run_queues[core];
+        if (rq->online && rq->nr_ready < best->nr_ready) {
+            best = rq;
+        }
+    }
+    return best;
+}
+
+// slice length at a priority: demoted tasks run longer but less often
+static uint64_t slice_ticks(tcb_t* task) {
+    return us_to_ticks(SCHED_SLICE_US * (1 + task->priority - task->base_priority));
+}
+
+static int slice_expired(tcb_t* task) {
+    return cpu_get_system_timer_count() - task->slice_start >= slice_ticks(task);
+}
+
+// a task that used up its slice without blocking drops one level and starts
+// a new slice, even if nothing else was ready to take over
+static void charge_slice(tcb_t* task) {
+    if (!slice_expired(task)) {
         return;
     }
+    if (task->priority < SCHED_PRIO_LEVELS - 1 &&
+        task->priority < task->base_priority + SCHED_FEEDBACK_LEVELS) {
+        task->priority++;
+    }
+    task->slice_start = cpu_get_system_timer_count();
+}
 
-    if (current_task == 0) {
-        current_task_index = 0;
-        current_task = task_list[current_task_index];
-        asm volatile("msr ttbr0_el1, %0" : : "r"(current_task->ttbr0_el1));
-        spinlock_release(&sched_lock);
-        asm volatile(
-            "mov sp, %0\n"
-            "mov x30, %1\n"
-            "br x30"
-            : : "r"(current_task->context.sp), "r"(current_task->context.lr)
-        );
+// program this core's slice timer for the task it runs: only needed while
+// another task waits to take over
+static void arm_slice(run_queue_t* rq, tcb_t* task) {
+    if (task == rq->idle || !rq->nr_ready) {
+        timer_clear_deadline(TIMER_SOURCE_SCHED);
     } else {
-        spinlock_release(&sched_lock);
-        sched_yield();
+        timer_set_deadline(TIMER_SOURCE_SCHED, task->slice_start + slice_ticks(task));
     }
 }
 
-void sched_yield() {
-    spinlock_acquire(&sched_lock);
-    if (num_tasks <= 1) {
-        spinlock_release(&sched_lock);
+// a task was just queued on rq. its core has to notice: a remote one gets a
+// kick, this one arms its slice timer. if rq's core is busy, an idle core is
+// woken too so it can steal the task
+static void notify_queue(run_queue_t* rq) {
+    uint32_t core = (uint32_t)(rq - run_queues);
+    if (core != cpu_get_core_id()) {
+        gic_send_sgi(core, SCHED_KICK_SGI);
+    } else {
+        tcb_t* current = sched_current_task();
+        if (current == rq->idle) {
+            rq->need_resched = 1;
+        } else if (current) {
+            arm_slice(rq, current);
+        }
+    }
+    if (rq->idling) {
         return;
     }
+    for (uint32_t other = 0; other < MAX_CORES; other++) {
+        if (other != core && run_queues[other].online && run_queues[other].idling) {
+            gic_send_sgi(other, SCHED_KICK_SGI);
+            return;
+        }
+    }
+}
 
-    cpu_context_t* old_context = &current_task->context;
+void sched_add_task(tcb_t* task) {
+    uint64_t flags = cpu_irq_save();
+    run_queue_t* rq = least_loaded_queue();
+    task->state = TASK_READY;
+    task->on_cpu = 0;
+    spinlock_acquire(&rq->lock);
+    enqueue_locked(rq, task);
+    spinlock_release(&rq->lock);
+    notify_queue(rq);
+    cpu_irq_restore(flags);
+}
 
-    current_task_index = (current_task_index + 1) % num_tasks;
-    current_task = task_list[current_task_index];
+// double the task table, called with task_table_lock held
+static int task_table_grow() {
+    uint32_t size = task_table_size ? task_table_size * 2 : TASK_TABLE_INITIAL;
+    tcb_t** table = (tcb_t**)kmalloc(size * sizeof(tcb_t*));
+    uint32_t* ids = (uint32_t*)kmalloc(size * sizeof(uint32_t));
+    if (!table || !ids) {
+        kprintf("sched: cannot grow the task table to %d entries\n", (int)size);
+        kfree(table);
+        kfree(ids);
+        return -1;
+    }
+    memset(table, 0, size * sizeof(tcb_t*));
+    if (task_table) {
+        memcpy(table, task_table, task_table_size * sizeof(tcb_t*));
+        memcpy(ids, free_ids, free_id_count * sizeof(uint32_t));
+        kfree(task_table);
+        kfree(free_ids);
+    }
+    task_table = table;
+    free_ids = ids;
+    task_table_size = size;
+    return 0;
+}
 
-    cpu_context_t* new_context = &current_task->context;
-    asm volatile("msr ttbr0_el1, %0" : : "r"(current_task->ttbr0_el1));
-    spinlock_release(&sched_lock);
-    context_switch(old_context, new_context);
+// give a task an id, reusing released ones before growing the table
+static int task_table_insert(tcb_t* task) {
+    uint64_t flags = spinlock_acquire_irqsave(&task_table_lock);
+    uint32_t id;
+    if (free_id_count) {
+        id = free_ids[--free_id_count];
+    } else if (next_unused_id < task_table_size || task_table_grow() == 0) {
+        id = next_unused_id++;
+    } else {
+        spinlock_release_irqrestore(&task_table_lock, flags);
+        return -1;
+    }
+    task_table[id] = task;
+    task->id = id;
+    spinlock_release_irqrestore(&task_table_lock, flags);
+    return 0;
 }
 
-void sched_create_task(void (*func)(), uint64_t stack_size) {
-    tcb_t* new_task = (tcb_t*)kmalloc(sizeof(tcb_t));
-    if (!new_task) {
+static void task_table_remove(tcb_t* task) {
+    uint64_t flags = spinlock_acquire_irqsave(&task_table_lock);
+    task_table[task->id] = 0;
+    free_ids[free_id_count++] = task->id;
+    spinlock_release_irqrestore(&task_table_lock, flags);
+}
+
+// free a bundle for good
+static void free_bundle(tcb_t* task) {
+    if (task->stack_base) {
+        pmm_free_pages(VIRT_TO_PHYS(task->stack_base), pmm_order_for_size(task->stack_size));
+    }
+    if (task->scratch.base) {
+        pmm_free_pages(VIRT_TO_PHYS(task->scratch.base), pmm_order_for_size(task->scratch.size));
+    }
+    vm_space_destroy(task->space);
+    kfree(task->fpsimd);
+    kfree(task);
+}
+
+// a tcb with a stack of 2^order pages and an empty address space, from this
+// core's pool, another core's pool, or freshly allocated
+static tcb_t* alloc_bundle(uint32_t order) {
+    if (order <= TASK_POOL_MAX_ORDER) {
+        uint64_t flags = cpu_irq_save();
+        uint32_t self = (uint32_t)cpu_get_core_id();
+        for (uint32_t i = 0; i < MAX_CORES; i++) {
+            task_pool_t* pool = &task_pools[(self + i) % MAX_CORES][order];
+            if (!pool->count) {
+                continue;
+            }
+            spinlock_acquire(&pool->lock);
+            tcb_t* task = pool->head;
+            if (task) {
+                pool->head = task->next;
+                pool->count--;
+            }
+            spinlock_release(&pool->lock);
+            if (task) {
+                cpu_irq_restore(flags);
+                return task;
+            }
+        }
+        cpu_irq_restore(flags);
+    }
+
+    tcb_t* task = (tcb_t*)kmalloc(sizeof(tcb_t));
+    if (!task) {
+        return 0;
+    }
+    memset(task, 0, sizeof(tcb_t));
+    // stacks are whole buddy blocks so they are page aligned and never share a page
+    uint64_t stack_pa = pmm_alloc_pages(order);
+    if (stack_pa) {
+        task->stack_base = (uint64_t)PHYS_TO_VIRT(stack_pa);
+        task->stack_size = PMM_PAGE_SIZE << order;
+    }
+    task->space = vm_space_create();
+    if (!stack_pa || !task->space) {
+        free_bundle(task);
+        return 0;
+    }
+    return task;
+}
+
+// empty a bundle's address space and scratch arena and park it in this
+// core's pool, or free it when the pool is full
+static void recycle_bundle(tcb_t* task) {
+    vm_space_clear(task->space);
+    task->scratch.top = 0;
+    uint32_t order = pmm_order_for_size(task->stack_size);
+    if (order <= TASK_POOL_MAX_ORDER) {
+        uint64_t flags = cpu_irq_save();
+        task_pool_t* pool = &task_pools[cpu_get_core_id()][order];
+        spinlock_acquire(&pool->lock);
+        int pooled = pool->count < TASK_POOL_DEPTH;
+        if (pooled) {
+            task->next = pool->head;
+            pool->head = task;
+            pool->count++;
+        }
+        spinlock_release(&pool->lock);
+        cpu_irq_restore(flags);
+        if (pooled) {
+            return;
+        }
+    }
+    free_bundle(task);
+}
+
+// give the tasks that exited on one core back their ids and bundles. runs
+// on a worker, since emptying an address space takes locks and walks tables
+// that have no business inside a switch with irqs masked
+static void reap_dead(void* ctx) {
+    run_queue_t* rq = (run_queue_t*)ctx;
+    uint64_t flags = spinlock_acquire_irqsave(&rq->lock);
+    tcb_t* task = rq->dead;
+    rq->dead = 0;
+    spinlock_release_irqrestore(&rq->lock, flags);
+    while (task) {
+        tcb_t* next = task->next;
+        task_table_remove(task);
+        recycle_bundle(task);
+        __atomic_sub_fetch(&num_tasks, 1, __ATOMIC_RELAXED);
+        task = next;
+    }
+}
+
+// second half of a switch, run by whatever task the core switched to: the
+// previous task's context is saved now, so other cores may take it, and a
+// task that exited drops its registers and goes on the core's reap list
+static void finish_switch() {
+    run_queue_t* rq = this_rq();
+    tcb_t* prev = rq->prev;
+    rq->prev = 0;
+    if (!prev) {
+        return;
+    }
+    if (prev->state == TASK_DEAD) {
+        fpsimd_release(prev);
+        spinlock_acquire(&rq->lock);
+        prev->next = rq->dead;
+        rq->dead = prev;
+        spinlock_release(&rq->lock);
+        work_queue(&rq->reap_work);
         return;
     }
-    new_task->id = num_tasks;
-    new_task->stack_base = (uint64_t)kmalloc(stack_size);
-    if (!new_task->stack_base) {
-        kfree(new_task);
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+}
+
+static void switch_to(run_queue_t* rq, tcb_t* prev, tcb_t* next) {
+    next->state = TASK_RUNNING;
+    next->slice_start = cpu_get_system_timer_count();
+    next->on_cpu = 1;
+    next->cpu = (uint32_t)(rq - run_queues);
+    rq->prev = prev;
+    arm_slice(rq, next);
+    fpsimd_switch(next);
+    asm volatile("msr tpidr_el1, %0" : : "r"(next) : "memory");
+    if (next->space) {
+        next->ttbr0_el1 = asid_switch_context(next->space);
+    } else {
+        // prev's space may be freed once it has switched out
+        vm_space_deactivate();
+    }
+    context_switch(&prev->context, &next->context);
+    // back on prev, possibly on another core
+    finish_switch();
+}
+
+// pick the next task for this core: the most urgent ready task in its own
+// queue, else one stolen from the busiest core, else the idle context. a
+// running task goes back to the tail of its level first, so equal tasks
+// round-robin. a blocked task stays off the queues, and one woken before it
+// got here is already queued
+void sched_yield() {
+    uint64_t flags = cpu_irq_save();
+    run_queue_t* rq = this_rq();
+    tcb_t* prev = sched_current_task();
+    if (!prev) {
+        cpu_irq_restore(flags);
         return;
     }
+    rq->need_resched = 0;
+    balance(rq);
+
+    spinlock_acquire(&rq->lock);
+    if (prev != rq->idle && prev->state == TASK_RUNNING) {
+        charge_slice(prev);
+        prev->state = TASK_READY;
+        enqueue_locked(rq, prev);
+    }
+    tcb_t* next = pick_next_locked(rq);
+    spinlock_release(&rq->lock);
+
+    if (!next && steal_task(rq)) {
+        spinlock_acquire(&rq->lock);
+        next = pick_next_locked(rq);
+        spinlock_release(&rq->lock);
+    }
+    if (!next) {
+        next = rq->idle;
+    }
+    if (next != prev) {
+        switch_to(rq, prev, next);
+    } else {
+        prev->state = TASK_RUNNING;
+        arm_slice(rq, prev);
+    }
+    cpu_irq_restore(flags);
+}
+
+// timer and kick interrupts end up here with irqs masked. nothing is switched
+// from inside the handler: the idle context, or a task whose slice is over
+// while another one waits, only gets need_resched set. otherwise the slice
+// timer is brought up to date
+void sched_tick() {
+    tcb_t* current = sched_current_task();
+    if (!current) {
+        return;
+    }
+    run_queue_t* rq = this_rq();
+    if (current == rq->idle || (rq->nr_ready && slice_expired(current))) {
+        rq->need_resched = 1;
+    } else {
+        arm_slice(rq, current);
+    }
+}
+
+// the one place an interrupt may preempt: called by irq_exit with irqs masked,
+// after the handlers and softirqs are done and the gic has seen its eoi. the
+// interrupted context's registers are on its own stack, so switching away
+// here resumes it through the same exception return later
+void sched_preempt_irq() {
+    run_queue_t* rq = this_rq();
+    if (rq->need_resched && sched_current_task()) {
+        sched_yield();
+    }
+}
+
+// whether the caller may sleep: it is a task, not a core's idle context
+int sched_can_block() {
+    uint64_t flags = cpu_irq_save();
+    tcb_t* current = sched_current_task();
+    int can_block = current && current != this_rq()->idle;
+    cpu_irq_restore(flags);
+    return can_block;
+}
+
+// lock the run queue a task is queued on, or would be queued on next. the
+// task may move between queues until the lock is held
+static run_queue_t* lock_task_rq(tcb_t* task) {
+    while (1) {
+        run_queue_t* rq = &run_queues[task->cpu];
+        spinlock_acquire(&rq->lock);
+        if (&run_queues[task->cpu] == rq) {
+            return rq;
+        }
+        spinlock_release(&rq->lock);
+    }
+}
+
+// first half of blocking: after this a sched_wake makes the task ready again,
+// so the caller can publish that it waits, recheck its condition and only
+// then call sched_block without missing a wakeup in between
+void sched_prepare_block() {
+    uint64_t flags = cpu_irq_save();
+    tcb_t* task = sched_current_task();
+    run_queue_t* rq = lock_task_rq(task);
+    task->state = TASK_BLOCKED;
+    spinlock_release(&rq->lock);
+    cpu_irq_restore(flags);
+}
+
+// second half: sleep until sched_wake, or return at once if the wakeup
+// already happened since sched_prepare_block
+void sched_block() {
+    sched_yield();
+}
+
+typedef struct {
+    tcb_t* task;
+    volatile uint32_t fired;
+} sleep_waiter_t;
+
+static void sleep_timer_fn(void* ctx) {
+    sleep_waiter_t* waiter = (sleep_waiter_t*)ctx;
+    waiter->fired = 1;
+    sched_wake(waiter->task);
+}
+
+// like sched_block, but give up once the counter reaches deadline. returns 0
+// when woken and -1 on timeout. the timeout is a coarse timer, as it is
+// usually cancelled
+int sched_block_until(uint64_t deadline) {
+    sleep_waiter_t waiter = { sched_current_task(), 0 };
+    hrtimer_t timer;
+    hrtimer_setup(&timer, sleep_timer_fn, &waiter, HRTIMER_COARSE);
+    hrtimer_start(&timer, deadline);
+    sched_block();
+    hrtimer_cancel(&timer);
+    return waiter.fired ? -1 : 0;
+}
+
+int sched_block_timeout(uint64_t ns) {
+    return sched_block_until(hrtimer_now() + hrtimer_ns_to_ticks(ns));
+}
+
+// block the calling task for at least ns nanoseconds, on a precise timer.
+// an unrelated sched_wake only makes it go back to sleep for the rest
+void sched_sleep_ns(uint64_t ns) {
+    uint64_t deadline = hrtimer_now() + hrtimer_ns_to_ticks(ns);
+    sleep_waiter_t waiter = { sched_current_task(), 0 };
+    hrtimer_t timer;
+    hrtimer_setup(&timer, sleep_timer_fn, &waiter, 0);
+    while (hrtimer_now() < deadline) {
+        sched_prepare_block();
+        hrtimer_start(&timer, deadline);
+        sched_block();
+        hrtimer_cancel(&timer);
+    }
+}
+
+// undo sched_prepare_block when the caller did not need to sleep after all.
+// a wakeup that already queued the task is taken back, as it is running
+void sched_cancel_block() {
+    uint64_t flags = cpu_irq_save();
+    tcb_t* task = sched_current_task();
+    run_queue_t* rq = lock_task_rq(task);
+    if (task->queued) {
+        dequeue_locked(rq, task);
+    }
+    task->state = TASK_RUNNING;
+    spinlock_release(&rq->lock);
+    cpu_irq_restore(flags);
+}
+
+// make a blocked task ready on the core it blocked on. blocking counts as
+// interactive behaviour, so it climbs back towards its base priority
+void sched_wake(tcb_t* task) {
+    uint64_t flags = cpu_irq_save();
+    run_queue_t* rq = lock_task_rq(task);
+    int woken = (task->state == TASK_BLOCKED);
+    if (woken) {
+        if (task->priority >= task->base_priority + SCHED_WAKE_BOOST) {
+            task->priority -= SCHED_WAKE_BOOST;
+        } else {
+            task->priority = task->base_priority;
+        }
+        task->state = TASK_READY;
+        enqueue_locked(rq, task);
+    }
+    spinlock_release(&rq->lock);
+    if (woken) {
+        notify_queue(rq);
+    }
+    cpu_irq_restore(flags);
+}
+
+// set a task's base priority, 0 being the most urgent. its feedback penalty
+// is dropped, and a queued task moves to its new level at once
+int sched_set_priority(tcb_t* task, uint32_t priority) {
+    if (!task || priority >= SCHED_PRIO_LEVELS) {
+        return -1;
+    }
+    uint64_t flags = cpu_irq_save();
+    run_queue_t* rq = lock_task_rq(task);
+    if (task->queued) {
+        dequeue_locked(rq, task);
+        task->base_priority = priority;
+        task->priority = priority;
+        enqueue_locked(rq, task);
+    } else {
+        task->base_priority = priority;
+        task->priority = priority;
+    }
+    spinlock_release(&rq->lock);
+    cpu_irq_restore(flags);
+    return 0;
+}
+
+// this core becomes a scheduler core: its current context is the idle task,
+// which runs whatever is ready and otherwise sleeps in wfi until an interrupt.
+// the queue is checked with irqs masked, a pending one still ends the wfi
+static void run_idle(uint64_t core) {
+    run_queue_t* rq = &run_queues[core];
+    gic_init_cpu();
+    gic_enable_irq(SCHED_KICK_SGI);
+    timer_init_cpu();
+    softirq_init_cpu();
+    fpsimd_init_cpu();
+    asm volatile("msr tpidr_el1, %0" : : "r"(rq->idle) : "memory");
+    rq->online = 1;
+    cpu_set_state(CPU_STATE_RUNNING);
+    cpu_enable_interrupts();
+    while (1) {
+        sched_yield();
+        uint64_t flags = cpu_irq_save();
+        if (!rq->nr_ready) {
+            rq->idling = 1;
+            cpu_wfi();
+            rq->idling = 0;
+        }
+        cpu_irq_restore(flags);
+    }
+}
+
+// enter the scheduler on the boot core and let the secondaries in; never returns
+void sched_schedule() {
+    cpu_disable_interrupts();
+    uint64_t core = cpu_get_core_id();
+    __atomic_store_n(&sched_started, 1, __ATOMIC_RELEASE);
+    cpu_sev();
+    run_idle(core);
+}
+
+// secondary cores wait here until the boot core has set the scheduler up
+void sched_start_secondary() {
+    while (!__atomic_load_n(&sched_started, __ATOMIC_ACQUIRE)) {
+        cpu_wfe();
+    }
+    run_idle(cpu_get_core_id());
+}
+
+// first code of every new task, reached through its initial lr
+static void task_start() {
+    finish_switch();
+    cpu_enable_interrupts();
+    tcb_t* task = sched_current_task();
+    task->entry();
+    sched_exit();
+}
+
+// stop the calling task for good; it is never queued again, and the core
+// that switches away from it hands its id and bundle to a worker
+void sched_exit() {
+    cpu_disable_interrupts();
+    sched_current_task()->state = TASK_DEAD;
+    sched_yield();
+    while (1);
+}
+
+// build a task that starts at func, in an empty address space or in a
+// copy-on-write clone of parent
+static int create_task_in(void (*func)(), uint64_t stack_size, vm_space_t* parent) {
+    tcb_t* new_task = alloc_bundle(pmm_order_for_size(stack_size));
+    if (!new_task) {
+        return -1;
+    }
+    if (parent && vm_space_clone_into(parent, new_task->space) != 0) {
+        recycle_bundle(new_task);
+        return -1;
+    }
+    // a pooled bundle keeps its resources, everything else starts from zero
+    uint64_t stack_base = new_task->stack_base;
+    stack_size = new_task->stack_size;
+    vm_space_t* space = new_task->space;
+    arena_t scratch = new_task->scratch;
+    fpsimd_state_t* fpsimd = new_task->fpsimd;
+    memset(new_task, 0, sizeof(tcb_t));
+    new_task->stack_base = stack_base;
     new_task->stack_size = stack_size;
+    new_task->space = space;
+    new_task->scratch = scratch;
+    new_task->fpsimd = fpsimd;
+    new_task->fpsimd_cpu = FPSIMD_CPU_NONE;
+    if (task_table_insert(new_task) != 0) {
+        recycle_bundle(new_task);
+        return -1;
+    }
+    __atomic_add_fetch(&num_tasks, 1, __ATOMIC_RELAXED);
 
     new_task->context.sp = new_task->stack_base + stack_size - 16;
-    new_task->context.lr = (uint64_t)func;
+    new_task->context.lr = (uint64_t)task_start;
+    new_task->entry = func;
+    new_task->base_priority = SCHED_PRIO_DEFAULT;
+    new_task->priority = SCHED_PRIO_DEFAULT;
     new_task->context.fp = new_task->stack_base + stack_size - 16;
-    new_task->ttbr0_el1 = vm_create_task_pagetable();
-    if (!new_task->ttbr0_el1) {
-        kfree((void*)new_task->stack_base);
-        kfree(new_task);
-        return;
-    }
+    new_task->ttbr0_el1 = space->root_pa;
 
     sched_add_task(new_task);
+    return 0;
+}
+
+int sched_create_task(void (*func)(), uint64_t stack_size) {
+    return create_task_in(func, stack_size, 0);
 }
 
+// spawn a task that starts at func in a copy-on-write clone of the caller's
+// address space, so no user page is copied until one side writes it
+int sched_fork_task(void (*func)(), uint64_t stack_size) {
+    tcb_t* current = sched_current_task();
+    if (!current || !current->space) {
+        return -1;
+    }
+    return create_task_in(func, stack_size, current->space);
+}
 
+// the live task with an id, or 0. the task may exit at any time after this
+// returns unless the caller knows it cannot
+tcb_t* sched_get_task(uint32_t id) {
+    uint64_t flags = spinlock_acquire_irqsave(&task_table_lock);
+    tcb_t* task = id < next_unused_id ? task_table[id] : 0;
+    spinlock_release_irqrestore(&task_table_lock, flags);
+    return task;
+}
+
+// tasks created and not yet released after exiting
+uint32_t sched_task_count() {
+    return __atomic_load_n(&num_tasks, __ATOMIC_RELAXED);
+}
+
+// the running task lives in tpidr_el1, so reading it needs no lock and
+// stays right across migration
+tcb_t* sched_current_task() {
+    tcb_t* task;
+    asm volatile("mrs %0, tpidr_el1" : "=r"(task));
+    return task;
+}
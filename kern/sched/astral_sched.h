@@ -4,8 +4,17 @@
 typedef unsigned long long uint64_t;
 typedef unsigned int uint32_t;
 
-#define MAX_TASKS 8
+#include "../memory/arena.h"
+#include "../memory/vm_maps.h"
+#include "spinlock.h"
+#include "workqueue.h"
 
+// priorities run from 0 (most urgent) to SCHED_PRIO_LEVELS - 1
+#define SCHED_PRIO_LEVELS   64
+#define SCHED_PRIO_DEFAULT  32
+
+// what context_switch keeps across a voluntary switch: the callee-saved
+// registers. the offsets are mirrored in context_switch.s
 typedef struct {
     uint64_t sp;
     uint64_t lr;
@@ -22,28 +31,86 @@ typedef struct {
     uint64_t fp;
 } cpu_context_t;
 
-typedef struct {
+_Static_assert(sizeof(cpu_context_t) == 104, "cpu_context_t must match context_switch.s");
+
+void context_switch(cpu_context_t* old_context, cpu_context_t* new_context);
+
+// task states; a ready task sits in exactly one run queue
+#define TASK_READY   0
+#define TASK_RUNNING 1
+#define TASK_DEAD    2
+#define TASK_BLOCKED 3 // off every queue until sched_wake
+
+typedef struct tcb {
     uint32_t id;
     cpu_context_t context;
     uint32_t state;
     uint64_t stack_base;
     uint64_t stack_size;
-    uint64_t ttbr0_el1; // page table base register for this task
+    uint64_t ttbr0_el1; // root table | asid << 48, refreshed on every switch
+    vm_space_t* space;  // address space the task runs in
+    arena_t scratch;    // per-task scratch memory, see arena_scratch()
+    void (*entry)();    // where the task starts running
+    volatile uint32_t on_cpu; // set from switch-in until its context is saved on switch-out
+    uint32_t cpu;       // core whose run queue it was last on
+    uint32_t queued;    // linked into run_queues[cpu]
+    uint32_t base_priority; // set by sched_set_priority
+    uint32_t priority;      // base_priority plus the feedback penalty
+    uint64_t slice_start;   // counter value when it was last switched in
+    struct fpsimd_state* fpsimd;     // saved fp/simd registers, allocated on first use
+    volatile uint32_t fpsimd_cpu;    // core whose registers hold its live state, see fpsimd.h
+    uint32_t fpsimd_valid;           // fpsimd holds a saved state
+    struct tcb* next;   // run queue links
+    struct tcb* prev;
 } tcb_t;
 
 typedef struct {
-    volatile uint32_t lock;
-} spinlock_t;
+    tcb_t* head;
+    tcb_t* tail;
+} task_list_t;
 
-void spinlock_init(spinlock_t* lock);
-void spinlock_acquire(spinlock_t* lock);
-void spinlock_release(spinlock_t* lock);
+// one per core: a fifo per priority level and a bitmap of the non-empty
+// levels, level p at bit 63 - p, so clz finds the most urgent one. the owner
+// pops from the heads; other cores steal from the tail of the least urgent
+// level. each queue has its own lock, so cores only meet when one steals or balances
+typedef struct {
+    spinlock_t lock;
+    uint64_t ready_bitmap;
+    task_list_t levels[SCHED_PRIO_LEVELS];
+    volatile uint32_t nr_ready; // tasks waiting in the queue, read unlocked as a load hint
+    uint32_t online;            // core is running the scheduler
+    volatile uint32_t idling;   // core sleeps in wfi with nothing to run
+    volatile uint32_t need_resched; // set by interrupt handlers, acted on at irq exit
+    tcb_t* idle;                // the core's boot context, run when nothing else is ready
+    tcb_t* prev;                // task switched away from, released once its context is saved
+    tcb_t* dead;                // exited tasks waiting for reap_work, linked through next
+    work_t reap_work;           // gives their ids and bundles back from a worker task
+    uint64_t next_balance;      // counter value at which to balance next
+    uint64_t next_boost;        // counter value at which queued tasks lose their feedback penalty
+} run_queue_t;
 
 void sched_init();
 void sched_add_task(tcb_t* task);
 void sched_schedule();
+void sched_start_secondary();
 void sched_yield();
-void sched_create_task(void (*func)(), uint64_t stack_size);
+void sched_tick();
+void sched_preempt_irq();
+void sched_exit();
+void sched_prepare_block();
+void sched_block();
+int sched_can_block();
+int sched_block_until(uint64_t deadline);
+int sched_block_timeout(uint64_t ns);
+void sched_cancel_block();
+void sched_sleep_ns(uint64_t ns);
+void sched_wake(tcb_t* task);
+int sched_set_priority(tcb_t* task, uint32_t priority);
+int sched_create_task(void (*func)(), uint64_t stack_size);
+int sched_fork_task(void (*func)(), uint64_t stack_size);
+tcb_t* sched_get_task(uint32_t id);
+uint32_t sched_task_count();
+tcb_t* sched_current_task();
 
 #endif
 
@@ -0,0 +1,87 @@
+#include "softirq.h"
+#include "cpu.h"
+#include "gic.h"
+#include "kprintf.h"
+#include "astral_sched.h"
+
+static softirq_fn softirq_handlers[SOFTIRQ_COUNT];
+
+// bits are set by handlers on their own core with irqs masked, and taken by
+// the same core, so no lock is needed
+static volatile uint32_t softirq_pending[MAX_CORES];
+// the core is inside run_softirqs, an interrupt nested in it leaves the exit
+// work to the outer one
+static uint32_t softirq_active[MAX_CORES];
+
+static void softirq_sgi(uint32_t irq) {
+    (void)irq;
+}
+
+void softirq_init() {
+    for (uint32_t nr = 0; nr < SOFTIRQ_COUNT; nr++) {
+        softirq_handlers[nr] = 0;
+    }
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        softirq_pending[core] = 0;
+        softirq_active[core] = 0;
+    }
+    gic_register(SOFTIRQ_SGI, softirq_sgi);
+}
+
+void softirq_init_cpu() {
+    gic_enable_irq(SOFTIRQ_SGI);
+}
+
+int softirq_register(uint32_t nr, softirq_fn fn) {
+    if (nr >= SOFTIRQ_COUNT) {
+        kprintf("softirq: cannot register softirq %d\n", (int)nr);
+        return -1;
+    }
+    softirq_handlers[nr] = fn;
+    return 0;
+}
+
+// mark a softirq pending on this core; it runs at the next irq exit
+void softirq_raise(uint32_t nr) {
+    uint64_t flags = cpu_irq_save();
+    softirq_pending[cpu_get_core_id()] |= 1U << nr;
+    cpu_irq_restore(flags);
+}
+
+// run what is pending with irqs enabled. bits raised meanwhile are picked up
+// in another round, up to SOFTIRQ_MAX_ROUNDS, and after that deferred to the
+// next exit through a self-sgi. called and returns with irqs masked
+static void run_softirqs(uint32_t core) {
+    softirq_active[core] = 1;
+    for (uint32_t round = 0; round < SOFTIRQ_MAX_ROUNDS && softirq_pending[core]; round++) {
+        uint32_t pending = softirq_pending[core];
+        softirq_pending[core] = 0;
+        cpu_enable_interrupts();
+        while (pending) {
+            uint32_t nr = (uint32_t)__builtin_ctz(pending);
+            pending &= pending - 1;
+            if (softirq_handlers[nr]) {
+                softirq_handlers[nr]();
+            }
+        }
+        cpu_disable_interrupts();
+    }
+    if (softirq_pending[core]) {
+        gic_send_sgi(core, SOFTIRQ_SGI);
+    }
+    softirq_active[core] = 0;
+}
+
+// the tail of every el1 interrupt, after gic_handle_irq: first the deferred
+// softirq work, then a reschedule if a handler asked for one. the core cannot
+// change before the reschedule, so one id is good for the whole exit
+void irq_exit() {
+    uint32_t core = cpu_get_core_id();
+    if (softirq_active[core]) {
+        return;
+    }
+    if (softirq_pending[core]) {
+        run_softirqs(core);
+    }
+    sched_preempt_irq();
+}
@@ -0,0 +1,27 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// deferred halves of interrupt handlers. a handler only acknowledges its
+// device and raises a softirq; the softirq runs on the same core at irq exit,
+// with irqs enabled again, so other interrupts are not held off while it
+// works. every core keeps its own pending bitmap, a bit per softirq number
+#define SOFTIRQ_TIMER 0 // expired hrtimers
+#define SOFTIRQ_COUNT 8
+
+// sent to the own core when softirqs are left over after SOFTIRQ_MAX_ROUNDS,
+// so they run at the next exit instead of starving the interrupted context
+#define SOFTIRQ_SGI 1
+#define SOFTIRQ_MAX_ROUNDS 4
+
+typedef void (*softirq_fn)();
+
+void softirq_init();
+void softirq_init_cpu();
+int softirq_register(uint32_t nr, softirq_fn fn);
+void softirq_raise(uint32_t nr);
+void irq_exit();
+
+#endif // SOFTIRQ_H
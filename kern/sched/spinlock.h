@@ -0,0 +1,19 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// ticket lock: the low half is the ticket being served, the high half the
+// next one to hand out. zero is unlocked
+typedef struct {
+    volatile uint32_t lock;
+} spinlock_t;
+
+void spinlock_init(spinlock_t* lock);
+void spinlock_acquire(spinlock_t* lock);
+void spinlock_release(spinlock_t* lock);
+uint64_t spinlock_acquire_irqsave(spinlock_t* lock);
+void spinlock_release_irqrestore(spinlock_t* lock, uint64_t flags);
+
+#endif // SPINLOCK_H
@@ -0,0 +1,219 @@
+#include "sync.h"
+#include "cpu.h"
+#include "kprintf.h"
+#include "hrtimer.h"
+
+void wait_queue_init(wait_queue_t* queue) {
+    spinlock_init(&queue->lock);
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+// mark the calling task as about to sleep, then publish it on the queue.
+// in this order a waker that finds the entry always makes the task ready
+void wait_prepare(wait_queue_t* queue, wait_entry_t* entry) {
+    entry->task = sched_current_task();
+    entry->woken = 0;
+    sched_prepare_block();
+    uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+    entry->next = 0;
+    entry->prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->next = entry;
+    } else {
+        queue->head = entry;
+    }
+    queue->tail = entry;
+    spinlock_release_irqrestore(&queue->lock, flags);
+}
+
+static void unlink_locked(wait_queue_t* queue, wait_entry_t* entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        queue->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        queue->tail = entry->prev;
+    }
+    entry->next = 0;
+    entry->prev = 0;
+}
+
+// leave the queue, whether the task slept or not. returns 1 if a wake picked
+// this entry; a caller that gives up anyway should pass that wake on
+int wait_finish(wait_queue_t* queue, wait_entry_t* entry) {
+    uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+    if (!entry->woken) {
+        unlink_locked(queue, entry);
+    }
+    spinlock_release_irqrestore(&queue->lock, flags);
+    sched_cancel_block();
+    return entry->woken;
+}
+
+// the task is woken under the queue lock, so its entry, which may live on
+// its stack, stays valid until sched_wake is done
+static int wake_locked(wait_queue_t* queue) {
+    wait_entry_t* entry = queue->head;
+    if (!entry) {
+        return 0;
+    }
+    unlink_locked(queue, entry);
+    entry->woken = 1;
+    sched_wake(entry->task);
+    return 1;
+}
+
+// wake the longest waiting task; returns whether there was one
+int wait_queue_wake_one(wait_queue_t* queue) {
+    uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+    int woken = wake_locked(queue);
+    spinlock_release_irqrestore(&queue->lock, flags);
+    return woken;
+}
+
+int wait_queue_wake_all(wait_queue_t* queue) {
+    uint64_t flags = spinlock_acquire_irqsave(&queue->lock);
+    int woken = 0;
+    while (wake_locked(queue)) {
+        woken++;
+    }
+    spinlock_release_irqrestore(&queue->lock, flags);
+    return woken;
+}
+
+void mutex_init(mutex_t* mutex) {
+    mutex->locked = 0;
+    mutex->owner = 0;
+    wait_queue_init(&mutex->waiters);
+}
+
+int mutex_trylock(mutex_t* mutex) {
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&mutex->locked, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    mutex->owner = sched_current_task();
+    return 1;
+}
+
+// an uncontended lock is one compare-and-swap. a contended one queues first
+// and retries before sleeping, so an unlock in between always finds it
+void mutex_lock(mutex_t* mutex) {
+    while (!mutex_trylock(mutex)) {
+        wait_entry_t entry;
+        wait_prepare(&mutex->waiters, &entry);
+        int acquired = mutex_trylock(mutex);
+        if (!acquired) {
+            sched_block();
+        }
+        wait_finish(&mutex->waiters, &entry);
+        if (acquired) {
+            return;
+        }
+    }
+}
+
+void mutex_unlock(mutex_t* mutex) {
+    if (mutex->owner != sched_current_task()) {
+        kprintf("mutex_unlock: not the owner\n");
+    }
+    mutex->owner = 0;
+    __atomic_store_n(&mutex->locked, 0, __ATOMIC_RELEASE);
+    wait_queue_wake_one(&mutex->waiters);
+}
+
+void semaphore_init(semaphore_t* sem, int32_t count) {
+    sem->count = count;
+    wait_queue_init(&sem->waiters);
+}
+
+int semaphore_trydown(semaphore_t* sem) {
+    int32_t count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// a woken waiter can still lose the count to a newcomer and just waits again
+static int semaphore_down_until(semaphore_t* sem, uint64_t deadline, int timed) {
+    while (!semaphore_trydown(sem)) {
+        wait_entry_t entry;
+        wait_prepare(&sem->waiters, &entry);
+        int taken = semaphore_trydown(sem);
+        int timed_out = 0;
+        if (!taken) {
+            if (timed) {
+                timed_out = sched_block_until(deadline) != 0;
+            } else {
+                sched_block();
+            }
+        }
+        wait_finish(&sem->waiters, &entry);
+        if (taken) {
+            return 0;
+        }
+        if (timed_out) {
+            return semaphore_trydown(sem) ? 0 : -1;
+        }
+    }
+    return 0;
+}
+
+void semaphore_down(semaphore_t* sem) {
+    semaphore_down_until(sem, 0, 0);
+}
+
+// returns 0 once the count was taken, -1 if ns passed first
+int semaphore_down_timeout(semaphore_t* sem, uint64_t ns) {
+    return semaphore_down_until(sem, hrtimer_now() + hrtimer_ns_to_ticks(ns), 1);
+}
+
+void semaphore_up(semaphore_t* sem) {
+    __atomic_add_fetch(&sem->count, 1, __ATOMIC_RELEASE);
+    wait_queue_wake_one(&sem->waiters);
+}
+
+void condvar_init(condvar_t* cond) {
+    wait_queue_init(&cond->waiters);
+}
+
+// the task is queued before the mutex is dropped, so a signal sent by the
+// next holder cannot be missed. callers recheck their condition in a loop
+static int condvar_wait_until(condvar_t* cond, mutex_t* mutex, uint64_t deadline, int timed) {
+    wait_entry_t entry;
+    wait_prepare(&cond->waiters, &entry);
+    mutex_unlock(mutex);
+    int timed_out = 0;
+    if (timed) {
+        timed_out = sched_block_until(deadline) != 0;
+    } else {
+        sched_block();
+    }
+    int woken = wait_finish(&cond->waiters, &entry);
+    mutex_lock(mutex);
+    return (timed_out && !woken) ? -1 : 0;
+}
+
+void condvar_wait(condvar_t* cond, mutex_t* mutex) {
+    condvar_wait_until(cond, mutex, 0, 0);
+}
+
+// returns -1 if ns passed without a signal; the mutex is held again either way
+int condvar_wait_timeout(condvar_t* cond, mutex_t* mutex, uint64_t ns) {
+    return condvar_wait_until(cond, mutex, hrtimer_now() + hrtimer_ns_to_ticks(ns), 1);
+}
+
+void condvar_signal(condvar_t* cond) {
+    wait_queue_wake_one(&cond->waiters);
+}
+
+void condvar_broadcast(condvar_t* cond) {
+    wait_queue_wake_all(&cond->waiters);
+}
@@ -0,0 +1,71 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+typedef int int32_t;
+
+#include "astral_sched.h"
+
+// sleeping synchronization. a waiter gives its core away through
+// sched_prepare_block/sched_block instead of spinning, and only the short
+// list updates happen under a spinlock. all of these are zero-initialized to
+// a ready state, so static ones need no init call. blocking is for tasks
+// only; waking also works from interrupt handlers
+
+// one waiting task, usually on the waiter's stack
+typedef struct wait_entry {
+    tcb_t* task;
+    volatile uint32_t woken; // picked by a wake, rather than a timeout or a spurious wakeup
+    struct wait_entry* next;
+    struct wait_entry* prev;
+} wait_entry_t;
+
+typedef struct {
+    spinlock_t lock;
+    wait_entry_t* head;
+    wait_entry_t* tail;
+} wait_queue_t;
+
+typedef struct {
+    volatile uint32_t locked;
+    tcb_t* owner;
+    wait_queue_t waiters;
+} mutex_t;
+
+typedef struct {
+    volatile int32_t count;
+    wait_queue_t waiters;
+} semaphore_t;
+
+typedef struct {
+    wait_queue_t waiters;
+} condvar_t;
+
+// the waiting pattern: wait_prepare, check the condition, sched_block or
+// sched_block_timeout if it does not hold yet, then wait_finish. a wake that
+// arrives anywhere in between is not lost
+void wait_queue_init(wait_queue_t* queue);
+void wait_prepare(wait_queue_t* queue, wait_entry_t* entry);
+int wait_finish(wait_queue_t* queue, wait_entry_t* entry);
+int wait_queue_wake_one(wait_queue_t* queue);
+int wait_queue_wake_all(wait_queue_t* queue);
+
+void mutex_init(mutex_t* mutex);
+void mutex_lock(mutex_t* mutex);
+int mutex_trylock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+
+void semaphore_init(semaphore_t* sem, int32_t count);
+void semaphore_down(semaphore_t* sem);
+int semaphore_down_timeout(semaphore_t* sem, uint64_t ns);
+int semaphore_trydown(semaphore_t* sem);
+void semaphore_up(semaphore_t* sem);
+
+void condvar_init(condvar_t* cond);
+void condvar_wait(condvar_t* cond, mutex_t* mutex);
+int condvar_wait_timeout(condvar_t* cond, mutex_t* mutex, uint64_t ns);
+void condvar_signal(condvar_t* cond);
+void condvar_broadcast(condvar_t* cond);
+
+#endif // SYNC_H
@@ -0,0 +1,83 @@
+#include "workqueue.h"
+#include "sync.h"
+#include "kprintf.h"
+
+// one fifo shared by all workers, so a task on any core can pick up work
+static spinlock_t work_lock;
+static work_t* volatile work_head; // read unlocked by a worker about to sleep
+static work_t* work_tail;
+static wait_queue_t work_waiters;
+
+void work_init(work_t* work, work_fn fn, void* ctx) {
+    work->fn = fn;
+    work->ctx = ctx;
+    work->pending = 0;
+    work->next = 0;
+}
+
+// returns 1 if the work was queued, 0 if it was still pending. safe from
+// interrupt handlers and softirqs
+int work_queue(work_t* work) {
+    uint64_t flags = spinlock_acquire_irqsave(&work_lock);
+    if (work->pending) {
+        spinlock_release_irqrestore(&work_lock, flags);
+        return 0;
+    }
+    work->pending = 1;
+    work->next = 0;
+    if (work_tail) {
+        work_tail->next = work;
+    } else {
+        work_head = work;
+    }
+    work_tail = work;
+    spinlock_release_irqrestore(&work_lock, flags);
+    wait_queue_wake_one(&work_waiters);
+    return 1;
+}
+
+static work_t* work_pop() {
+    uint64_t flags = spinlock_acquire_irqsave(&work_lock);
+    work_t* work = work_head;
+    if (work) {
+        work_head = work->next;
+        if (!work_head) {
+            work_tail = 0;
+        }
+        // cleared before it runs, so the function may queue itself again
+        work->pending = 0;
+    }
+    spinlock_release_irqrestore(&work_lock, flags);
+    return work;
+}
+
+static void worker_main() {
+    while (1) {
+        work_t* work = work_pop();
+        if (work) {
+            work->fn(work->ctx);
+            continue;
+        }
+        wait_entry_t entry;
+        wait_prepare(&work_waiters, &entry);
+        if (!work_head) {
+            sched_block();
+        }
+        wait_finish(&work_waiters, &entry);
+    }
+}
+
+// start the worker tasks; call once after sched_init
+int workqueue_init(uint32_t workers) {
+    spinlock_init(&work_lock);
+    work_head = 0;
+    work_tail = 0;
+    wait_queue_init(&work_waiters);
+    for (uint32_t i = 0; i < workers; i++) {
+        if (sched_create_task(worker_main, WORKQUEUE_STACK_SIZE) < 0) {
+            kprintf("workqueue: could not start worker %d\n", (int)i);
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// work that has to sleep or take long, handed from interrupt handlers and
+// softirqs to a pool of kernel worker tasks. an item is queued at most once
+// at a time; queueing it again before its function started is a no-op, so a
+// burst of completions is handled by one run
+typedef void (*work_fn)(void* ctx);
+
+typedef struct work {
+    work_fn fn;
+    void* ctx;
+    volatile uint32_t pending; // queued and not yet started
+    struct work* next;
+} work_t;
+
+#define WORKQUEUE_STACK_SIZE 0x4000
+
+void work_init(work_t* work, work_fn fn, void* ctx);
+int work_queue(work_t* work);
+int workqueue_init(uint32_t workers);
+
+#endif // WORKQUEUE_H